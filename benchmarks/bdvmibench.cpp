@@ -0,0 +1,597 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include <bdvmi/eventhandler.h>
+#include <bdvmi/mockdriver.h>
+#include <bdvmi/mockeventmanager.h>
+#include <bdvmi/xencache.h>
+#include <bdvmi/xeneventmanager.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+ * Microbenchmarks for the paths every event goes through, run against the mock backend. Each
+ * one runs for at least the minimum time (-t, in milliseconds) and reports the time and heap
+ * allocations per operation. Only the benchmarks whose names contain one of the command line
+ * arguments run, if there are any.
+ */
+
+namespace { // Anonymous namespace
+
+volatile unsigned long allocations;
+volatile uint64_t sink; // keeps results from being optimized away
+
+uint64_t nowNs()
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return static_cast<uint64_t>( ts.tv_sec ) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Only the parts between start() and stop() count
+class Stopwatch {
+
+public:
+	Stopwatch() : ns_( 0 ), allocs_( 0 ), startNs_( 0 ), startAllocs_( 0 )
+	{
+	}
+
+	void start()
+	{
+		startAllocs_ = allocations;
+		startNs_ = nowNs();
+	}
+
+	void stop()
+	{
+		ns_ += nowNs() - startNs_;
+		allocs_ += allocations - startAllocs_;
+	}
+
+	uint64_t ns() const
+	{
+		return ns_;
+	}
+
+	unsigned long allocs() const
+	{
+		return allocs_;
+	}
+
+private:
+	uint64_t ns_;
+	unsigned long allocs_;
+	uint64_t startNs_;
+	unsigned long startAllocs_;
+};
+
+class Benchmark {
+
+public:
+	Benchmark( const char *name ) : name_( name )
+	{
+	}
+
+	virtual ~Benchmark()
+	{
+	}
+
+public:
+	const char *name() const
+	{
+		return name_;
+	}
+
+	// Do ops operations, timing them with sw
+	virtual void run( unsigned long ops, Stopwatch &sw ) = 0;
+
+private:
+	const char *name_;
+};
+
+void measure( Benchmark &b, uint64_t minNs )
+{
+	unsigned long ops = 1;
+
+	for ( ;; ) {
+		Stopwatch sw;
+
+		b.run( ops, sw );
+
+		if ( sw.ns() >= minNs || ops >= ( 1UL << 30 ) ) {
+			printf( "%-24s %12lu %12.1f %12.2f\n", b.name(), ops, static_cast<double>( sw.ns() ) / ops,
+			        static_cast<double>( sw.allocs() ) / ops );
+			fflush( stdout );
+			return;
+		}
+
+		// Aim a bit past the minimum time
+		unsigned long next = sw.ns() ? static_cast<unsigned long>( 1.2 * ops * minNs / sw.ns() ) : ops * 100;
+
+		ops = min( max( next, ops * 2 ), ops * 100 );
+	}
+}
+
+// Pages come from the mock guest instead of Xen, copied into a mapping of their own (like the
+// ones xc_map_foreign_range() sets up)
+class MockPageCache : public bdvmi::XenPageCache {
+
+public:
+	MockPageCache( bdvmi::MockGuest &guest ) : guest_( guest )
+	{
+	}
+
+protected:
+	virtual void *mapPage( unsigned long gfn )
+	{
+		void *page = mmap( NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+		if ( page == MAP_FAILED )
+			return NULL;
+
+		guest_.read( static_cast<uint64_t>( gfn ) << bdvmi::MockGuest::PAGE_SHIFT, page, PAGE_SIZE );
+
+		return page;
+	}
+
+private:
+	enum { PAGE_SIZE = 4096 };
+
+	bdvmi::MockGuest &guest_;
+};
+
+// All the pages are already in the cache
+class PageCacheHit : public Benchmark {
+
+public:
+	PageCacheHit( bdvmi::MockGuest &guest ) : Benchmark( "page_cache_hit" ), guest_( guest )
+	{
+	}
+
+	virtual void run( unsigned long ops, Stopwatch &sw )
+	{
+		MockPageCache cache( guest_ );
+		void *p;
+
+		for ( unsigned long gfn = 0; gfn < PAGES; ++gfn ) {
+			cache.update( gfn, p );
+			cache.release( p );
+		}
+
+		sw.start();
+
+		for ( unsigned long i = 0; i < ops; ++i ) {
+			cache.update( i % PAGES, p );
+			cache.release( p );
+		}
+
+		sw.stop();
+	}
+
+private:
+	enum { PAGES = 512 };
+
+	bdvmi::MockGuest &guest_;
+};
+
+// Every access is to a page not in the cache, with evictions whenever it fills up
+class PageCacheMiss : public Benchmark {
+
+public:
+	PageCacheMiss( bdvmi::MockGuest &guest ) : Benchmark( "page_cache_miss" ), guest_( guest )
+	{
+	}
+
+	virtual void run( unsigned long ops, Stopwatch &sw )
+	{
+		MockPageCache cache( guest_ );
+		void *p;
+
+		sw.start();
+
+		for ( unsigned long i = 0; i < ops; ++i ) {
+			if ( cache.update( i % PAGES, p ) == bdvmi::MAP_SUCCESS )
+				cache.release( p );
+		}
+
+		sw.stop();
+	}
+
+private:
+	enum { PAGES = 64 * 1024 };
+
+	bdvmi::MockGuest &guest_;
+};
+
+// Only the update() calls that find the cache full, i.e. mostly the eviction
+class PageCacheEviction : public Benchmark {
+
+public:
+	PageCacheEviction( bdvmi::MockGuest &guest ) : Benchmark( "page_cache_eviction" ), guest_( guest )
+	{
+	}
+
+	virtual void run( unsigned long ops, Stopwatch &sw )
+	{
+		MockPageCache cache( guest_ );
+		unsigned long gfn = 0;
+		unsigned long fill = LIMIT; // until the next update() evicts
+		void *p;
+
+		for ( unsigned long i = 0; i < ops; ++i ) {
+			for ( ; fill; --fill, ++gfn ) {
+				if ( cache.update( gfn % PAGES, p ) == bdvmi::MAP_SUCCESS )
+					cache.release( p );
+			}
+
+			sw.start();
+
+			if ( cache.update( gfn++ % PAGES, p ) == bdvmi::MAP_SUCCESS )
+				cache.release( p );
+
+			sw.stop();
+
+			// Half the pages are gone, and one has just been added
+			fill = LIMIT - LIMIT / 2 - 1;
+		}
+	}
+
+private:
+	enum { LIMIT = bdvmi::XenPageCache::MAX_CACHE_SIZE_DEFAULT, PAGES = 64 * 1024 };
+
+	bdvmi::MockGuest &guest_;
+};
+
+class CopyRegisters : public Benchmark {
+
+public:
+	CopyRegisters( bdvmi::MockGuest &guest ) : Benchmark( "copy_registers" )
+	{
+		bdvmi::XenEventManager::pageFaultRequest( req_, 0, guest.registers( 0 ), 0x100000, 0x400000, true,
+		                                          false );
+	}
+
+	virtual void run( unsigned long ops, Stopwatch &sw )
+	{
+		bdvmi::Registers regs;
+
+		sw.start();
+
+		for ( unsigned long i = 0; i < ops; ++i ) {
+			bdvmi::XenEventManager::requestRegisters( req_, regs );
+			sink = sink + regs.rip; // not +=, that is deprecated for volatiles from C++20 on
+		}
+
+		sw.stop();
+	}
+
+private:
+	mem_event_request_t req_;
+};
+
+// Page walk for every translation
+class TranslateWalk : public Benchmark {
+
+public:
+	TranslateWalk( bdvmi::MockDriver &driver ) : Benchmark( "translate_walk" ), driver_( driver )
+	{
+	}
+
+	virtual void run( unsigned long ops, Stopwatch &sw )
+	{
+		unsigned int pages = driver_.options().pages;
+		void *p;
+
+		sw.start();
+
+		for ( unsigned long i = 0; i < ops; ++i ) {
+			uint64_t gva = driver_.workingSetGva() + ( static_cast<uint64_t>( i % pages ) << 12 );
+
+			if ( driver_.mapVirtMemToHost( gva, 8, 0, 0, p ) == bdvmi::MAP_SUCCESS )
+				driver_.unmapVirtMem( p );
+		}
+
+		sw.stop();
+	}
+
+private:
+	bdvmi::MockDriver &driver_;
+};
+
+// Translations set up with cacheGuestVirtAddr()
+class TranslateCached : public Benchmark {
+
+public:
+	TranslateCached( bdvmi::MockDriver &driver ) : Benchmark( "translate_cached" ), driver_( driver )
+	{
+		for ( unsigned int i = 0; i < PAGES; ++i )
+			driver_.cacheGuestVirtAddr( driver_.workingSetGva() + ( static_cast<uint64_t>( i ) << 12 ) );
+	}
+
+	virtual void run( unsigned long ops, Stopwatch &sw )
+	{
+		void *p;
+
+		sw.start();
+
+		for ( unsigned long i = 0; i < ops; ++i ) {
+			uint64_t gva = driver_.workingSetGva() + ( static_cast<uint64_t>( i % PAGES ) << 12 );
+
+			if ( driver_.mapVirtMemToHost( gva, 8, 0, 0, p ) == bdvmi::MAP_SUCCESS )
+				driver_.unmapVirtMem( p );
+		}
+
+		sw.stop();
+	}
+
+private:
+	enum { PAGES = 64 };
+
+	bdvmi::MockDriver &driver_;
+};
+
+// Restricting, then restoring, access to a range of pages, one call per page. There's no batched
+// protection call in the Driver API (XenDriver makes one set_mem_access hypercall per page), so
+// this is what protecting a batch of pages costs, page by page.
+class PageProtection : public Benchmark {
+
+public:
+	PageProtection( bdvmi::MockDriver &driver ) : Benchmark( "page_protection" ), driver_( driver )
+	{
+	}
+
+	virtual void run( unsigned long ops, Stopwatch &sw )
+	{
+		unsigned int pages = driver_.options().pages;
+
+		sw.start();
+
+		for ( unsigned long i = 0; i < ops; ++i ) {
+			bool restore = ( i / pages ) & 1;
+
+			driver_.setPageProtection( driver_.workingSetGpa( i % pages ), true, restore, true );
+		}
+
+		sw.stop();
+
+		for ( unsigned int i = 0; i < pages; ++i )
+			driver_.setPageProtection( driver_.workingSetGpa( i ), true, true, true );
+	}
+
+private:
+	bdvmi::MockDriver &driver_;
+};
+
+class NullHandler : public bdvmi::EventHandler {
+
+public:
+	virtual void handleCR( unsigned short, unsigned short, const bdvmi::RegistersView &, uint64_t, uint64_t,
+	                       bdvmi::HVAction & )
+	{
+	}
+
+	virtual void handleMSR( unsigned short, uint32_t, uint64_t, uint64_t, bdvmi::HVAction & )
+	{
+	}
+
+	virtual void handlePageFault( unsigned short, const bdvmi::RegistersView &, uint64_t, uint64_t, bool, bool,
+	                              bool, bdvmi::HVAction &, uint8_t *, uint32_t &, unsigned short & )
+	{
+	}
+
+	virtual void handleVMCALL( unsigned short, const bdvmi::RegistersView &, uint64_t, uint64_t )
+	{
+	}
+
+	virtual void handleXSETBV( unsigned short, uint64_t )
+	{
+	}
+
+	virtual void handleSessionOver( bool )
+	{
+	}
+};
+
+// Requests going through the ring to the handler and back, from the mock hypervisor thread
+class RingTurnaround : public Benchmark {
+
+public:
+	RingTurnaround( const char *name, unsigned int vcpus ) : Benchmark( name ), vcpus_( vcpus )
+	{
+	}
+
+	virtual void run( unsigned long ops, Stopwatch &sw )
+	{
+		bdvmi::MockOptions options;
+
+		options.vcpus = vcpus_;
+		options.memorySize = 64ULL << 20;
+		options.pages = 64;
+		options.events = ops;
+
+		bdvmi::MockDriver driver( "bench", options );
+		NullHandler handler;
+
+		sw.start();
+
+		bdvmi::MockEventManager em( driver, bdvmi::EventManager::ENABLE_MEMORY );
+
+		em.handler( &handler );
+		em.waitForEvents();
+
+		sw.stop();
+	}
+
+private:
+	unsigned int vcpus_;
+};
+
+bool selected( const char *name, int argc, char *argv[] )
+{
+	if ( argc <= 0 )
+		return true;
+
+	for ( int i = 0; i < argc; ++i )
+		if ( strstr( name, argv[i] ) )
+			return true;
+
+	return false;
+}
+
+} // end of anonymous namespace
+
+// Count the heap allocations, through every replaceable allocation function. Dynamic exception
+// specifications are gone from C++17 on, which is what g++ defaults to nowadays.
+#if __cplusplus >= 201103L
+#define BENCH_THROWS_BAD_ALLOC
+#define BENCH_NOTHROW noexcept
+#else
+#define BENCH_THROWS_BAD_ALLOC throw( std::bad_alloc )
+#define BENCH_NOTHROW throw()
+#endif
+
+namespace { // Anonymous namespace
+
+void *countedAlloc( size_t size )
+{
+	__sync_add_and_fetch( &allocations, 1 );
+
+	return malloc( size ? size : 1 );
+}
+
+} // end of anonymous namespace
+
+void *operator new( size_t size ) BENCH_THROWS_BAD_ALLOC
+{
+	void *p = countedAlloc( size );
+
+	if ( !p )
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void *operator new[]( size_t size ) BENCH_THROWS_BAD_ALLOC
+{
+	void *p = countedAlloc( size );
+
+	if ( !p )
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void *operator new( size_t size, const std::nothrow_t & ) BENCH_NOTHROW
+{
+	return countedAlloc( size );
+}
+
+void *operator new[]( size_t size, const std::nothrow_t & ) BENCH_NOTHROW
+{
+	return countedAlloc( size );
+}
+
+void operator delete( void *p ) BENCH_NOTHROW
+{
+	free( p );
+}
+
+void operator delete[]( void *p ) BENCH_NOTHROW
+{
+	free( p );
+}
+
+void operator delete( void *p, const std::nothrow_t & ) BENCH_NOTHROW
+{
+	free( p );
+}
+
+void operator delete[]( void *p, const std::nothrow_t & ) BENCH_NOTHROW
+{
+	free( p );
+}
+
+#if __cplusplus >= 201402L
+void operator delete( void *p, size_t ) BENCH_NOTHROW
+{
+	free( p );
+}
+
+void operator delete[]( void *p, size_t ) BENCH_NOTHROW
+{
+	free( p );
+}
+#endif
+
+int main( int argc, char *argv[] )
+{
+	uint64_t minNs = 500000000ULL;
+	int opt;
+
+	while ( ( opt = getopt( argc, argv, "t:" ) ) != -1 ) {
+		if ( opt != 't' ) {
+			cerr << "Usage: " << argv[0] << " [-t min_ms] [benchmark ...]" << endl;
+			return -1;
+		}
+
+		minNs = strtoull( optarg, NULL, 10 ) * 1000000ULL;
+	}
+
+	try {
+		bdvmi::MockOptions options;
+
+		options.pages = 4096;
+
+		bdvmi::MockDriver driver( "bench", options );
+
+		PageCacheHit pageCacheHit( driver.guest() );
+		PageCacheMiss pageCacheMiss( driver.guest() );
+		PageCacheEviction pageCacheEviction( driver.guest() );
+		CopyRegisters copyRegisters( driver.guest() );
+		TranslateWalk translateWalk( driver );
+		TranslateCached translateCached( driver );
+		PageProtection pageProtection( driver );
+		RingTurnaround ringTurnaround( "ring_turnaround", 1 );
+		RingTurnaround ringTurnaround4( "ring_turnaround_4vcpus", 4 );
+
+		Benchmark *benchmarks[] = { &pageCacheHit,  &pageCacheMiss,   &pageCacheEviction,
+		                            &copyRegisters, &translateWalk,   &translateCached,
+		                            &pageProtection, &ringTurnaround, &ringTurnaround4 };
+
+		printf( "%-24s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op" );
+
+		for ( size_t i = 0; i < sizeof( benchmarks ) / sizeof( benchmarks[0] ); ++i )
+			if ( selected( benchmarks[i]->name(), argc - optind, argv + optind ) )
+				measure( *benchmarks[i], minNs );
+	}
+	catch ( const exception &e )
+	{
+		cerr << "Error: caught exception: " << e.what() << endl;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,475 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+#include <bdvmi/eventhandler.h>
+#include <bdvmi/histogram.h>
+#include <bdvmi/mockdriver.h>
+#include <bdvmi/mockeventmanager.h>
+#include <bdvmi/statspage.h>
+#include <bdvmi/xeneventreactor.h>
+#include <pthread.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+ * Event storm generator: N mock domains with M VCPUs each, injecting a mix of page fault, CR3
+ * write, MSR write and VMCALL requests (-m pf=80,cr=10,msr=5,vmcall=5) at a fixed rate per
+ * domain (or as fast as they're answered), handled by the regular XenEventManager code with a
+ * handler spending -w microseconds per event. Every interval it reports the throughput, the
+ * requests in flight, how far behind the injection schedule the domains are (the backlog) and
+ * the response latency percentiles, as seen by the guest VCPUs.
+ */
+
+namespace { // Anonymous namespace
+
+uint64_t nowNs()
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return static_cast<uint64_t>( ts.tv_sec ) * 1000000000ULL + ts.tv_nsec;
+}
+
+class LoadHandler : public bdvmi::EventHandler {
+
+public:
+	LoadHandler( uint64_t workNs ) : workNs_( workNs )
+	{
+	}
+
+public:
+	virtual void handleCR( unsigned short, unsigned short, const bdvmi::RegistersView &, uint64_t, uint64_t,
+	                       bdvmi::HVAction & )
+	{
+		work();
+	}
+
+	virtual void handleMSR( unsigned short, uint32_t, uint64_t, uint64_t, bdvmi::HVAction & )
+	{
+		work();
+	}
+
+	virtual void handlePageFault( unsigned short, const bdvmi::RegistersView &, uint64_t, uint64_t, bool, bool,
+	                              bool, bdvmi::HVAction &, uint8_t *, uint32_t &, unsigned short & )
+	{
+		work();
+	}
+
+	virtual void handleVMCALL( unsigned short, const bdvmi::RegistersView &, uint64_t, uint64_t )
+	{
+		work();
+	}
+
+	virtual void handleXSETBV( unsigned short, uint64_t )
+	{
+	}
+
+	virtual void handleSessionOver( bool )
+	{
+	}
+
+private:
+	// Busy, like a handler looking at guest memory would be
+	void work() const
+	{
+		if ( !workNs_ )
+			return;
+
+		uint64_t until = nowNs() + workNs_;
+
+		while ( nowNs() < until )
+			;
+	}
+
+private:
+	uint64_t workNs_;
+};
+
+struct Domain {
+	Domain( const string &name, const bdvmi::MockOptions &options, unsigned short flags )
+	    : driver( name, options ), em( driver, flags ), started( false )
+	{
+	}
+
+	bdvmi::MockDriver driver;
+	bdvmi::MockEventManager em;
+	pthread_t thread;
+	bool started;
+};
+
+void *domainMain( void *arg )
+{
+	try {
+		static_cast<Domain *>( arg )->em.waitForEvents();
+	}
+	catch ( const exception &e )
+	{
+		cerr << "Error: caught exception: " << e.what() << endl;
+	}
+
+	return NULL;
+}
+
+void *reactorMain( void *arg )
+{
+	try {
+		static_cast<bdvmi::XenEventReactor *>( arg )->run();
+	}
+	catch ( const exception &e )
+	{
+		cerr << "Error: caught exception: " << e.what() << endl;
+	}
+
+	return NULL;
+}
+
+// "pf=80,cr=10,msr=5,vmcall=5"
+bool parseMix( const char *mix, bdvmi::MockOptions &options )
+{
+	options.pageFaults = options.crWrites = options.msrWrites = options.vmcalls = 0;
+
+	string s( mix );
+	size_t pos = 0;
+
+	while ( pos < s.size() ) {
+		size_t end = s.find( ',', pos );
+
+		if ( end == string::npos )
+			end = s.size();
+
+		string item = s.substr( pos, end - pos );
+		size_t eq = item.find( '=' );
+
+		if ( eq == string::npos )
+			return false;
+
+		string type = item.substr( 0, eq );
+		unsigned int weight = strtoul( item.c_str() + eq + 1, NULL, 10 );
+
+		if ( type == "pf" )
+			options.pageFaults = weight;
+		else if ( type == "cr" )
+			options.crWrites = weight;
+		else if ( type == "msr" )
+			options.msrWrites = weight;
+		else if ( type == "vmcall" )
+			options.vmcalls = weight;
+		else
+			return false;
+
+		pos = end + 1;
+	}
+
+	return options.pageFaults + options.crWrites + options.msrWrites + options.vmcalls != 0;
+}
+
+void printHeader()
+{
+	printf( "%8s %12s %10s %10s %10s %10s %10s %10s\n", "time", "events/s", "inflight", "backlog", "p50_us",
+	        "p99_us", "p99.9_us", "max_us" );
+}
+
+void printLine( const char *label, double eventsPerSec, uint64_t inflight, uint64_t backlog,
+                const bdvmi::Histogram &latencies )
+{
+	printf( "%8s %12.0f %10llu %10llu %10.1f %10.1f %10.1f %10.1f\n", label, eventsPerSec,
+	        static_cast<unsigned long long>( inflight ), static_cast<unsigned long long>( backlog ),
+	        latencies.percentile( 50 ) / 1000.0, latencies.percentile( 99 ) / 1000.0,
+	        latencies.percentile( 99.9 ) / 1000.0, latencies.max() / 1000.0 );
+	fflush( stdout );
+}
+
+void printStat( const char *name, const bdvmi::Histogram &h, double scale )
+{
+	printf( "%-22s %12llu %10.1f %10.1f %10.1f %10.1f\n", name, static_cast<unsigned long long>( h.count() ),
+	        h.percentile( 50 ) / scale, h.percentile( 99 ) / scale, h.percentile( 99.9 ) / scale, h.max() / scale );
+}
+
+// Where the time went, on the library side (see EventManager::statistics())
+void printStatistics( const bdvmi::EventStatistics &stats )
+{
+	printf( "\n%-22s %12s %10s %10s %10s %10s\n", "library", "count", "p50", "p99", "p99.9", "max" );
+
+	for ( unsigned int i = 0; i < bdvmi::EventStatistics::EVENT_TYPES; ++i ) {
+		bdvmi::EventStatistics::EventType type = static_cast<bdvmi::EventStatistics::EventType>( i );
+
+		if ( !stats.requests[i] )
+			continue;
+
+		string name = string( bdvmi::EventStatistics::eventTypeName( type ) ) + " handler us";
+
+		printStat( name.c_str(), stats.handlerTime[i], 1000.0 );
+	}
+
+	printStat( "response us", stats.responseTime, 1000.0 );
+	printStat( "notify us", stats.notifyTime, 1000.0 );
+	printStat( "ring ack us", stats.ackLatency, 1000.0 );
+	printStat( "ring occupancy", stats.ringOccupancy, 1.0 );
+	printStat( "batch size", stats.batchSizes, 1.0 );
+	printf( "%llu filtered, %llu deadline misses, %llu late decisions\n",
+	        static_cast<unsigned long long>( stats.filtered ), static_cast<unsigned long long>( stats.deadlineMisses ),
+	        static_cast<unsigned long long>( stats.lateDecisions ) );
+	printf( "%llu shed by the overhead governor, %llu governor level changes\n",
+	        static_cast<unsigned long long>( stats.shed ), static_cast<unsigned long long>( stats.governorChanges ) );
+}
+
+void usage( const char *name )
+{
+	cerr << "Usage: " << name << " [-d domains] [-v vcpus] [-r rate_per_domain] [-s seconds] [-i interval_ms]"
+	     << endl
+	     << "\t[-m pf=N,cr=N,msr=N,vmcall=N] [-w handler_us] [-p workers] [-R] [-P pages] [-S]" << endl
+	     << "\t[-D deadline_us] [-G handler_cpu_percent]" << endl
+	     << "  -R  service all the domains from one thread (XenEventReactor), instead of one each" << endl
+	     << "  -D  answer events the handler hasn't decided on in time with NONE (needs -p)" << endl
+	     << "  -G  have the overhead governor cut down monitoring past this handler CPU usage" << endl
+	     << "  -S  publish the library's counters in the stats page (watch them with bdvmistat)" << endl;
+}
+
+} // end of anonymous namespace
+
+int main( int argc, char *argv[] )
+{
+	bdvmi::MockOptions options;
+	unsigned int domains = 1;
+	unsigned int seconds = 10;
+	unsigned int intervalMs = 1000;
+	unsigned int workers = 0;
+	unsigned int deadlineUs = 0;
+	unsigned int cpuBudget = 0;
+	uint64_t workNs = 0;
+	bool reactor = false;
+	bool statsPage = false;
+	int opt;
+
+	options.vcpus = 1;
+	options.memorySize = 64ULL << 20;
+	options.pages = 256;
+
+	while ( ( opt = getopt( argc, argv, "d:v:r:s:i:m:w:p:RP:SD:G:" ) ) != -1 ) {
+		switch ( opt ) {
+			case 'd':
+				domains = strtoul( optarg, NULL, 10 );
+				break;
+			case 'v':
+				options.vcpus = strtoul( optarg, NULL, 10 );
+				break;
+			case 'r':
+				options.rate = strtoul( optarg, NULL, 10 );
+				break;
+			case 's':
+				seconds = strtoul( optarg, NULL, 10 );
+				break;
+			case 'i':
+				intervalMs = strtoul( optarg, NULL, 10 );
+				break;
+			case 'm':
+				if ( !parseMix( optarg, options ) ) {
+					cerr << "Invalid mix: " << optarg << endl;
+					return -1;
+				}
+				break;
+			case 'w':
+				workNs = strtoull( optarg, NULL, 10 ) * 1000ULL;
+				break;
+			case 'p':
+				workers = strtoul( optarg, NULL, 10 );
+				break;
+			case 'R':
+				reactor = true;
+				break;
+			case 'P':
+				options.pages = strtoul( optarg, NULL, 10 );
+				break;
+			case 'S':
+				statsPage = true;
+				break;
+			case 'D':
+				deadlineUs = strtoul( optarg, NULL, 10 );
+				break;
+			case 'G':
+				cpuBudget = strtoul( optarg, NULL, 10 );
+				break;
+			default:
+				usage( argv[0] );
+				return -1;
+		}
+	}
+
+	if ( !domains || !options.vcpus || !options.pages || !intervalMs ) {
+		usage( argv[0] );
+		return -1;
+	}
+
+	unsigned short flags = 0;
+
+	if ( options.pageFaults )
+		flags |= bdvmi::EventManager::ENABLE_MEMORY;
+	if ( options.crWrites )
+		flags |= bdvmi::EventManager::ENABLE_CR;
+	if ( options.msrWrites )
+		flags |= bdvmi::EventManager::ENABLE_MSR;
+	if ( options.vmcalls )
+		flags |= bdvmi::EventManager::ENABLE_VMCALL;
+
+	if ( statsPage && !bdvmi::StatsPage::open() )
+		cerr << "Could not create the stats page" << endl;
+
+	LoadHandler handler( workNs );
+	bdvmi::XenEventReactor eventReactor;
+	pthread_t reactorThread;
+	bool reactorStarted = false;
+	vector<Domain *> running;
+	int ret = 0;
+
+	try {
+		for ( unsigned int i = 0; i < domains; ++i ) {
+			char name[32];
+
+			snprintf( name, sizeof( name ), "load%u", i );
+
+			Domain *domain = new Domain( name, options, flags );
+
+			running.push_back( domain );
+
+			domain->em.handler( &handler );
+
+			if ( workers && !domain->em.parallelDispatch( workers ) )
+				cerr << "Parallel dispatch not available, using the event loop thread" << endl;
+
+			if ( deadlineUs && !domain->em.handlerDeadline( deadlineUs ) )
+				cerr << "Handler deadlines not available" << endl;
+
+			if ( cpuBudget && !domain->em.overheadBudget( cpuBudget ) )
+				cerr << "The overhead governor is not available" << endl;
+		}
+
+		for ( size_t i = 0; i < running.size(); ++i ) {
+			if ( reactor )
+				eventReactor.add( &running[i]->em );
+			else if ( pthread_create( &running[i]->thread, NULL, domainMain, running[i] ) != 0 )
+				throw runtime_error( "could not start a domain thread" );
+			else
+				running[i]->started = true;
+		}
+
+		if ( reactor ) {
+			if ( pthread_create( &reactorThread, NULL, reactorMain, &eventReactor ) != 0 )
+				throw runtime_error( "could not start the reactor thread" );
+
+			reactorStarted = true;
+		}
+
+		printf( "%u domain(s) x %u VCPU(s), %s, mix pf=%u cr=%u msr=%u vmcall=%u, ", domains, options.vcpus,
+		        reactor ? "one reactor thread" : "one thread per domain", options.pageFaults,
+		        options.crWrites, options.msrWrites, options.vmcalls );
+
+		if ( options.rate )
+			printf( "%u events/s per domain\n", options.rate );
+		else
+			printf( "unthrottled\n" );
+
+		printHeader();
+
+		bdvmi::Histogram total;
+		uint64_t start = nowNs();
+		uint64_t last = start;
+		uint64_t lastAnswered = 0, lastInflight = 0, lastBacklog = 0;
+		uint64_t end = start + seconds * 1000000000ULL;
+
+		for ( ;; ) {
+			uint64_t now = nowNs();
+			uint64_t until = min<uint64_t>( last + intervalMs * 1000000ULL, end );
+
+			if ( now < until ) {
+				usleep( ( until - now ) / 1000 );
+				continue;
+			}
+
+			bdvmi::Histogram latencies;
+			uint64_t injected = 0, answered = 0, backlog = 0;
+
+			for ( size_t i = 0; i < running.size(); ++i ) {
+				answered += running[i]->em.answered();
+				injected += running[i]->em.injected();
+				backlog += running[i]->em.backlog();
+				running[i]->em.takeLatencies( latencies );
+			}
+
+			char label[16];
+
+			snprintf( label, sizeof( label ), "%.1fs", ( now - start ) / 1e9 );
+			printLine( label, ( answered - lastAnswered ) * 1e9 / ( now - last ), injected - answered, backlog,
+			           latencies );
+
+			total.merge( latencies );
+			last = now;
+			lastAnswered = answered;
+			lastInflight = injected - answered;
+			lastBacklog = backlog;
+
+			if ( now >= end )
+				break;
+		}
+
+		printf( "\n" );
+		printLine( "total", lastAnswered * 1e9 / ( last - start ), lastInflight, lastBacklog, total );
+		printf( "%llu synchronous events, mean latency %.1f us\n",
+		        static_cast<unsigned long long>( total.count() ), total.mean() / 1000.0 );
+
+		bdvmi::EventStatistics stats;
+
+		for ( size_t i = 0; i < running.size(); ++i ) {
+			bdvmi::EventStatistics domainStats;
+
+			if ( running[i]->em.statistics( domainStats ) )
+				stats.merge( domainStats );
+		}
+
+		printStatistics( stats );
+	}
+	catch ( const exception &e )
+	{
+		cerr << "Error: caught exception: " << e.what() << endl;
+		ret = -1;
+	}
+
+	if ( reactorStarted ) {
+		eventReactor.stop();
+		pthread_join( reactorThread, NULL );
+	}
+
+	for ( size_t i = 0; i < running.size(); ++i ) {
+		if ( running[i]->started ) {
+			running[i]->em.stop();
+			pthread_join( running[i]->thread, NULL );
+		}
+	}
+
+	for ( size_t i = 0; i < running.size(); ++i )
+		delete running[i];
+
+	bdvmi::StatsPage::close();
+
+	return ret;
+}
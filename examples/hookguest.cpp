@@ -19,16 +19,19 @@
 #include <bdvmi/eventhandler.h>
 #include <bdvmi/eventmanager.h>
 #include <bdvmi/loghelper.h>
+#include <bdvmi/statspage.h>
 #include <iostream>
 #include <memory>
 #include <signal.h>
 #include <sstream>
+#include <unistd.h>
 
 using namespace std;
 
 namespace { // Anonymous namespace
 
 	sig_atomic_t stop;
+	sigset_t stopSet;
 
 	void stop_handler( int /* signo */ )
 	{
@@ -74,8 +77,9 @@ class DemoEventHandler : public bdvmi::EventHandler {
 
 public:
 	// Callback for CR write events
-	virtual void handleCR( unsigned short /* vcpu */, unsigned short crNumber, const bdvmi::Registers & /* regs */,
-	                       uint64_t /* oldValue */, uint64_t newValue, bdvmi::HVAction & /* hvAction */ )
+	virtual void handleCR( unsigned short /* vcpu */, unsigned short crNumber,
+	                       const bdvmi::RegistersView & /* regs */, uint64_t /* oldValue */, uint64_t newValue,
+	                       bdvmi::HVAction & /* hvAction */ )
 	{
 		cout << "CR" << crNumber << " event, newValue: 0x" << hex << newValue << endl;
 	}
@@ -88,7 +92,7 @@ public:
 	}
 
 	// Callback for page faults
-	virtual void handlePageFault( unsigned short vcpu, const bdvmi::Registers & /* regs */,
+	virtual void handlePageFault( unsigned short vcpu, const bdvmi::RegistersView & /* regs */,
 	                              uint64_t /* physAddress */, uint64_t /* virtAddress */, bool /* read */,
 	                              bool /* write */, bool /* execute */, bdvmi::HVAction & /* action */,
 	                              uint8_t * /* data */, uint32_t & /* size */,
@@ -97,7 +101,7 @@ public:
 		cout << "Page fault event on VCPU: " << vcpu << endl;
 	}
 
-	virtual void handleVMCALL( unsigned short vcpu, const bdvmi::Registers & /* regs */, uint64_t /* rip */,
+	virtual void handleVMCALL( unsigned short vcpu, const bdvmi::RegistersView & /* regs */, uint64_t /* rip */,
 	                           uint64_t eax )
 	{
 		cout << "VMCALL event on VCPU " << vcpu << ", EAX: 0x" << hex << eax << endl;
@@ -113,10 +117,10 @@ public:
 		cout << "Session over." << endl;
 	}
 
-	// This callback will run before each event (helper)
-	virtual void runPreEvent()
+	// This callback will run before each batch of events (helper)
+	virtual void runPreBatch( unsigned int count )
 	{
-		cout << "Prepare for event ..." << endl;
+		cout << "Prepare for " << dec << count << " event(s) ..." << endl;
 	}
 };
 
@@ -147,6 +151,7 @@ public:
 		DemoEventHandler deh;
 
 		em->signalStopVar( &stop );
+		em->stopSignals( stopSet );
 
 		em->handler( &deh );
 
@@ -177,6 +182,13 @@ int main()
 		signal( SIGHUP, stop_handler );
 		signal( SIGTERM, stop_handler );
 
+		// Blocked, the signals stay pending and the event loops see them right away
+		sigemptyset( &stopSet );
+		sigaddset( &stopSet, SIGINT );
+		sigaddset( &stopSet, SIGHUP );
+		sigaddset( &stopSet, SIGTERM );
+		sigprocmask( SIG_BLOCK, &stopSet, NULL );
+
 		DemoLogHelper logHelper;
 		bdvmi::BackendFactory bf( bdvmi::BackendFactory::BACKEND_XEN, &logHelper );
 
@@ -197,9 +209,17 @@ int main()
 		cout << "Setting up break-out-of-the-loop (stop) variable ..." << endl;
 		pdw->signalStopVar( &stop );
 
+		if ( !pdw->stopSignals( stopSet ) ) // fall back on polling the stop variable
+			sigprocmask( SIG_UNBLOCK, &stopSet, NULL );
+
+		if ( bdvmi::StatsPage::open() )
+			cout << "Publishing counters, watch them with: bdvmistat " << getpid() << endl;
+
 		cout << "Waiting for domains ..." << endl;
 		pdw->waitForDomains();
 
+		bdvmi::StatsPage::close();
+
 		cout << "\nDone." << endl;
 	}
 	catch ( const exception &e )
@@ -18,6 +18,8 @@
 
 #include <string>
 #include "exception.h"
+#include "mockoptions.h"
+#include "replayoptions.h"
 
 namespace bdvmi {
 
@@ -29,7 +31,7 @@ class LogHelper;
 class BackendFactory {
 
 public:
-	enum BackendType { BACKEND_XEN, BACKEND_KVM };
+	enum BackendType { BACKEND_XEN, BACKEND_KVM, BACKEND_REPLAY, BACKEND_MOCK };
 
 public:
 	BackendFactory( BackendType type, LogHelper *logHelper = NULL );
@@ -41,6 +43,18 @@ public:
 
 	EventManager *eventManager( Driver &driver, unsigned short handlerFlags );
 
+	// BACKEND_REPLAY only, call it before domainWatcher() / driver()
+	void replayOptions( const ReplayOptions &options )
+	{
+		replayOptions_ = options;
+	}
+
+	// BACKEND_MOCK only, call it before driver()
+	void mockOptions( const MockOptions &options )
+	{
+		mockOptions_ = options;
+	}
+
 private:
 	// Prevent copying
 	BackendFactory( const BackendFactory & );
@@ -51,6 +65,8 @@ private:
 private:
 	BackendType type_;
 	LogHelper *logHelper_;
+	ReplayOptions replayOptions_;
+	MockOptions mockOptions_;
 };
 
 } // namespace bdvmi
@@ -0,0 +1,82 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIDECISIONCACHE_H_INCLUDED__
+#define __BDVMIDECISIONCACHE_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "eventhandler.h"
+
+namespace bdvmi {
+
+/*
+ * Bounded LRU map of (GFN, RIP, access) to the action a page fault got, for faults the handler
+ * always answers the same way. Not thread-safe, it's meant to be used by the event loop only.
+ */
+class DecisionCache {
+
+public:
+	DecisionCache( size_t maxEntries );
+
+public:
+	bool find( uint64_t gfn, uint64_t rip, unsigned int access, HVAction &action,
+	           unsigned short &instructionSize );
+
+	// Evicts the least recently used entry if the cache is full
+	void insert( uint64_t gfn, uint64_t rip, unsigned int access, HVAction action,
+	             unsigned short instructionSize );
+
+	void clear();
+
+	size_t size() const
+	{
+		return used_;
+	}
+
+private:
+	static const uint32_t NIL = 0xffffffff;
+
+	struct Entry {
+		uint64_t gfn;
+		uint64_t rip;
+		uint32_t access;
+		uint32_t hashNext;
+		uint32_t lruPrev;
+		uint32_t lruNext;
+		HVAction action;
+		unsigned short instructionSize;
+	};
+
+private:
+	uint32_t lookup( uint64_t gfn, uint64_t rip, unsigned int access, uint32_t *&link );
+
+	void unlink( uint32_t index );
+
+	void pushFront( uint32_t index );
+
+private:
+	std::vector<Entry> entries_;
+	std::vector<uint32_t> buckets_; // chains through Entry::hashNext
+	unsigned int bucketBits_;
+	uint32_t used_;
+	uint32_t head_; // most recently used
+	uint32_t tail_; // least recently used
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIDECISIONCACHE_H_INCLUDED__
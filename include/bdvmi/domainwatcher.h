@@ -20,6 +20,7 @@
 #include <list>
 #include <string>
 #include <signal.h>
+#include <stdint.h>
 
 namespace bdvmi {
 
@@ -67,27 +68,52 @@ public:
 	void stop()
 	{
 		stop_ = true;
+		wakeUp();
 	}
 
 	// "Template" pattern - calls waitForDomainOrTimeout()
 	void waitForDomains();
 
+	// Polled every 100 ms, unless stopSignals() is used as well
 	void signalStopVar( sig_atomic_t *sigStop )
 	{
 		sigStop_ = sigStop;
 	}
 
+	// Stop waiting for domains as soon as one of these signals is pending. They need to be
+	// blocked in all threads, and are left pending for the application to handle.
+	bool stopSignals( const sigset_t &signals )
+	{
+		stopSignalsOn_ = watchStopSignals( signals );
+		return stopSignalsOn_;
+	}
+
 protected:
-	// Return true if a new domain is up, false for timeout
+	// Return true if a new domain is up, false for timeout (ms == -1 means no timeout)
 	virtual bool waitForDomainsOrTimeout( std::list<DomainInfo> &domains, int ms ) = 0;
 
+	// Make waitForDomainsOrTimeout() return right away, possibly from another thread
+	virtual void wakeUp()
+	{
+	}
+
+	// Have waitForDomainsOrTimeout() call stop() when one of the signals is pending
+	virtual bool watchStopSignals( const sigset_t & /* signals */ )
+	{
+		return false;
+	}
+
 protected:
 	sig_atomic_t *sigStop_;
 
 private:
 	std::set<std::string> domains_;
 	bool stop_;
+	bool stopSignalsOn_;
 	DomainHandler *handler_;
+	uint64_t wakeups_;          // waitForDomainsOrTimeout() returns
+	uint64_t domainsSeen_;      // domains reported to the handler
+	uint64_t protectedSeen_;    // ... of which protected
 };
 
 } // namespace bdvmi
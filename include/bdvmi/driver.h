@@ -19,6 +19,7 @@
 #include <stdint.h>
 #include <cstdlib>
 #include <cstring>
+#include <string>
 
 namespace bdvmi {
 
@@ -111,6 +112,22 @@ struct Mtrrs {
 
 enum MapReturnCode { MAP_SUCCESS, MAP_FAILED_GENERIC, MAP_PAGE_NOT_PRESENT, MAP_INVALID_PARAMETER };
 
+// Driver counters, as returned by Driver::statistics()
+struct DriverStatistics {
+
+	DriverStatistics()
+	{
+		memset( this, 0, sizeof( DriverStatistics ) );
+	}
+
+	uint64_t hypercalls;     // calls into the hypervisor, page mappings included
+	uint64_t cacheHits;      // page cache lookups that found the page already mapped
+	uint64_t cacheMisses;    // page cache lookups that had to map the page
+	uint64_t cacheEvictions; // pages unmapped to make room for others
+	uint64_t cachePages;     // pages currently in the cache
+	uint64_t mapFailures;    // pages that could not be mapped
+};
+
 /*
  * The functions a driver implements are not allowed to throw exceptions,
  * because they will be called from ms_abi (WINAPI) functions, and GCC
@@ -193,6 +210,18 @@ public:
 	virtual std::string uuid() const throw() = 0;
 
 	virtual unsigned int id() const throw() = 0;
+
+	// Changes every time page protections change (see EventManager::decisionCache())
+	virtual unsigned int protectionGeneration() const throw()
+	{
+		return 0;
+	}
+
+	// Get a snapshot of the driver's counters (false if it doesn't keep any)
+	virtual bool statistics( DriverStatistics & /* stats */ ) const throw()
+	{
+		return false;
+	}
 };
 
 } // namespace bdvmi
@@ -0,0 +1,90 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIEVENTFILTER_H_INCLUDED__
+#define __BDVMIEVENTFILTER_H_INCLUDED__
+
+#include <stdint.h>
+#include <vector>
+#include "pagefaultrules.h"
+
+namespace bdvmi {
+
+/*
+ * Decides which events are worth handing to the EventHandler. The ones that don't get
+ * through are answered with NONE (or the matching page fault rule's action) by the event
+ * manager itself. Configure it from the thread running the event loop (or before starting
+ * it), except for pageFaultRules().
+ */
+class EventFilter {
+
+public:
+	EventFilter();
+
+	~EventFilter();
+
+public:
+	// Only let CR3 writes through for values that haven't been seen lately. A bounded
+	// number of values is remembered, so an old one may occasionally show up again.
+	void newCR3Only( bool enable );
+
+	// Forget the CR3 values seen so far
+	void resetCR3();
+
+	// Only let CR0 or CR4 writes through if they change one of the bits in mask (by
+	// default all of them).
+	bool crBits( unsigned short crNumber, uint64_t mask );
+
+	// The mask set by crBits() (all bits for CRs other than 0 and 4)
+	uint64_t crMask( unsigned short crNumber ) const;
+
+	// Replace the page fault rules (an empty set turns them off). Safe to call from any
+	// thread, the event loop switches to the new rules before its next page fault.
+	void pageFaultRules( const PageFaultRules &rules );
+
+	// Called by the event managers, for each CR write
+	bool wantsCR( unsigned short crNumber, uint64_t oldValue, uint64_t newValue );
+
+	// Called by the event managers, for each page fault. Returns true (and the action to
+	// take) if a rule matches.
+	bool matchPageFault( uint64_t gfn, unsigned int access, uint64_t rip, uint64_t cr3, HVAction &action );
+
+	// Changes every time the event loop switches to new page fault rules
+	unsigned int rulesGeneration() const
+	{
+		return rulesGeneration_;
+	}
+
+private:
+	// Not implemented
+	EventFilter( const EventFilter & );
+	EventFilter &operator=( const EventFilter & );
+
+private:
+	enum { CR3_CACHE_BITS = 12 };
+
+private:
+	bool newCR3Only_;
+	uint64_t cr0Mask_;
+	uint64_t cr4Mask_;
+	std::vector<uint64_t> seenCR3_;     // direct-mapped
+	PageFaultRules *rules_;             // only touched by the event loop
+	PageFaultRules *volatile newRules_; // handed over by pageFaultRules()
+	unsigned int rulesGeneration_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIEVENTFILTER_H_INCLUDED__
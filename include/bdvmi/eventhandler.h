@@ -17,12 +17,10 @@
 #define __BDVMIEVENTHANDLER_H_INCLUDED__
 
 #include <stdint.h>
+#include "registersview.h"
 
 namespace bdvmi {
 
-// Forward declaration
-class Registers;
-
 enum HVAction { NONE, EMULATE_NOWRITE, SKIP_INSTRUCTION, ALLOW_VIRTUAL, EMULATE_SET_CTXT };
 
 class EventHandler {
@@ -35,7 +33,7 @@ public:
 
 public:
 	// Callback for CR{0,3,4} write events.
-	virtual void handleCR( unsigned short vcpu, unsigned short crNumber, const bdvmi::Registers &regs,
+	virtual void handleCR( unsigned short vcpu, unsigned short crNumber, const RegistersView &regs,
 	                       uint64_t oldValue, uint64_t newValue, HVAction &action ) = 0;
 
 	// Callback for writes in MSR addresses.
@@ -43,13 +41,13 @@ public:
 	                        HVAction &action ) = 0;
 
 	// Callback for page faults.
-	virtual void handlePageFault( unsigned short vcpu, const Registers &regs, uint64_t physAddress,
+	virtual void handlePageFault( unsigned short vcpu, const RegistersView &regs, uint64_t physAddress,
 	                              uint64_t virtAddress, bool read, bool write, bool execute,
 	                              HVAction &action, uint8_t *emulatorCtx, uint32_t &emuCtxSize,
 	                              unsigned short &instructionSize ) = 0;
 
 	// Callback for VMCALL events.
-	virtual void handleVMCALL( unsigned short vcpu, const Registers &regs, uint64_t rip, uint64_t eax ) = 0;
+	virtual void handleVMCALL( unsigned short vcpu, const RegistersView &regs, uint64_t rip, uint64_t eax ) = 0;
 
 	virtual void handleXSETBV( unsigned short vcpu, uint64_t ecx ) = 0;
 
@@ -57,8 +55,23 @@ public:
 	// then this has _not_ happened because the guest shut down or has been forcefully terminated).
 	virtual void handleSessionOver( bool guestStillRunning ) = 0;
 
-	// Useful for reloading configuration, checking state, etc.
-	virtual void runPreEvent() = 0;
+	// Useful for reloading configuration, checking state, etc. Only called (before each event)
+	// if the event manager's preEventHook() is on, runPreBatch() is much cheaper.
+	virtual void runPreEvent()
+	{
+	}
+
+	// Called on the event loop thread before handling a batch of (about) count events. With
+	// parallel dispatch, the callbacks for them run later on the worker threads.
+	virtual void runPreBatch( unsigned int /* count */ )
+	{
+	}
+
+	// Called on the event loop thread once the batch started by runPreBatch() has been
+	// answered (or handed over to the worker threads).
+	virtual void runPostBatch()
+	{
+	}
 };
 
 } // namespace bdvmi
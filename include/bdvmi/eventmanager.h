@@ -17,12 +17,14 @@
 #define __BDVMIEVENTMANAGER_H_INCLUDED__
 
 #include <signal.h>
+#include <stdint.h>
+#include <string>
+#include "eventfilter.h"
+#include "eventhandler.h"
+#include "eventstatistics.h"
 
 namespace bdvmi {
 
-// forward declaration, minimize compile-time file dependencies
-class EventHandler;
-
 class EventManager {
 
 public:
@@ -34,8 +36,22 @@ public:
 	       ENABLE_XSETBV = ( 1 << 4 ),
 	       ENABLE_ALL = ( ENABLE_CR | ENABLE_MSR | ENABLE_MEMORY | ENABLE_VMCALL | ENABLE_XSETBV ) };
 
+	// How far the overhead governor has cut down monitoring (see overheadBudget()). Each level
+	// includes the ones before it.
+	enum GovernorLevel {
+		GOVERNOR_FULL,   // everything the handler asked for
+		GOVERNOR_NO_CR3, // CR3 writes aren't monitored
+		GOVERNOR_ASYNC,  // CR and MSR writes don't pause the VCPU anymore (where asyncEvents() can
+		                 // switch them)
+		GOVERNOR_SAMPLED // only one in eight page faults, CR and MSR writes reach the handler, the
+		                 // rest are answered with NONE
+	};
+
+	// Opaque handle to an event response put off by deferResponse()
+	typedef void *ResponseToken;
+
 public:
-	EventManager( EventHandler *handler = 0 ) : sigStop_( 0 ), handler_( handler )
+	EventManager( EventHandler *handler = 0 ) : sigStop_( 0 ), handler_( handler ), preEventHook_( false )
 	{
 	}
 
@@ -57,20 +73,184 @@ public:
 		return handler_;
 	}
 
+	// Call EventHandler::runPreEvent() before every event (off by default, the handler's
+	// runPreBatch() and runPostBatch() are always called)
+	void preEventHook( bool enable )
+	{
+		preEventHook_ = enable;
+	}
+
+	bool preEventHook() const
+	{
+		return preEventHook_;
+	}
+
+	// Events the filter turns down never reach the handler
+	EventFilter &eventFilter()
+	{
+		return filter_;
+	}
+
+	// Only report CR0 or CR4 writes that change one of the bits in mask. Where the
+	// hypervisor supports it, the other writes don't cause VM exits at all.
+	virtual bool monitorCRBits( unsigned short crNumber, uint64_t mask )
+	{
+		return filter_.crBits( crNumber, mask );
+	}
+
+	// Polled every 100 ms, unless stopSignals() is used as well
 	void signalStopVar( sig_atomic_t *sigStop )
 	{
 		sigStop_ = sigStop;
 	}
 
+	// Stop the event loop as soon as one of these signals is pending. They need to be
+	// blocked in all threads, and are left pending for the application to handle.
+	virtual bool stopSignals( const sigset_t & /* signals */ )
+	{
+		return false;
+	}
+
 	// Set handler flags (i.e. ENABLE_MSR | ENABLE_MEMORY)
 	virtual bool handlerFlags( unsigned short flags ) = 0;
 
 	// Get handler flags
 	virtual unsigned short handlerFlags() const = 0;
 
+	// Handle events on up to `workers' threads (events from the same VCPU keep their order), 0 to
+	// handle them on the waitForEvents() thread. The EventHandler must be thread-safe if enabled
+	// (XenDriver is, so the callbacks can keep using it). Not to be called from EventHandler callbacks.
+	// Events already handed to a worker keep the handler(), handlerFlags() and preEventHook() they
+	// were dispatched with.
+	virtual bool parallelDispatch( unsigned int /* workers */ )
+	{
+		return false;
+	}
+
+	// Only valid from inside the handleCR(), handleMSR() and handlePageFault() callbacks: don't
+	// answer the current event when the callback returns (the action it sets is ignored). The
+	// event's VCPU stays paused until completeResponse() gets called with the returned token,
+	// while events from the other VCPUs keep being handled. Returns 0 if not supported.
+	virtual ResponseToken deferResponse()
+	{
+		return 0;
+	}
+
+	// Answer a deferred event, from any thread, exactly once for each token. The parameters
+	// mean the same as the corresponding handlePageFault() ones. Tokens not completed yet (even
+	// those handlerDeadline() has answered already) keep waitForEvents() from returning after stop().
+	virtual bool completeResponse( ResponseToken /* token */, HVAction /* action */,
+	                               const uint8_t * /* emulatorCtx */ = 0, uint32_t /* emuCtxSize */ = 0,
+	                               unsigned short /* instructionSize */ = 0 )
+	{
+		return false;
+	}
+
+	// Have the events in flags (ENABLE_CR, ENABLE_MSR, ENABLE_VMCALL, ENABLE_XSETBV) reported
+	// without pausing the VCPU, for handlers that only need to be notified: the actions they
+	// set are ignored, and deferResponse() isn't available. Fails if the hypervisor can't do
+	// it for some of them.
+	virtual bool asyncEvents( unsigned short flags )
+	{
+		return flags == 0;
+	}
+
+	// Remember up to maxEntries page fault decisions marked with cacheDecision() (0 turns the
+	// cache off). Later faults with the same GFN, RIP and access type get the same answer
+	// without reaching the handler, until page protections or page fault rules change.
+	virtual bool decisionCache( size_t maxEntries )
+	{
+		return maxEntries == 0;
+	}
+
+	// Only valid from inside the handlePageFault() callback: the action it sets only depends
+	// on the GFN, RIP and access type, so it may be reused (see decisionCache()). Decisions
+	// using EMULATE_SET_CTXT, or deferred with deferResponse(), are never reused.
+	virtual bool cacheDecision()
+	{
+		return false;
+	}
+
+	// Forget the cached decisions, e.g. when whatever they're based on changes. Safe to call
+	// from any thread.
+	virtual void invalidateDecisions()
+	{
+	}
+
+	// Record every request and the response sent back for it to a binary trace file at path
+	// (see EventTraceHeader). An empty path stops recording. Call it from the thread running
+	// the event loop (or before starting it).
+	virtual bool traceEvents( const std::string & /* path */ )
+	{
+		return false;
+	}
+
+	// Bound the time a VCPU stays paused waiting for the handler: events not answered within us
+	// microseconds of being taken off the ring get the fallback action (NONE, EMULATE_NOWRITE or
+	// ALLOW_VIRTUAL) instead, and the handler's decision gets discarded whenever it shows up.
+	// That only works for events handled away from the event loop thread (parallelDispatch(),
+	// deferResponse()), late handlers running on it are only counted. 0 turns it off. Call it
+	// from the thread running the event loop (or before starting it).
+	virtual bool handlerDeadline( unsigned int /* us */, HVAction /* fallback */ = NONE )
+	{
+		return false;
+	}
+
+	// Keep the time spent in the handler under cpuPercent percent of a CPU, and the events
+	// reaching it under maxRate a second (0 for no limit). Past that, monitoring gets cheaper one
+	// level at a time, up to maxLevel, and goes back one level at a time once the load has stayed
+	// under half the budget for a second. Call it from the thread running the event loop (or
+	// before starting it).
+	virtual bool overheadBudget( unsigned int cpuPercent, unsigned int /* maxRate */ = 0,
+	                             GovernorLevel /* maxLevel */ = GOVERNOR_SAMPLED )
+	{
+		return cpuPercent == 0;
+	}
+
+	virtual GovernorLevel governorLevel() const
+	{
+		return GOVERNOR_FULL;
+	}
+
+	// Busy poll for up to maxSpinUs microseconds before blocking (0 disables it). The actual
+	// spin time adapts to how often events have been arriving lately.
+	virtual bool busyPoll( unsigned int /* maxSpinUs */ )
+	{
+		return false;
+	}
+
+	// Get a snapshot of the event loop counters (it may be slightly off if events are
+	// being handled meanwhile)
+	virtual bool statistics( EventStatistics & /* stats */ ) const
+	{
+		return false;
+	}
+
 	// Loop waiting for events
 	virtual void waitForEvents() = 0;
 
+	// For applications running their own event loop instead of waitForEvents(): this fd
+	// becomes readable when processPending() has something to do (-1 if not supported).
+	virtual int pollFd() const
+	{
+		return -1;
+	}
+
+	// Handle whatever is pending without blocking, at most maxEvents requests (0 means
+	// no limit). Returns false once the session is over (after stop(), with all the
+	// events answered and all the deferResponse() tokens completed).
+	virtual bool processPending( unsigned int /* maxEvents */ = 0 )
+	{
+		return false;
+	}
+
+	// True if processPending() left requests behind (because of maxEvents): call it
+	// again without waiting for pollFd()
+	virtual bool hasPendingEvents()
+	{
+		return false;
+	}
+
 	// Stop the event loop
 	virtual void stop() = 0;
 
@@ -82,6 +262,8 @@ protected:
 
 private:
 	EventHandler *handler_;
+	EventFilter filter_;
+	bool preEventHook_;
 };
 
 } // namespace bdvmi
@@ -0,0 +1,85 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIEVENTPOLLER_H_INCLUDED__
+#define __BDVMIEVENTPOLLER_H_INCLUDED__
+
+#include <signal.h>
+
+namespace bdvmi {
+
+/*
+ * epoll(7) wrapper for the event loops. Every watched fd gets an id bit, and wait()
+ * returns the bits of the fds that are ready. Besides those, wait() returns WAKE_UP
+ * after a wakeUp() call (from any thread, or a signal handler), and STOP_SIGNAL once
+ * one of the signals passed to watchSignals() is pending.
+ */
+class EventPoller {
+
+public:
+	enum { WAKE_UP = ( 1u << 30 ), STOP_SIGNAL = ( 1u << 31 ) };
+
+public:
+	EventPoller();
+
+	~EventPoller();
+
+public:
+	// Watch fd for input, reporting it as id (a single bit, below WAKE_UP)
+	void add( int fd, unsigned int id );
+
+	void remove( int fd );
+
+	// The signals must be blocked in all threads (so that they stay pending). They are
+	// not consumed, so every EventPoller watching them sees them. Since they stay pending,
+	// only the first wait() to see one returns STOP_SIGNAL (until watchSignals() is called
+	// again), otherwise the poller would never block again.
+	bool watchSignals( const sigset_t &signals );
+
+	bool watchingSignals() const
+	{
+		return signalFd_ >= 0;
+	}
+
+	// Readable whenever wait() would return something (so pollers can be nested)
+	int fd() const
+	{
+		return epollFd_;
+	}
+
+	// Make the current (or next) wait() return right away
+	void wakeUp();
+
+	// Block for up to ms milliseconds (-1 means no timeout). Returns 0 for timeouts
+	// and interruptions.
+	unsigned int wait( int ms );
+
+private:
+	// No copying allowed (class has file descriptors)
+	EventPoller( const EventPoller & );
+
+	// No copying allowed (class has file descriptors)
+	EventPoller &operator=( const EventPoller & );
+
+private:
+	int epollFd_;
+	int wakeUpFd_;
+	int signalFd_;
+	bool signalReported_; // signalFd_ is out of the epoll set
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIEVENTPOLLER_H_INCLUDED__
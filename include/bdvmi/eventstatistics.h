@@ -0,0 +1,62 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIEVENTSTATISTICS_H_INCLUDED__
+#define __BDVMIEVENTSTATISTICS_H_INCLUDED__
+
+#include "histogram.h"
+#include <stdint.h>
+
+namespace bdvmi {
+
+/*
+ * Event loop counters, as returned by EventManager::statistics(). Times are in nanoseconds.
+ * Every thread handling events keeps its own copy, statistics() adds them up.
+ */
+struct EventStatistics {
+	enum EventType { PAGE_FAULT, CR, MSR, VMCALL, XSETBV, OTHER, EVENT_TYPES };
+
+	EventStatistics();
+
+	// Add other's counters to these
+	void merge( const EventStatistics &other );
+
+	static const char *eventTypeName( EventType type );
+
+	uint64_t events;       // responses sent
+	uint64_t spinWakeups;  // batches found by busy polling
+	uint64_t sleepWakeups; // batches found after blocking
+	uint64_t spinTime;     // total time spent busy polling
+	uint64_t ackTime;      // total time spent acknowledging ring notifications (event channel or local ring)
+	uint64_t maxAckTime;
+
+	uint64_t requests[EVENT_TYPES]; // taken off the ring, by type
+	uint64_t filtered;              // answered without involving the handler (see eventFilter())
+	uint64_t deadlineMisses;        // handlers that took longer than EventManager::handlerDeadline()
+	uint64_t lateDecisions;         // ... and whose decision came after the fallback action had been sent
+	uint64_t shed;                  // answered without involving the handler by the overhead governor
+	uint64_t governorChanges;       // EventManager::governorLevel() changes
+
+	Histogram handlerTime[EVENT_TYPES]; // spent in the handler callbacks, by type
+	Histogram responseTime;             // from a request being taken off the ring to its response being pushed
+	Histogram notifyTime;               // spent telling the hypervisor about new responses
+	Histogram ackLatency;               // same as ackTime, per notification
+	Histogram ringOccupancy;            // requests found on the ring, whenever the event loop looks at it
+	Histogram batchSizes;               // responses pushed at once
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIEVENTSTATISTICS_H_INCLUDED__
@@ -0,0 +1,180 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIEVENTTRACE_H_INCLUDED__
+#define __BDVMIEVENTTRACE_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace bdvmi {
+
+#define BDVMI_EVENT_TRACE_MAGIC "BDVMITRC"
+
+enum { EVENT_TRACE_VERSION = 1 };
+
+/*
+ * On-disk layout: an EventTraceHeader, followed by dataSize bytes of records. Each record is an
+ * EventTraceRecord, followed by the raw ring request (requestSize bytes) and the response sent
+ * back for it (responseSize bytes). All fields are in host byte order.
+ */
+struct EventTraceHeader {
+	char magic[8]; // BDVMI_EVENT_TRACE_MAGIC, not NUL-terminated
+	uint32_t version;
+	uint32_t headerSize;
+	uint32_t interfaceVersion; // __XEN_LATEST_INTERFACE_VERSION__ of the recording library
+	uint32_t requestSize;
+	uint32_t responseSize;
+	uint32_t reserved;
+	uint64_t tscSpeed; // TSC ticks per second, 0 if unknown
+	uint64_t dataSize; // updated on every sync, a crashed recorder may have left more behind
+	uint64_t records;
+	uint64_t dropped; // not recorded because the file couldn't grow
+};
+
+struct EventTraceRecord {
+	enum {
+		FILTERED = 1, // answered without involving the handler
+		EXPIRED = 2   // answered with the fallback action (see EventManager::handlerDeadline())
+	};
+
+	uint32_t size; // the whole record, padded to 8 bytes
+	uint32_t flags;
+	uint64_t tsc;     // when the request was taken off the ring
+	uint64_t latency; // TSC ticks until its response was ready
+};
+
+/*
+ * Appends event records to a trace file, through a shared mapping preallocated chunkSize bytes
+ * at a time. Dirty pages are handed to the kernel for writeback about once a second. Not
+ * thread-safe.
+ */
+class EventTrace {
+
+public:
+	EventTrace( const std::string &path, uint32_t interfaceVersion, uint32_t requestSize, uint32_t responseSize,
+	            uint64_t tscSpeed, size_t chunkSize = 64 << 20 );
+
+	~EventTrace();
+
+public:
+	bool append( uint64_t tsc, uint64_t latency, uint32_t flags, const void *request, const void *response );
+
+	// Call every now and then (e.g. once per batch of events) to get the data to disk
+	void tick();
+
+	uint64_t dropped() const
+	{
+		return header()->dropped;
+	}
+
+	static uint64_t tsc()
+	{
+#if defined( __i386__ ) || defined( __x86_64__ )
+		uint32_t lo, hi;
+		__asm__ __volatile__( "rdtsc" : "=a"( lo ), "=d"( hi ) );
+		return ( static_cast<uint64_t>( hi ) << 32 ) | lo;
+#else
+		return 0;
+#endif
+	}
+
+private:
+	// No copying allowed (class has fd_)
+	EventTrace( const EventTrace & );
+
+	// No copying allowed (class has fd_)
+	EventTrace &operator=( const EventTrace & );
+
+private:
+	EventTraceHeader *header() const
+	{
+		return reinterpret_cast<EventTraceHeader *>( map_ );
+	}
+
+	bool grow();
+
+	void sync( bool wait );
+
+	void cleanup();
+
+private:
+	int fd_;
+	char *map_;
+	size_t mapSize_;
+	size_t chunkSize_;
+	size_t used_;
+	size_t syncedUpTo_;
+	uint32_t recordSize_;
+	uint64_t lastSyncNs_;
+};
+
+/*
+ * Read-only view of a trace file written by EventTrace, with its records sorted by TSC (the
+ * order the requests came in, dispatched and deferred events are recorded when answered).
+ */
+class EventTraceReader {
+
+public:
+	// Throws if the file isn't a trace, or has a different version or request layout
+	EventTraceReader( const std::string &path, uint32_t interfaceVersion, uint32_t requestSize,
+	                  uint32_t responseSize );
+
+	~EventTraceReader();
+
+public:
+	const EventTraceHeader &header() const
+	{
+		return *reinterpret_cast<const EventTraceHeader *>( map_ );
+	}
+
+	size_t size() const
+	{
+		return records_.size();
+	}
+
+	const EventTraceRecord &record( size_t index ) const
+	{
+		return *records_[index];
+	}
+
+	const void *request( size_t index ) const
+	{
+		return records_[index] + 1;
+	}
+
+	const void *response( size_t index ) const
+	{
+		return reinterpret_cast<const char *>( records_[index] + 1 ) + header().requestSize;
+	}
+
+private:
+	// No copying allowed (class has map_)
+	EventTraceReader( const EventTraceReader & );
+
+	// No copying allowed (class has map_)
+	EventTraceReader &operator=( const EventTraceReader & );
+
+private:
+	char *map_;
+	size_t mapSize_;
+	std::vector<const EventTraceRecord *> records_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIEVENTTRACE_H_INCLUDED__
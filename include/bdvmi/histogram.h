@@ -0,0 +1,97 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIHISTOGRAM_H_INCLUDED__
+#define __BDVMIHISTOGRAM_H_INCLUDED__
+
+#include <stdint.h>
+
+namespace bdvmi {
+
+/*
+ * Fixed-size histogram of 64-bit values (e.g. latencies in nanoseconds), with log-linear
+ * buckets: exact below 32, and within about 6% above that, whatever the magnitude. Recording
+ * is a few instructions and never allocates. Not thread-safe, merge() per-thread instances
+ * to combine them.
+ */
+class Histogram {
+
+public:
+	Histogram();
+
+public:
+	void add( uint64_t value )
+	{
+		++counts_[bucket( value )];
+		++count_;
+		sum_ += value;
+
+		if ( value > max_ )
+			max_ = value;
+	}
+
+	void merge( const Histogram &other );
+
+	void clear();
+
+	uint64_t count() const
+	{
+		return count_;
+	}
+
+	uint64_t max() const
+	{
+		return max_;
+	}
+
+	uint64_t sum() const
+	{
+		return sum_;
+	}
+
+	uint64_t mean() const
+	{
+		return count_ ? sum_ / count_ : 0;
+	}
+
+	// The value (bucket upper bound) at or under which percent (0 - 100) of the values are
+	uint64_t percentile( double percent ) const;
+
+private:
+	enum { SUB_BITS = 5, SUB_COUNT = 1 << SUB_BITS, HALF_COUNT = SUB_COUNT / 2 };
+	enum { BUCKETS = ( 64 - SUB_BITS ) * HALF_COUNT + SUB_COUNT };
+
+	static unsigned int bucket( uint64_t value )
+	{
+		if ( value < SUB_COUNT )
+			return value;
+
+		unsigned int shift = 63 - __builtin_clzll( value ) - SUB_BITS + 1;
+
+		return shift * HALF_COUNT + ( value >> shift );
+	}
+
+	static uint64_t highest( unsigned int bucket );
+
+private:
+	uint64_t counts_[BUCKETS];
+	uint64_t count_;
+	uint64_t sum_;
+	uint64_t max_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIHISTOGRAM_H_INCLUDED__
@@ -0,0 +1,176 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMOCKDRIVER_H_INCLUDED__
+#define __BDVMIMOCKDRIVER_H_INCLUDED__
+
+#include "driver.h"
+#include "mockguest.h"
+#include "mockoptions.h"
+#include "msrbitmap.h"
+#include "xeneventmanager.h"
+#include <map>
+#include <vector>
+
+namespace bdvmi {
+
+// Forward declaration, minimize compile-time file dependencies
+class LogHelper;
+
+/*
+ * Driver for a simulated guest (MockGuest), with MockEventManager playing the hypervisor.
+ * Every VCPU runs 64-bit code in the same address space, with MockOptions::pages pages mapped
+ * at workingSetGva(). Translations and mappings go through the guest's page tables, like
+ * they would on real hardware.
+ */
+class MockDriver : public Driver {
+
+public:
+	MockDriver( const std::string &domain, const MockOptions &options, LogHelper *logHelper = NULL );
+
+	virtual ~MockDriver();
+
+public:
+	virtual bool cpuCount( unsigned int &count ) const throw();
+
+	virtual bool tscSpeed( unsigned long long &speed ) const throw();
+
+	virtual bool mtrrType( unsigned long long guestAddress, uint8_t &type ) const throw();
+
+	virtual bool setPageProtection( unsigned long long guestAddress, bool read, bool write,
+	                                bool execute ) throw();
+
+	virtual bool getPageProtection( unsigned long long guestAddress, bool &read, bool &write,
+	                                bool &execute ) const throw();
+
+	virtual bool registers( unsigned short vcpu, Registers &regs ) const throw();
+
+	virtual bool mtrrs( unsigned short vcpu, Mtrrs &m ) const throw();
+
+	virtual bool setRegisters( unsigned short vcpu, const Registers &regs, bool setEip ) throw();
+
+	virtual bool writeToPhysAddress( unsigned long long address, void *buffer, size_t length ) throw();
+
+	virtual bool enableMsrExit( unsigned int msr, bool &oldValue ) throw();
+
+	virtual bool disableMsrExit( unsigned int msr, bool &oldValue ) throw();
+
+	virtual bool isMsrEnabled( unsigned int msr, bool &enabled ) const throw()
+	{
+		enabled = msrs_.test( msr );
+		return true;
+	}
+
+	virtual MapReturnCode mapPhysMemToHost( unsigned long long address, size_t length, uint32_t flags,
+	                                        void *&pointer ) throw();
+
+	virtual bool unmapPhysMem( void *hostPtr ) throw();
+
+	virtual MapReturnCode mapVirtMemToHost( unsigned long long address, size_t length, uint32_t flags,
+	                                        unsigned short vcpu, void *&pointer ) throw();
+
+	virtual bool unmapVirtMem( void *hostPtr ) throw();
+
+	virtual bool cacheGuestVirtAddr( unsigned long long addr ) throw();
+
+	// Pages virtualAddress in, as the guest OS would
+	virtual bool requestPageFault( int vcpu, uint64_t addressSpace, uint64_t virtualAddress,
+	                               uint32_t writeAccess ) throw();
+
+	virtual bool disableRepOptimizations() throw();
+
+	virtual bool shutdown() throw();
+
+	virtual bool pause() throw();
+
+	virtual bool unpause() throw();
+
+	virtual bool setPageCacheLimit( size_t limit ) throw();
+
+	virtual std::string uuid() const throw()
+	{
+		return uuid_;
+	}
+
+	virtual unsigned int id() const throw()
+	{
+		return 0;
+	}
+
+	virtual unsigned int protectionGeneration() const throw()
+	{
+		return protectionGeneration_;
+	}
+
+public: // Mock-specific stuff
+	MockGuest &guest()
+	{
+		return guest_;
+	}
+
+	const MockOptions &options() const
+	{
+		return options_;
+	}
+
+	// The ring MockEventManager injects requests through
+	mem_event_sring_t *ring() const
+	{
+		return ring_;
+	}
+
+	uint64_t workingSetGva() const
+	{
+		return WORKING_SET_GVA;
+	}
+
+	// The guest physical address of the working set's index-th page
+	uint64_t workingSetGpa( unsigned int index ) const
+	{
+		return workingSet_[index];
+	}
+
+	bool shutDown() const
+	{
+		return shutDown_;
+	}
+
+public:
+	static const uint64_t WORKING_SET_GVA = 0x0000000000400000ULL;
+
+private:
+	// Don't allow copying for these objects (class has ring_)
+	MockDriver( const MockDriver & );
+
+	// Don't allow copying for these objects (class has ring_)
+	MockDriver &operator=( const MockDriver & );
+
+private:
+	MockOptions options_;
+	LogHelper *logHelper_;
+	std::string uuid_;
+	MockGuest guest_;
+	mem_event_sring_t *ring_;
+	std::vector<uint64_t> workingSet_;
+	std::map<unsigned long long, unsigned long long> addressCache_; // GVA -> GPA, see cacheGuestVirtAddr()
+	MsrBitmap msrs_;
+	std::map<unsigned long long, unsigned char> protections_; // GFN -> R/W/X bits, RWX if not there
+	volatile unsigned int protectionGeneration_;
+	volatile bool shutDown_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMOCKDRIVER_H_INCLUDED__
@@ -0,0 +1,120 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMOCKEVENTMANAGER_H_INCLUDED__
+#define __BDVMIMOCKEVENTMANAGER_H_INCLUDED__
+
+#include "histogram.h"
+#include "xeneventmanager.h"
+#include <pthread.h>
+#include <vector>
+
+namespace bdvmi {
+
+class MockDriver;
+
+/*
+ * The hypervisor side of a MockDriver guest: a thread injecting requests into a ring of its
+ * own (see MockOptions for the mix and the rate), which are handled by the regular
+ * XenEventManager code. Like with Xen, a VCPU waits for the response to a synchronous
+ * request before it gets another one. The session is over once MockOptions::events requests
+ * have been answered, or the guest has been shut down.
+ */
+class MockEventManager : public XenEventManager {
+
+public:
+	MockEventManager( MockDriver &driver, unsigned short handlerFlags, LogHelper *logHelper = NULL );
+
+	virtual ~MockEventManager();
+
+public: // Mock-specific stuff
+	uint64_t injected() const
+	{
+		return injected_;
+	}
+
+	uint64_t answered() const
+	{
+		return answered_;
+	}
+
+	// Requests overdue because the VCPUs are still waiting on responses (with MockOptions::rate)
+	uint64_t backlog() const
+	{
+		return backlog_;
+	}
+
+	// Add the time (in ns) synchronous requests took to be answered, since the last call, to
+	// latencies. Can be called from any thread, lags behind by up to 10 ms.
+	void takeLatencies( Histogram &latencies );
+
+private:
+	enum RequestKind { NO_REQUEST, PAGE_FAULT, CR_WRITE, MSR_WRITE, VMCALL };
+
+private:
+	virtual void notifyLocalRing();
+
+	virtual void asyncFlagsChanged( unsigned short flags );
+
+	static void *hypervisorMain( void *arg );
+
+	void hypervisor();
+
+	// What the next request will be (the mix is spread over the sequence numbers)
+	RequestKind nextRequest() const;
+
+	// Put the next request for vcpu on the ring, false if no events are enabled
+	bool inject( unsigned short vcpu );
+
+	void collect();
+
+	void publishLatencies();
+
+	void stopHypervisor();
+
+	void cleanup();
+
+private:
+	// Don't allow copying for these objects
+	MockEventManager( const MockEventManager & );
+
+	// Don't allow copying for these objects
+	MockEventManager &operator=( const MockEventManager & );
+
+private:
+	MockDriver &driver_;
+	mem_event_front_ring_t frontRing_;
+	int requestsFd_;  // tells the event loop about new requests
+	int responsesFd_; // tells the hypervisor thread about new responses
+	pthread_t thread_;
+	bool running_;
+	volatile bool quit_;
+	volatile unsigned short async_;
+	std::vector<bool> paused_;                // hypervisor thread only
+	uint64_t sequence_;                       // hypervisor thread only
+	std::vector<uint64_t> injectedAt_;        // hypervisor thread only
+	std::vector<unsigned int> asyncInFlight_; // async requests not answered yet, hypervisor thread only
+	std::vector<Registers> snapshots_;        // hypervisor thread only, see inject()
+	Histogram latencies_;                     // hypervisor thread only
+	Histogram published_;                     // see takeLatencies()
+	pthread_mutex_t lock_;                    // protects published_
+	volatile uint64_t injected_;
+	volatile uint64_t answered_;
+	volatile uint64_t backlog_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMOCKEVENTMANAGER_H_INCLUDED__
@@ -0,0 +1,98 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMOCKGUEST_H_INCLUDED__
+#define __BDVMIMOCKGUEST_H_INCLUDED__
+
+#include "driver.h"
+#include <stdint.h>
+#include <vector>
+
+namespace bdvmi {
+
+/*
+ * A simulated guest: sparse physical memory (pages get allocated, zeroed, on first use),
+ * 4-level page tables built on demand and a register file per VCPU. Pages are never freed
+ * before the guest goes away, so page() pointers stay valid, and can be looked up from any
+ * thread without locking.
+ */
+class MockGuest {
+
+public:
+	MockGuest( unsigned int vcpus, uint64_t memorySize );
+
+	~MockGuest();
+
+public:
+	unsigned int vcpus() const
+	{
+		return regs_.size();
+	}
+
+	uint64_t memorySize() const
+	{
+		return pages_.size() << PAGE_SHIFT;
+	}
+
+	// The page at gfn, allocated if create is set. NULL if out of range or not present.
+	char *page( uint64_t gfn, bool create );
+
+	// Pages not present read as zeroes
+	bool read( uint64_t gpa, void *buffer, size_t size ) const;
+
+	bool write( uint64_t gpa, const void *buffer, size_t size );
+
+	// A free physical page, taken from the top of memory (the bottom is left to the caller)
+	uint64_t allocPage();
+
+	// A new (empty) 4-level paging address space, returns its CR3
+	uint64_t createAddressSpace();
+
+	// Map the gva page to the gpa page in the cr3 address space, page tables come from allocPage()
+	bool mapPage( uint64_t cr3, uint64_t gva, uint64_t gpa, bool writable = true );
+
+	// Not synchronized, only one thread should touch a VCPU's registers at a time
+	Registers &registers( unsigned short vcpu )
+	{
+		return regs_[vcpu];
+	}
+
+	const Registers &registers( unsigned short vcpu ) const
+	{
+		return regs_[vcpu];
+	}
+
+	// Registers for 64-bit code running with cr3 (paging on, PAE, long mode)
+	void longMode( unsigned short vcpu, uint64_t cr3, uint64_t rip );
+
+public:
+	static const unsigned int PAGE_SHIFT = 12;
+
+private:
+	// Don't allow copying for these objects (class has pages_)
+	MockGuest( const MockGuest & );
+
+	// Don't allow copying for these objects (class has pages_)
+	MockGuest &operator=( const MockGuest & );
+
+private:
+	std::vector<char *> pages_;
+	std::vector<Registers> regs_;
+	volatile uint64_t nextFree_; // allocPage() goes down from here
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMOCKGUEST_H_INCLUDED__
@@ -0,0 +1,50 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMOCKOPTIONS_H_INCLUDED__
+#define __BDVMIMOCKOPTIONS_H_INCLUDED__
+
+#include <stdint.h>
+
+namespace bdvmi {
+
+// What BACKEND_MOCK simulates (see MockDriver and MockEventManager)
+struct MockOptions {
+	MockOptions()
+	    : vcpus( 1 ), memorySize( 1ULL << 30 ), pages( 1024 ), events( 0 ), rate( 0 ), pageFaults( 1 ),
+	      crWrites( 0 ), msrWrites( 0 ), vmcalls( 0 )
+	{
+	}
+
+	unsigned int vcpus;
+	// Guest physical address space size. Pages only take up host memory once touched.
+	uint64_t memorySize;
+	// Pages in the working set (mapped in the guest's address space) the page faults hit
+	unsigned int pages;
+	// Requests to inject, 0 means until stopped. The session is over once all are answered.
+	uint64_t events;
+	// Requests per second, 0 means as fast as they're answered
+	unsigned int rate;
+	// The request mix: relative weights of page faults, CR3 writes, MSR writes and VMCALLs.
+	// Only the types enabled with the handler flags are injected.
+	unsigned int pageFaults;
+	unsigned int crWrites;
+	unsigned int msrWrites;
+	unsigned int vmcalls;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMOCKOPTIONS_H_INCLUDED__
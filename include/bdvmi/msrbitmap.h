@@ -0,0 +1,99 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMSRBITMAP_H_INCLUDED__
+#define __BDVMIMSRBITMAP_H_INCLUDED__
+
+#include <cstring>
+#include <set>
+#include <vector>
+
+namespace bdvmi {
+
+/*
+ * Set of MSR indices. The two architectural ranges (0x00000000 - 0x00001fff and
+ * 0xc0000000 - 0xc0001fff, the same ones VMX MSR bitmaps cover) are plain bitmaps,
+ * so test() is a couple of instructions for all the MSRs that matter in practice.
+ */
+class MsrBitmap {
+
+public:
+	MsrBitmap()
+	{
+		memset( bits_, 0, sizeof( bits_ ) );
+	}
+
+public:
+	// Returns the previous state of the MSR
+	bool set( unsigned int msr, bool enable )
+	{
+		int bit = index( msr );
+
+		if ( bit < 0 )
+			return enable ? !others_.insert( msr ).second : ( others_.erase( msr ) != 0 );
+
+		unsigned char mask = 1 << ( bit & 7 );
+		bool old = ( bits_[bit >> 3] & mask ) != 0;
+
+		if ( enable )
+			bits_[bit >> 3] |= mask;
+		else
+			bits_[bit >> 3] &= ~mask;
+
+		return old;
+	}
+
+	bool test( unsigned int msr ) const
+	{
+		int bit = index( msr );
+
+		if ( bit < 0 )
+			return !others_.empty() && others_.find( msr ) != others_.end();
+
+		return ( bits_[bit >> 3] & ( 1 << ( bit & 7 ) ) ) != 0;
+	}
+
+	// Appends every MSR in the set to msrs
+	void list( std::vector<unsigned int> &msrs ) const
+	{
+		for ( int bit = 0; bit < 2 * RANGE_SIZE; ++bit )
+			if ( bits_[bit >> 3] & ( 1 << ( bit & 7 ) ) )
+				msrs.push_back( bit < RANGE_SIZE ? bit : 0xc0000000 + ( bit - RANGE_SIZE ) );
+
+		msrs.insert( msrs.end(), others_.begin(), others_.end() );
+	}
+
+private:
+	enum { RANGE_SIZE = 0x2000 };
+
+	static int index( unsigned int msr )
+	{
+		if ( msr < RANGE_SIZE )
+			return msr;
+
+		if ( msr - 0xc0000000 < RANGE_SIZE )
+			return RANGE_SIZE + ( msr - 0xc0000000 );
+
+		return -1;
+	}
+
+private:
+	unsigned char bits_[2 * RANGE_SIZE / 8];
+	std::set<unsigned int> others_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMSRBITMAP_H_INCLUDED__
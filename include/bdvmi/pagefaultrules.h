@@ -0,0 +1,79 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIPAGEFAULTRULES_H_INCLUDED__
+#define __BDVMIPAGEFAULTRULES_H_INCLUDED__
+
+#include <stdint.h>
+#include <vector>
+#include "eventhandler.h"
+
+namespace bdvmi {
+
+/*
+ * A set of page fault rules, for faults that always get the same answer. A fault matching one of
+ * them is answered with the rule's action by the event manager, without involving the handler
+ * (see EventFilter::pageFaultRules()).
+ */
+class PageFaultRules {
+
+public:
+	enum { ACCESS_R = 1, ACCESS_W = 2, ACCESS_X = 4 };
+
+	static const uint64_t ANY_CR3;
+
+public:
+	// Faults on guest frames [gfnStart, gfnEnd], for accesses in access (all of the faulting
+	// accesses need to be there), caused by an instruction in [ripStart, ripEnd] running in the
+	// cr3 address space (or any). If more rules match, the one added first wins. Actions that
+	// depend on the instruction (SKIP_INSTRUCTION, EMULATE_SET_CTXT) can't be used.
+	bool add( uint64_t gfnStart, uint64_t gfnEnd, unsigned int access, uint64_t ripStart, uint64_t ripEnd,
+	          uint64_t cr3, HVAction action );
+
+	void clear();
+
+	bool empty() const
+	{
+		return rules_.empty();
+	}
+
+	// Build the lookup table. match() only sees the rules added before the last compile().
+	void compile();
+
+	bool match( uint64_t gfn, unsigned int access, uint64_t rip, uint64_t cr3, HVAction &action ) const;
+
+private:
+	struct Rule {
+		uint64_t gfnStart;
+		uint64_t gfnEnd;
+		uint64_t ripStart;
+		uint64_t ripEnd;
+		uint64_t cr3;
+		unsigned int access;
+		HVAction action;
+	};
+
+private:
+	std::vector<Rule> rules_;
+	// Compiled form: disjoint GFN intervals, starting at segmentStarts_[i] and ending where the
+	// next one starts, each with the rules covering it (in order) in segmentRules_[first, next first)
+	std::vector<uint64_t> segmentStarts_;
+	std::vector<uint32_t> segmentFirst_;
+	std::vector<Rule> segmentRules_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIPAGEFAULTRULES_H_INCLUDED__
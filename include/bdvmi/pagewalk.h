@@ -0,0 +1,96 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIPAGEWALK_H_INCLUDED__
+#define __BDVMIPAGEWALK_H_INCLUDED__
+
+#include <stdint.h>
+#include "driver.h"
+
+namespace bdvmi {
+
+/*
+ * Software x86 page table walk (non-PAE, PAE and 4-level paging), for drivers that keep guest
+ * memory to themselves. Memory needs a bool read( uint64_t gpa, void *buffer, size_t size ) const
+ * member. Only presence is checked, not access rights.
+ */
+template <typename Memory>
+bool walkPageTables( const Memory &memory, const Registers &regs, uint64_t gva, uint64_t &gpa )
+{
+	const uint64_t CR0_PG = 1ULL << 31;
+	const uint64_t CR4_PSE = 1ULL << 4;
+	const uint64_t CR4_PAE = 1ULL << 5;
+	const uint64_t EFER_LMA = 1ULL << 10;
+	const uint64_t PRESENT = 1ULL << 0;
+	const uint64_t LARGE = 1ULL << 7;
+	const uint64_t ADDRESS_MASK = 0x000ffffffffff000ULL;
+
+	if ( !( regs.cr0 & CR0_PG ) ) {
+		gpa = gva;
+		return true;
+	}
+
+	if ( !( regs.cr4 & CR4_PAE ) ) {
+		uint32_t pde, pte;
+
+		if ( !memory.read( ( regs.cr3 & 0xfffff000 ) + ( ( gva >> 22 ) & 0x3ff ) * 4, &pde, 4 ) ||
+		     !( pde & PRESENT ) )
+			return false;
+
+		if ( ( pde & LARGE ) && ( regs.cr4 & CR4_PSE ) ) {
+			gpa = ( pde & 0xffc00000 ) | ( gva & 0x3fffff );
+			return true;
+		}
+
+		if ( !memory.read( ( pde & 0xfffff000 ) + ( ( gva >> 12 ) & 0x3ff ) * 4, &pte, 4 ) ||
+		     !( pte & PRESENT ) )
+			return false;
+
+		gpa = ( pte & 0xfffff000 ) | ( gva & 0xfff );
+		return true;
+	}
+
+	// PAE and 4-level paging share the entry format, PAE just starts with a 4 entry PDPT
+	bool longMode = ( regs.msr_efer & EFER_LMA ) != 0;
+	int levels = longMode ? 4 : 3;
+	uint64_t table = longMode ? ( regs.cr3 & ADDRESS_MASK ) : ( regs.cr3 & 0xffffffe0 );
+
+	for ( int level = levels; level > 0; --level ) {
+		unsigned int shift = 12 + 9 * ( level - 1 );
+		uint64_t index = ( gva >> shift ) & ( ( !longMode && level == 3 ) ? 0x3 : 0x1ff );
+		uint64_t entry;
+
+		if ( !memory.read( table + index * 8, &entry, 8 ) || !( entry & PRESENT ) )
+			return false;
+
+		// 1 GB pages (not in PAE PDPTEs) and 2 MB pages
+		bool large = level == 2 || ( level == 3 && longMode );
+
+		if ( level == 1 || ( large && ( entry & LARGE ) ) ) {
+			uint64_t offsetMask = ( 1ULL << shift ) - 1;
+
+			gpa = ( entry & ADDRESS_MASK & ~offsetMask ) | ( gva & offsetMask );
+			return true;
+		}
+
+		table = entry & ADDRESS_MASK;
+	}
+
+	return false;
+}
+
+} // namespace bdvmi
+
+#endif // __BDVMIPAGEWALK_H_INCLUDED__
@@ -0,0 +1,81 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIREGISTERSVIEW_H_INCLUDED__
+#define __BDVMIREGISTERSVIEW_H_INCLUDED__
+
+#include "driver.h"
+
+namespace bdvmi {
+
+/*
+ * Read-only view of the registers of the VCPU that caused an event. Only the
+ * registers actually asked for get decoded, so handlers that don't look at them
+ * pay nothing. The full Registers structure is built on the first registers()
+ * call. A view is only valid for the duration of the callback it's passed to.
+ */
+class RegistersView {
+
+public:
+	// base class, so virtual destructor
+	virtual ~RegistersView()
+	{
+	}
+
+public:
+	virtual uint64_t sysenter_cs() const = 0;
+	virtual uint64_t sysenter_esp() const = 0;
+	virtual uint64_t sysenter_eip() const = 0;
+	virtual uint64_t msr_efer() const = 0;
+	virtual uint64_t msr_star() const = 0;
+	virtual uint64_t msr_lstar() const = 0;
+	virtual uint64_t fs_base() const = 0;
+	virtual uint64_t gs_base() const = 0;
+
+	virtual uint64_t rax() const = 0;
+	virtual uint64_t rcx() const = 0;
+	virtual uint64_t rdx() const = 0;
+	virtual uint64_t rbx() const = 0;
+	virtual uint64_t rsp() const = 0;
+	virtual uint64_t rbp() const = 0;
+	virtual uint64_t rsi() const = 0;
+	virtual uint64_t rdi() const = 0;
+	virtual uint64_t r8() const = 0;
+	virtual uint64_t r9() const = 0;
+	virtual uint64_t r10() const = 0;
+	virtual uint64_t r11() const = 0;
+	virtual uint64_t r12() const = 0;
+	virtual uint64_t r13() const = 0;
+	virtual uint64_t r14() const = 0;
+	virtual uint64_t r15() const = 0;
+	virtual uint64_t rflags() const = 0;
+	virtual uint64_t rip() const = 0;
+	virtual uint64_t dr7() const = 0;
+	virtual uint64_t cr0() const = 0;
+	virtual uint64_t cr2() const = 0;
+	virtual uint64_t cr3() const = 0;
+	virtual uint64_t cr4() const = 0;
+
+	virtual uint32_t cs_arbytes() const = 0;
+
+	virtual Registers::GuestX86Mode guestX86Mode() const = 0;
+
+	// All of the above at once (registers not carried by the event are zero)
+	virtual const Registers &registers() const = 0;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIREGISTERSVIEW_H_INCLUDED__
@@ -0,0 +1,170 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIREPLAYDRIVER_H_INCLUDED__
+#define __BDVMIREPLAYDRIVER_H_INCLUDED__
+
+#include "driver.h"
+#include "eventtrace.h"
+#include "msrbitmap.h"
+#include "replayoptions.h"
+#include "xeneventmanager.h"
+#include <map>
+#include <vector>
+
+namespace bdvmi {
+
+// Forward declaration, minimize compile-time file dependencies
+class LogHelper;
+
+/*
+ * Driver for a recorded trace (see EventManager::traceEvents()), playing the part of the
+ * hypervisor for ReplayEventManager: guest memory comes from ReplayOptions::memoryImage,
+ * and the VCPU registers from the request being replayed.
+ */
+class ReplayDriver : public Driver {
+
+public:
+	ReplayDriver( const std::string &tracePath, const ReplayOptions &options, LogHelper *logHelper = NULL );
+
+	virtual ~ReplayDriver();
+
+public:
+	virtual bool cpuCount( unsigned int &count ) const throw();
+
+	virtual bool tscSpeed( unsigned long long &speed ) const throw();
+
+	virtual bool mtrrType( unsigned long long guestAddress, uint8_t &type ) const throw();
+
+	virtual bool setPageProtection( unsigned long long guestAddress, bool read, bool write,
+	                                bool execute ) throw();
+
+	virtual bool getPageProtection( unsigned long long guestAddress, bool &read, bool &write,
+	                                bool &execute ) const throw();
+
+	virtual bool registers( unsigned short vcpu, Registers &regs ) const throw();
+
+	virtual bool mtrrs( unsigned short vcpu, Mtrrs &m ) const throw();
+
+	virtual bool setRegisters( unsigned short vcpu, const Registers &regs, bool setEip ) throw();
+
+	virtual bool writeToPhysAddress( unsigned long long address, void *buffer, size_t length ) throw();
+
+	virtual bool enableMsrExit( unsigned int msr, bool &oldValue ) throw();
+
+	virtual bool disableMsrExit( unsigned int msr, bool &oldValue ) throw();
+
+	virtual bool isMsrEnabled( unsigned int msr, bool &enabled ) const throw()
+	{
+		enabled = msrs_.test( msr );
+		return true;
+	}
+
+	virtual MapReturnCode mapPhysMemToHost( unsigned long long address, size_t length, uint32_t flags,
+	                                        void *&pointer ) throw();
+
+	virtual bool unmapPhysMem( void *hostPtr ) throw();
+
+	virtual MapReturnCode mapVirtMemToHost( unsigned long long address, size_t length, uint32_t flags,
+	                                        unsigned short vcpu, void *&pointer ) throw();
+
+	virtual bool unmapVirtMem( void *hostPtr ) throw();
+
+	virtual bool cacheGuestVirtAddr( unsigned long long addr ) throw();
+
+	virtual bool requestPageFault( int vcpu, uint64_t addressSpace, uint64_t virtualAddress,
+	                               uint32_t writeAccess ) throw();
+
+	virtual bool disableRepOptimizations() throw();
+
+	virtual bool shutdown() throw();
+
+	virtual bool pause() throw();
+
+	virtual bool unpause() throw();
+
+	virtual bool setPageCacheLimit( size_t limit ) throw();
+
+	virtual std::string uuid() const throw()
+	{
+		return uuid_;
+	}
+
+	virtual unsigned int id() const throw()
+	{
+		return 0;
+	}
+
+	virtual unsigned int protectionGeneration() const throw()
+	{
+		return protectionGeneration_;
+	}
+
+public: // Replay-specific stuff
+	const EventTraceReader &trace() const
+	{
+		return trace_;
+	}
+
+	const ReplayOptions &options() const
+	{
+		return options_;
+	}
+
+	// The ring ReplayEventManager feeds the trace through
+	mem_event_sring_t *ring() const
+	{
+		return ring_;
+	}
+
+	// The request being handled for vcpu (where registers() come from), copied. Called by
+	// ReplayEventManager on the thread about to handle it.
+	void currentRequest( unsigned short vcpu, const mem_event_request_t *req );
+
+	// For walkPageTables()
+	bool read( uint64_t gpa, void *buffer, size_t size ) const;
+
+private:
+	// Don't allow copying for these objects (class has memory_ and ring_)
+	ReplayDriver( const ReplayDriver & );
+
+	// Don't allow copying for these objects (class has memory_ and ring_)
+	ReplayDriver &operator=( const ReplayDriver & );
+
+private:
+	void cleanup();
+
+private:
+	EventTraceReader trace_;
+	ReplayOptions options_;
+	LogHelper *logHelper_;
+	std::string uuid_;
+	char *memory_;
+	size_t memorySize_;
+	mem_event_sring_t *ring_;
+	unsigned int cpuCount_;
+	// Per VCPU, written by the thread handling the VCPU's events (so no std::vector<bool>)
+	std::vector<mem_event_request_t> requests_;
+	std::vector<char> hasRequest_;
+	std::vector<Registers> setRegisters_; // overrides the request's registers until the next one
+	std::vector<char> registersSet_;
+	MsrBitmap msrs_;
+	std::map<unsigned long long, unsigned char> protections_; // GFN -> R/W/X bits, RWX if not there
+	volatile unsigned int protectionGeneration_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIREPLAYDRIVER_H_INCLUDED__
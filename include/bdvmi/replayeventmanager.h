@@ -0,0 +1,101 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIREPLAYEVENTMANAGER_H_INCLUDED__
+#define __BDVMIREPLAYEVENTMANAGER_H_INCLUDED__
+
+#include "xeneventmanager.h"
+#include <deque>
+#include <vector>
+
+namespace bdvmi {
+
+class ReplayDriver;
+
+/*
+ * Plays a recorded trace back into the EventHandler, through the same request handling code
+ * XenEventManager uses, on a ring of its own. A VCPU only gets its next request once the
+ * previous (synchronous) one has been answered, like with a real guest. The session is over
+ * once the trace has been played ReplayOptions::loops times.
+ */
+class ReplayEventManager : public XenEventManager {
+
+public:
+	ReplayEventManager( ReplayDriver &driver, unsigned short handlerFlags, LogHelper *logHelper = NULL );
+
+	virtual ~ReplayEventManager();
+
+public:
+	virtual void waitForEvents();
+
+	// Doesn't wait for ReplayOptions::realTime pacing, call it again later
+	virtual bool processPending( unsigned int maxEvents = 0 );
+
+	// Nothing to poll for, just call processPending() in a loop
+	virtual int pollFd() const
+	{
+		return -1;
+	}
+
+	// Not available with ReplayOptions::deterministic
+	virtual bool parallelDispatch( unsigned int workers );
+
+public: // Replay-specific stuff
+	uint64_t replayed() const
+	{
+		return replayed_;
+	}
+
+	// Responses whose flags differ from the recorded ones
+	uint64_t mismatches() const
+	{
+		return mismatches_;
+	}
+
+private:
+	// Have the driver's registers() come from req while it's being handled
+	virtual void beginRequest( const mem_event_request_t &req );
+
+	// Put the requests that are due on the ring. Returns how long to wait (in ms) before the
+	// next one is due, 0 if there's work to do right away, -1 to wait for responses.
+	int feed();
+
+	// Pick up the responses
+	void collect();
+
+private:
+	// Don't allow copying for these objects
+	ReplayEventManager( const ReplayEventManager & );
+
+	// Don't allow copying for these objects
+	ReplayEventManager &operator=( const ReplayEventManager & );
+
+private:
+	ReplayDriver &driver_;
+	mem_event_front_ring_t frontRing_;
+	size_t next_; // the next record to put on the ring
+	unsigned int loop_;
+	uint64_t startNs_;
+	uint64_t startTsc_;
+	std::vector<std::deque<size_t> > onRing_; // records on the ring, per VCPU
+	std::vector<bool> paused_;                // the VCPU is waiting for a response
+	unsigned int outstanding_;
+	uint64_t replayed_;
+	uint64_t mismatches_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIREPLAYEVENTMANAGER_H_INCLUDED__
@@ -0,0 +1,46 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIREPLAYOPTIONS_H_INCLUDED__
+#define __BDVMIREPLAYOPTIONS_H_INCLUDED__
+
+#include <string>
+
+namespace bdvmi {
+
+// How BACKEND_REPLAY plays back a trace recorded with EventManager::traceEvents()
+struct ReplayOptions {
+	ReplayOptions() : realTime( false ), speed( 1.0 ), deterministic( true ), loops( 1 )
+	{
+	}
+
+	// The trace the domain watcher reports (driver() takes the trace path as the domain name)
+	std::string trace;
+	// Guest physical memory as a flat file, the offset being the address (sparse files are
+	// fine, e.g. for synthesized images). Writes stay in memory. Empty means no memory.
+	std::string memoryImage;
+	// Keep the recorded spacing between requests (scaled by speed) instead of going as fast
+	// as possible
+	bool realTime;
+	double speed;
+	// Handle the requests one by one, in the recorded order (no parallelDispatch())
+	bool deterministic;
+	// Play the trace this many times (0 means until stopped)
+	unsigned int loops;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIREPLAYOPTIONS_H_INCLUDED__
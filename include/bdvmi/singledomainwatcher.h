@@ -0,0 +1,47 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMISINGLEDOMAINWATCHER_H_INCLUDED__
+#define __BDVMISINGLEDOMAINWATCHER_H_INCLUDED__
+
+#include "domainwatcher.h"
+#include "eventpoller.h"
+#include <string>
+
+namespace bdvmi {
+
+// Reports a single, already running domain: for backends without a hypervisor to ask (trace
+// replay, mock guests)
+class SingleDomainWatcher : public DomainWatcher {
+
+public:
+	SingleDomainWatcher( const std::string &name );
+
+private:
+	virtual bool waitForDomainsOrTimeout( std::list<DomainInfo> &domains, int ms );
+
+	virtual void wakeUp();
+
+	virtual bool watchStopSignals( const sigset_t &signals );
+
+private:
+	std::string name_;
+	bool reported_;
+	EventPoller poller_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMISINGLEDOMAINWATCHER_H_INCLUDED__
@@ -0,0 +1,173 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+#ifndef __BDVMISTATSPAGE_H_INCLUDED__
+#define __BDVMISTATSPAGE_H_INCLUDED__
+
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+
+namespace bdvmi {
+
+/*
+ * One component's counters in the shared memory stats page. Each slot has a single writer,
+ * and readers use sequence as a seqlock: it's odd while the slot is being written, so a copy
+ * is consistent if sequence was even and unchanged before and after taking it.
+ */
+struct StatsSlot {
+	enum Kind { FREE, EVENT_MANAGER, DRIVER, DOMAIN_WATCHER, KINDS };
+
+	enum { NAME_SIZE = 48, VALUES = 24 };
+
+	// EVENT_MANAGER values (times are in nanoseconds)
+	enum {
+		EM_EVENTS,
+		EM_PAGE_FAULTS,
+		EM_CR,
+		EM_MSR,
+		EM_VMCALL,
+		EM_XSETBV,
+		EM_OTHER,
+		EM_FILTERED,
+		EM_IN_FLIGHT,
+		EM_SPIN_WAKEUPS,
+		EM_SLEEP_WAKEUPS,
+		EM_SPIN_TIME,
+		EM_HANDLER_TIME,
+		EM_RESPONSES,
+		EM_RESPONSE_TIME,
+		EM_RESPONSE_P99,
+		EM_NOTIFIES,
+		EM_NOTIFY_TIME,
+		EM_BATCHES,
+		EM_DEADLINE_MISSES,
+		EM_LATE_DECISIONS,
+		EM_SHED,
+		EM_GOVERNOR_LEVEL,
+		EM_VALUES
+	};
+
+	// DRIVER values
+	enum {
+		DRV_HYPERCALLS,
+		DRV_CACHE_HITS,
+		DRV_CACHE_MISSES,
+		DRV_CACHE_EVICTIONS,
+		DRV_CACHE_PAGES,
+		DRV_MAP_FAILURES,
+		DRV_VALUES
+	};
+
+	// DOMAIN_WATCHER values
+	enum { DW_WAKEUPS, DW_DOMAINS, DW_PROTECTED_DOMAINS, DW_VALUES };
+
+	volatile uint32_t sequence;
+	volatile uint32_t kind;
+	char name[NAME_SIZE];
+	volatile uint64_t updated; // CLOCK_MONOTONIC, in nanoseconds
+	volatile uint64_t values[VALUES];
+};
+
+struct StatsPageHeader {
+	enum { MAGIC = 0x53494d56 /* "VMIS" */, VERSION = 1 };
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;
+	uint32_t slots; // following the header
+};
+
+/*
+ * Publishes the process' counters (event managers, drivers, domain watchers) in a shared
+ * memory segment, /dev/shm/bdvmi-stats.<pid>, for tools/bdvmistat and the like to watch
+ * without making the introspection threads do anything. Off until open() is called. Each
+ * component writes its own slot from its own thread, at most every 100 ms.
+ */
+class StatsPage {
+
+public:
+	// Create the segment (with room for slots components), false on failure
+	static bool open( unsigned int slots = 64 );
+
+	// Remove the segment. Slots already handed out stay valid (but nobody can see them).
+	static void close();
+
+	static bool enabled()
+	{
+		return page_ != NULL;
+	}
+
+	// A slot for one component, NULL if the stats page is off or full
+	static StatsSlot *acquire( StatsSlot::Kind kind, const std::string &name );
+
+	static void release( StatsSlot *slot );
+
+	// Update the slot's values (only its owner may call this)
+	static void publish( StatsSlot *slot, const uint64_t *values, unsigned int count );
+
+	static std::string path( pid_t pid );
+
+	// What the values mean, for readers. NULL for unused values.
+	static const char *kindName( uint32_t kind );
+
+	static const char *valueName( uint32_t kind, unsigned int index );
+
+	// Whether the value only ever goes up (so its rate makes sense), rather than being a level
+	static bool valueIsCounter( uint32_t kind, unsigned int index );
+
+private:
+	static StatsPageHeader *page_;
+	static size_t size_;
+};
+
+/*
+ * Reading another process' stats page.
+ */
+class StatsPageReader {
+
+public:
+	StatsPageReader();
+
+	~StatsPageReader();
+
+public:
+	// Map pid's stats page, false if there's none (or it's not one we understand)
+	bool attach( pid_t pid );
+
+	void detach();
+
+	unsigned int slots() const
+	{
+		return page_ ? page_->slots : 0;
+	}
+
+	// A consistent copy of slot index, false if it's free (or kept changing)
+	bool read( unsigned int index, StatsSlot &slot ) const;
+
+private:
+	// No copying allowed (class has a mapping)
+	StatsPageReader( const StatsPageReader & );
+
+	// No copying allowed (class has a mapping)
+	StatsPageReader &operator=( const StatsPageReader & );
+
+private:
+	const StatsPageHeader *page_;
+	size_t size_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMISTATSPAGE_H_INCLUDED__
@@ -17,6 +17,7 @@
 #define __BDVMXENCACHE_H_INCLUDED__
 
 #include <map>
+#include <pthread.h>
 #include "driver.h"
 
 extern "C" {
@@ -34,13 +35,13 @@ public:
 
 private:
 	struct CacheInfo {
-		CacheInfo() : accessed( 0 ), pointer( NULL ), in_use( true )
+		CacheInfo() : accessed( 0 ), pointer( NULL ), users( 1 )
 		{
 		}
 
 		unsigned long accessed;
 		void *pointer;
-		bool in_use;
+		unsigned int users; // update()s not yet release()d, only unused pages get evicted
 	};
 
 	typedef std::map<unsigned long, CacheInfo> cache_t;
@@ -51,15 +52,22 @@ public:
 
 	XenPageCache( LogHelper *logHelper = NULL );
 
-	~XenPageCache();
+	virtual ~XenPageCache();
 
-public:
+public: // update(), release(), setLimit() and statistics() may be called from several threads
 	void init( xc_interface *xci, domid_t domain );
 	bool setLimit( size_t limit );
 
 	MapReturnCode update( unsigned long gfn, void *&pointer );
 	void release( void *pointer );
 
+	// Fill in the page cache part of stats
+	void statistics( DriverStatistics &stats ) const;
+
+protected:
+	// Map a single guest page, NULL on failure. The pages are released with munmap(2).
+	virtual void *mapPage( unsigned long gfn );
+
 private:
 	MapReturnCode insertNew( unsigned long gfn, void *&pointer );
 	void cleanup();
@@ -76,6 +84,11 @@ private:
 	domid_t domain_;
 	size_t cacheLimit_;
 	LogHelper *logHelper_;
+	uint64_t hits_;
+	uint64_t misses_;
+	uint64_t evictions_;
+	uint64_t failures_;
+	mutable pthread_mutex_t lock_;
 };
 
 } // namespace bdvmi
@@ -0,0 +1,70 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIXENCOMPLETIONQUEUE_H_INCLUDED__
+#define __BDVMIXENCOMPLETIONQUEUE_H_INCLUDED__
+
+namespace bdvmi {
+
+// Forward declaration, minimize compile-time file dependencies
+struct XenPendingEvent;
+
+/*
+ * Lock-free queue of handled events. Any thread can push(), but only the event
+ * loop thread can pop. Events pushed by the same thread are popped in the same
+ * order. fd() becomes readable when the queue goes from empty to non-empty.
+ */
+class XenCompletionQueue {
+
+public:
+	XenCompletionQueue();
+
+	~XenCompletionQueue();
+
+public:
+	void push( XenPendingEvent *ev );
+
+	// Take all the queued events at once, oldest first
+	XenPendingEvent *popAll();
+
+	// Cheap check for busy polling (no fd() notification needed)
+	bool pending() const
+	{
+		return head_ != NULL;
+	}
+
+	int fd() const
+	{
+		return fd_;
+	}
+
+	// Acknowledge the fd() notification (call before popAll())
+	void clearNotification();
+
+private:
+	// No copying allowed (class has fd_)
+	XenCompletionQueue( const XenCompletionQueue & );
+
+	// No copying allowed (class has fd_)
+	XenCompletionQueue &operator=( const XenCompletionQueue & );
+
+private:
+	XenPendingEvent *volatile head_;
+	int fd_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIXENCOMPLETIONQUEUE_H_INCLUDED__
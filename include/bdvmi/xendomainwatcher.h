@@ -18,6 +18,7 @@
 
 #include "domainwatcher.h"
 #include "exception.h"
+#include "eventpoller.h"
 #include <set>
 
 extern "C" {
@@ -52,6 +53,10 @@ private:
 private:
 	virtual bool waitForDomainsOrTimeout( std::list<DomainInfo> &domains, int ms );
 
+	virtual void wakeUp();
+
+	virtual bool watchStopSignals( const sigset_t &signals );
+
 private:
 	xs_handle *xsh_;
 	xc_interface *xci_;
@@ -59,6 +64,7 @@ private:
 	const std::string releaseToken_;
 	std::set<domid_t> domIds_;
 	LogHelper *logHelper_;
+	EventPoller poller_;
 };
 
 } // namespace bdvmi
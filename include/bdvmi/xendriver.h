@@ -21,10 +21,12 @@
 #include <string>
 #include <sstream>
 #include <map>
+#include <pthread.h>
 
 #include "driver.h"
 #include "exception.h"
 #include "xencache.h"
+#include "msrbitmap.h"
 
 extern "C" {
 #include <xenstore.h>
@@ -36,6 +38,8 @@ namespace bdvmi {
 
 class LogHelper;
 
+// Safe to use from several threads at once (i.e. from EventHandler callbacks with
+// EventManager::parallelDispatch() on).
 class XenDriver : public Driver {
 
 public:
@@ -72,11 +76,7 @@ public:
 
 	virtual bool disableMsrExit( unsigned int msr, bool &oldValue ) throw();
 
-	virtual bool isMsrEnabled( unsigned int msr, bool &enabled ) const throw()
-	{
-		enabled = msrs_.find( msr ) != msrs_.end();
-		return true;
-	}
+	virtual bool isMsrEnabled( unsigned int msr, bool &enabled ) const throw();
 
 	virtual MapReturnCode mapPhysMemToHost( unsigned long long address, size_t length, uint32_t flags,
 	                                        void *&pointer ) throw();
@@ -113,15 +113,28 @@ public:
 		return domain_;
 	}
 
+	virtual unsigned int protectionGeneration() const throw()
+	{
+		return protectionGeneration_;
+	}
+
+	virtual bool statistics( DriverStatistics &stats ) const throw();
+
 public: // Xen specific-stuff
 	xc_interface *nativeHandle() const
 	{
 		return xci_;
 	}
 
+	// Have the hypervisor trap (or stop trapping) all the MSRs enableMsrExit() has been
+	// asked for. While they're off, enableMsrExit() and disableMsrExit() only keep track.
+	bool msrExits( bool enable ) const throw();
+
 public:
 	static int32_t guestX86Mode( const Registers &regs );
 
+	static int32_t guestX86Mode( uint64_t cr0, uint64_t rflags, uint64_t msr_efer, uint32_t cs_arbytes );
+
 private:
 	// Don't allow copying for these objects (class has xci_)
 	XenDriver( const XenDriver & );
@@ -142,17 +155,24 @@ private:
 
 	void getMtrrRange( uint64_t base_msr, uint64_t mask_msr, uint64_t &base, uint64_t &end ) const;
 
+	// One more call into the hypervisor (see statistics()), name is for the hypercall tracepoint
+	void countHypercall( const char *name ) const;
+
 private:
 	xc_interface *xci_;
 	xs_handle *xsh_;
 	domid_t domain_;
 	unsigned int physAddr_;
-	std::set<unsigned int> msrs_;
-	XenPageCache pageCache_;
+	MsrBitmap msrs_;
+	XenPageCache pageCache_; // has its own lock
 	std::map<unsigned long long, unsigned long> addressCache_;
+	mutable bool msrExitsOn_;
+	mutable pthread_mutex_t lock_; // protects msrs_, msrExitsOn_ and addressCache_
 	int guestWidth_;
 	LogHelper *logHelper_;
 	std::string uuid_;
+	volatile unsigned int protectionGeneration_;
+	mutable uint64_t hypercalls_; // not counting the page cache's
 };
 
 } // namespace bdvmi
@@ -36,6 +36,7 @@ extern "C" {
 #define mem_event_request_t vm_event_request_t
 #define mem_event_response_t vm_event_response_t
 #define mem_event_back_ring_t vm_event_back_ring_t
+#define mem_event_front_ring_t vm_event_front_ring_t
 #define mem_event_sring_t vm_event_sring_t
 #define MEM_EVENT_REASON_VIOLATION VM_EVENT_REASON_MEM_ACCESS
 #define MEM_EVENT_REASON_CR0 VM_EVENT_REASON_MOV_TO_CR0
@@ -44,6 +45,7 @@ extern "C" {
 #define MEM_EVENT_REASON_MSR VM_EVENT_REASON_MOV_TO_MSR
 #define MEM_EVENT_FLAG_EMULATE VM_EVENT_FLAG_EMULATE
 #define MEM_EVENT_FLAG_EMULATE_NOWRITE VM_EVENT_FLAG_EMULATE_NOWRITE
+#define MEM_EVENT_FLAG_VCPU_PAUSED VM_EVENT_FLAG_VCPU_PAUSED
 #else
 #include <xen/mem_event.h>
 #endif
@@ -51,10 +53,22 @@ extern "C" {
 }
 
 #include "xeninlines.h"
+#include "xencompletionqueue.h"
+#include "eventpoller.h"
+#include "decisioncache.h"
+#include "eventtrace.h"
+#include "driver.h"
+#include "statspage.h"
+#include <deque>
+#include <utility>
+#include <vector>
 
 namespace bdvmi {
 
+class Driver;
 class XenDriver;
+class XenVcpuDispatcher;
+struct XenPendingEvent;
 class LogHelper;
 
 class XenEventManager : public EventManager {
@@ -78,6 +92,103 @@ public:
 	// Stop the event loop
 	virtual void stop();
 
+	virtual int pollFd() const
+	{
+		return poller_.fd();
+	}
+
+	virtual bool processPending( unsigned int maxEvents = 0 );
+
+	virtual bool hasPendingEvents();
+
+	// Hand events over to a pool of worker threads (0 means handle them on the waitForEvents() thread)
+	virtual bool parallelDispatch( unsigned int workers );
+
+	virtual bool monitorCRBits( unsigned short crNumber, uint64_t mask );
+
+	virtual bool asyncEvents( unsigned short flags );
+
+	virtual bool stopSignals( const sigset_t &signals );
+
+	virtual bool busyPoll( unsigned int maxSpinUs );
+
+	virtual bool handlerDeadline( unsigned int us, HVAction fallback = NONE );
+
+	virtual bool overheadBudget( unsigned int cpuPercent, unsigned int maxRate = 0,
+	                             GovernorLevel maxLevel = GOVERNOR_SAMPLED );
+
+	virtual GovernorLevel governorLevel() const
+	{
+		return governorLevel_;
+	}
+
+	virtual bool statistics( EventStatistics &stats ) const;
+
+	virtual ResponseToken deferResponse();
+
+	virtual bool completeResponse( ResponseToken token, HVAction action, const uint8_t *emulatorCtx = NULL,
+	                               uint32_t emuCtxSize = 0, unsigned short instructionSize = 0 );
+
+	virtual bool decisionCache( size_t maxEntries );
+
+	virtual bool cacheDecision();
+
+	virtual void invalidateDecisions();
+
+	virtual bool traceEvents( const std::string &path );
+
+public:
+	// The registers saved in a ring request
+	static void requestRegisters( const mem_event_request_t &req, Registers &regs );
+
+	// Requests as the hypervisor would put them on the ring (VCPU paused), for simulated guests
+	static void pageFaultRequest( mem_event_request_t &req, unsigned short vcpu, const Registers &regs,
+	                              uint64_t gpa, uint64_t gla, bool write, bool execute );
+
+	static void crRequest( mem_event_request_t &req, unsigned short vcpu, const Registers &regs,
+	                       unsigned short crNumber, uint64_t oldValue, uint64_t newValue );
+
+	static void msrRequest( mem_event_request_t &req, unsigned short vcpu, const Registers &regs, uint32_t msr,
+	                        uint64_t value );
+
+	static void vmcallRequest( mem_event_request_t &req, unsigned short vcpu, const Registers &regs );
+
+protected:
+	// Run on a ring set up (and fed) by the caller instead of the hypervisor's, e.g. to replay
+	// recorded events. No hypervisor calls are made.
+	XenEventManager( const Driver &driver, unsigned short handlerFlags, LogHelper *logHelper,
+	                 mem_event_sring_t *sring );
+
+	// One round of waitForEvents(): wait up to ms for something to happen, then handle at most budget
+	// requests (0 means no limit). Returns false when the loop is over.
+	bool runOnce( int ms, unsigned int budget );
+
+	bool stopping() const
+	{
+		return stop_;
+	}
+
+	// For a ring fed from another thread: fd becomes readable when there are new requests
+	// (an eventfd(2), reset by the event loop)
+	void watchLocalRing( int fd );
+
+	// Called when the feeder asked to be told about new responses (RING_FINAL_CHECK_FOR_RESPONSES())
+	virtual void notifyLocalRing()
+	{
+	}
+
+	// Called on the thread about to hand req to the EventHandler (the event loop's, or a dispatch
+	// worker's), before any callback runs
+	virtual void beginRequest( const mem_event_request_t & /* req */ )
+	{
+	}
+
+	// Called when the events in asynchronous mode have changed, flags being all of them (the
+	// application's asyncEvents() and the overhead governor's)
+	virtual void asyncFlagsChanged( unsigned short /* flags */ )
+	{
+	}
+
 private:
 	void initXenStore();
 
@@ -85,13 +196,111 @@ private:
 
 	void initMemAccess();
 
+	bool syncEvents( unsigned short type ) const
+	{
+		return ( asyncFlags_ & type ) == 0;
+	}
+
+#if __XEN_LATEST_INTERFACE_VERSION__ < 0x00040600
+	int hvmpmeMode( unsigned short type ) const
+	{
+		return syncEvents( type ) ? HVMPME_mode_sync : HVMPME_mode_async;
+	}
+#endif
+
 	int waitForEventOrTimeout( int ms );
 
+	// Spin until there's something to do or the (adaptive) spin budget runs out. Returns
+	// false if the loop should block instead.
+	bool spinForRequests();
+
+	// Account for a batch of events found by spinning or after blocking
+	void noteBatch( unsigned int events, bool spun );
+
+	// Handle the requests currently on the ring (up to budget, if not 0), in batches. Returns the number
+	// of responses sent.
+	unsigned int drainRing( unsigned int budget );
+
+	// Dispatch a single request to the handler and fill in its response (regs is scratch storage, ev is
+	// NULL for requests still in the ring, stats are the calling thread's). Returns false if the handler
+	// deferred the response.
+	bool handleRequest( const mem_event_request_t &req, mem_event_response_t &rsp, Registers &regs,
+	                    XenPendingEvent *ev, EventStatistics &stats );
+
+	// Run the request by the event filter (and the driver's enabled MSRs) and the decision cache.
+	// For requests they turn down, action and instructionSize are the answer.
+	bool wantsEvent( const mem_event_request_t &req, HVAction &action, unsigned short &instructionSize );
+
+	// Remember the handler's decision for a page fault (right away if ev is NULL, otherwise when
+	// the response gets back to the event loop)
+	void rememberDecision( const mem_event_request_t &req, HVAction action, unsigned short instructionSize,
+	                       XenPendingEvent *ev );
+
+	// Empty the decision cache if anything it depends on has changed since it was last used
+	void checkDecisions();
+
+	// What cached decisions depend on, changes whenever any of it does
+	unsigned int decisionsGeneration();
+
+	// Update our slots in the stats page, if it's been a while
+	void publishStatistics();
+
+	// Check the load against the overhead budget, once per measurement window
+	void runGovernor();
+
+	void changeGovernorLevel( GovernorLevel level );
+
+	// Switch the events in flags to asynchronous mode, and the rest back (see asyncEvents())
+	bool applyAsyncFlags( unsigned short flags );
+
+	// Turn CR3 write events off and back on in the hypervisor, leaving CR0 and CR4 alone
+	void monitorCR3( bool enable );
+
+	// Whether the current governor level keeps this (wanted) request away from the handler
+	bool shedEvent( const mem_event_request_t &req );
+
+	void traceEvent( const mem_event_request_t &req, const mem_event_response_t &rsp, uint64_t startTsc,
+	                 uint32_t flags );
+
+	// Translate the handler's decision into the response
+	void applyAction( const mem_event_request_t &req, mem_event_response_t &rsp, HVAction action,
+	                  const uint8_t *emulatorCtx, uint32_t emuCtxSize, unsigned short instructionSize );
+
+	// handleRequest() for a request copied out of the ring (called by the dispatch threads)
+	bool handleEvent( XenPendingEvent &ev, Registers &regs, EventStatistics &stats );
+
+	// Queue the responses of the events handled away from the ring. Returns their number.
+	unsigned int reapCompletions();
+
+	// Start the handler deadline clock for an event handled away from the event loop thread
+	void watchDeadline( XenPendingEvent *ev );
+
+	// Answer the watched events past their deadline with the fallback action. Returns their number.
+	unsigned int expireEvents();
+
+	// Have the poller wake us up at when (CLOCK_MONOTONIC nanoseconds)
+	void armDeadline( uint64_t when );
+
+	XenPendingEvent *allocEvent();
+
+	void freeEvent( XenPendingEvent *ev );
+
+	void initResponse( const mem_event_request_t &req, mem_event_response_t &rsp );
+
 	void getRequest( mem_event_request_t *req );
 
 	void putResponse( mem_event_response_t *rsp );
 
-	void resumePage( mem_event_response_t *rsp );
+	// Consume the next request, returning the ring slot its response should be built in
+	mem_event_response_t *getRequestInPlace();
+
+	// Publish the response built in the slot returned by getRequestInPlace()
+	void putResponseInPlace();
+
+	// Publish the responses queued by putResponse(), notifying Xen only if it's waiting for them. Batches
+	// made only of responses to async events don't get a notification until the ring fills up or
+	// NOTIFY_DELAY_NS pass, unless flush is set.
+	void resumePages( bool flush = false );
 
 	std::string uuid();
 
@@ -104,8 +313,10 @@ private:
 	// Don't allow copying for these objects
 	XenEventManager &operator=( const XenEventManager & );
 
+	friend class XenVcpuDispatcher;
+
 private:
-	const XenDriver &driver_;
+	const Driver &driver_;
 	xc_interface *xci_;
 	domid_t domain_;
 	bool stop_;
@@ -123,6 +334,52 @@ private:
 	bool guestStillRunning_;
 	LogHelper *logHelper_;
 	bool firstReleaseWatch_;
+	Registers eventRegs_; // storage for materializing the registers of the current event
+	XenCompletionQueue completions_;
+	XenVcpuDispatcher *dispatcher_;
+	std::vector<XenPendingEvent *> freeEvents_;
+	unsigned int eventsInFlight_;
+	EventPoller poller_;
+	uint64_t maxSpinNs_;
+	uint64_t avgGapNs_; // moving average of the time between batches
+	uint64_t lastBatchNs_;
+	EventStatistics stats_;          // the event loop thread's (the dispatch threads have their own)
+	std::vector<uint64_t> arrivals_; // of the responses not pushed yet (see EventStatistics::responseTime)
+	unsigned short asyncFlags_;
+	bool pausedResponses_; // some queued response is for a paused VCPU
+	bool pendingNotify_;   // Xen asked to be notified, but the notification was put off
+	RING_IDX resumedUpTo_; // rsp_prod_pvt as of the last notification
+	DecisionCache *decisions_;
+	unsigned int decisionsGeneration_; // what the cached decisions were based on (see checkDecisions())
+	volatile unsigned int invalidations_;
+	EventTrace *trace_;
+	uint64_t traceTsc_;  // when the current request was taken off the ring
+	uint64_t arrivalNs_; // same, in nanoseconds
+	bool localRing_;     // see the protected constructor
+	int localRingFd_;    // see watchLocalRing()
+	StatsSlot *statsSlot_;
+	StatsSlot *driverSlot_;
+	uint64_t publishedNs_; // when the slots were last updated
+	uint64_t deadlineNs_;  // see handlerDeadline(), 0 if off
+	HVAction deadlineAction_;
+	int deadlineFd_;       // timerfd for the oldest watched event's deadline
+	bool deadlineArmed_;
+	std::deque<std::pair<XenPendingEvent *, uint64_t> > watched_; // (event, serial), oldest first
+	unsigned int expiredInFlight_; // answered with deadlineAction_, but still with the handler
+	uint64_t serial_;
+	int notifyFd_;         // timerfd bounding how long notifications get put off (see resumePages())
+	uint64_t deferredNs_;  // when the oldest response still waiting for a notification was pushed, or 0
+	unsigned int cpuBudget_;  // see overheadBudget(), 0 for no limit
+	unsigned int rateBudget_; // same
+	GovernorLevel maxGovernorLevel_;
+	GovernorLevel governorLevel_;
+	uint64_t governorWindowNs_; // start of the current measurement window (0 if there's none yet)
+	uint64_t governorEvents_;   // handler calls as of then
+	uint64_t governorBusyNs_;   // time spent in the handler as of then
+	uint64_t calmSinceNs_;      // the load has been under half the budget since then (0 if it's not)
+	unsigned short appAsyncFlags_;      // what the application asked for with asyncEvents()
+	unsigned short governorAsyncFlags_; // added by GOVERNOR_ASYNC
+	unsigned int sampled_;              // for GOVERNOR_SAMPLED
 };
 
 } // namespace bdvmi
@@ -0,0 +1,117 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIXENEVENTREACTOR_H_INCLUDED__
+#define __BDVMIXENEVENTREACTOR_H_INCLUDED__
+
+#include "eventpoller.h"
+#include <deque>
+#include <set>
+#include <vector>
+#include <pthread.h>
+#include <signal.h>
+
+namespace bdvmi {
+
+// Forward declarations, minimize compile-time file dependencies
+class LogHelper;
+class EventManager;
+
+/*
+ * Services the events of many domains from a single thread: run() waits on all the registered
+ * event managers at once (see EventManager::pollFd()) and handles at most batchBudget requests
+ * from each domain before moving on to the next one, so a busy domain can't starve the others.
+ * A manager leaves the reactor on its own when its session is over (see
+ * EventHandler::handleSessionOver()).
+ */
+class XenEventReactor {
+
+public:
+	XenEventReactor( unsigned int batchBudget = 64, LogHelper *logHelper = NULL );
+
+	~XenEventReactor();
+
+public:
+	// Can be called from any thread. The manager's waitForEvents() must not be used meanwhile.
+	void add( EventManager *em );
+
+	// Can be called from any thread, except from the manager's own handler callbacks. Once it
+	// returns, run() won't touch the manager anymore and it can be destroyed.
+	void remove( EventManager *em );
+
+	// Loop servicing events, until stop() and all the sessions are over
+	void run();
+
+	// Stop all the managers, then run() (can be called from any thread)
+	void stop();
+
+	// Polled every 100 ms, unless stopSignals() is used as well
+	void signalStopVar( sig_atomic_t *sigStop )
+	{
+		sigStop_ = sigStop;
+	}
+
+	// Same as EventManager::stopSignals()
+	bool stopSignals( const sigset_t &signals )
+	{
+		return poller_.watchSignals( signals );
+	}
+
+private:
+	// Take in the add() and remove() requests made since the last round
+	void adoptChanges();
+
+	// Wait on the managers' poll fds and queue up the ones with something to do
+	void collectReady();
+
+	// Give each ready manager one round, requeueing the ones left with work
+	void serviceReady();
+
+	void queue( EventManager *em );
+
+	void detach( EventManager *em );
+
+	void stopManagers();
+
+private:
+	// No copying allowed (class has file descriptors)
+	XenEventReactor( const XenEventReactor & );
+
+	// No copying allowed (class has file descriptors)
+	XenEventReactor &operator=( const XenEventReactor & );
+
+private:
+	unsigned int batchBudget_;
+	LogHelper *logHelper_;
+	EventPoller poller_;
+	int managersFd_;
+	std::set<EventManager *> managers_;
+	std::deque<EventManager *> ready_;
+	std::set<EventManager *> queued_;
+	sig_atomic_t *sigStop_;
+	volatile bool stop_;
+
+	// Shared with add() and remove()
+	pthread_mutex_t lock_;
+	pthread_cond_t detached_;
+	bool running_;
+	pthread_t thread_;
+	std::vector<EventManager *> adds_;
+	std::vector<EventManager *> removes_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIXENEVENTREACTOR_H_INCLUDED__
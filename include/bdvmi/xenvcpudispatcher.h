@@ -0,0 +1,86 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIXENVCPUDISPATCHER_H_INCLUDED__
+#define __BDVMIXENVCPUDISPATCHER_H_INCLUDED__
+
+#include "xeneventmanager.h"
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+namespace bdvmi {
+
+/*
+ * Pool of worker threads handling ring requests. All the requests of a VCPU go
+ * to the same worker, so they're handled (and answered) in the order they came
+ * in, while a slow handler on one VCPU doesn't hold up the others.
+ */
+class XenVcpuDispatcher {
+
+public:
+	XenVcpuDispatcher( XenEventManager &manager, XenCompletionQueue &completions, unsigned int workers );
+
+	// Handles whatever is still queued, then joins the workers
+	~XenVcpuDispatcher();
+
+public:
+	// Queue ev for handling, it will come back through the completion queue
+	void dispatch( XenPendingEvent *ev );
+
+	unsigned int workers() const
+	{
+		return workers_.size();
+	}
+
+	// Add the worker threads' counters to stats
+	void statistics( EventStatistics &stats ) const;
+
+private:
+	struct Worker {
+		Worker( XenVcpuDispatcher *d ) : dispatcher( d ), quit( false )
+		{
+		}
+
+		XenVcpuDispatcher *dispatcher;
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		std::deque<XenPendingEvent *> queue;
+		bool quit;
+		EventStatistics stats; // only written by the worker thread
+	};
+
+private:
+	static void *workerMain( void *arg );
+
+	void stopWorkers();
+
+private:
+	// No copying allowed (class has threads)
+	XenVcpuDispatcher( const XenVcpuDispatcher & );
+
+	// No copying allowed (class has threads)
+	XenVcpuDispatcher &operator=( const XenVcpuDispatcher & );
+
+private:
+	XenEventManager &manager_;
+	XenCompletionQueue &completions_;
+	std::vector<Worker *> workers_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIXENVCPUDISPATCHER_H_INCLUDED__
@@ -17,13 +17,18 @@
 #include "bdvmi/xendriver.h"
 #include "bdvmi/xendomainwatcher.h"
 #include "bdvmi/xeneventmanager.h"
+#include "bdvmi/mockdriver.h"
+#include "bdvmi/mockeventmanager.h"
+#include "bdvmi/replaydriver.h"
+#include "bdvmi/replayeventmanager.h"
+#include "bdvmi/singledomainwatcher.h"
 
 namespace bdvmi {
 
 BackendFactory::BackendFactory( BackendType type, LogHelper *logHelper ) : type_( type ), logHelper_( logHelper )
 {
-	if ( type_ != BACKEND_XEN )
-		throw Exception( "Xen is the only supported backend for now" );
+	if ( type_ == BACKEND_KVM )
+		throw Exception( "KVM is not supported for now" );
 }
 
 DomainWatcher *BackendFactory::domainWatcher()
@@ -31,6 +36,10 @@ DomainWatcher *BackendFactory::domainWatcher()
 	switch ( type_ ) {
 		case BACKEND_XEN:
 			return new XenDomainWatcher( logHelper_ );
+		case BACKEND_REPLAY:
+			return new SingleDomainWatcher( replayOptions_.trace );
+		case BACKEND_MOCK:
+			return new SingleDomainWatcher( "mock" );
 		default:
 			throw Exception( "Xen is the only supported backend for now" );
 	}
@@ -41,6 +50,10 @@ Driver *BackendFactory::driver( const std::string &domain, bool watchableOnly )
 	switch ( type_ ) {
 		case BACKEND_XEN:
 			return new XenDriver( domain, logHelper_, watchableOnly );
+		case BACKEND_REPLAY:
+			return new ReplayDriver( domain, replayOptions_, logHelper_ );
+		case BACKEND_MOCK:
+			return new MockDriver( domain, mockOptions_, logHelper_ );
 		default:
 			throw Exception( "Xen is the only supported backend for now" );
 	}
@@ -51,6 +64,10 @@ EventManager *BackendFactory::eventManager( Driver &driver, unsigned short flags
 	switch ( type_ ) {
 		case BACKEND_XEN:
 			return new XenEventManager( dynamic_cast<XenDriver &>( driver ), flags, logHelper_ );
+		case BACKEND_REPLAY:
+			return new ReplayEventManager( dynamic_cast<ReplayDriver &>( driver ), flags, logHelper_ );
+		case BACKEND_MOCK:
+			return new MockEventManager( dynamic_cast<MockDriver &>( driver ), flags, logHelper_ );
 		default:
 			throw Exception( "Xen is the only supported backend for now" );
 	}
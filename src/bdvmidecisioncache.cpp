@@ -0,0 +1,151 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/decisioncache.h"
+
+namespace bdvmi {
+
+const uint32_t DecisionCache::NIL;
+
+DecisionCache::DecisionCache( size_t maxEntries )
+    : entries_( maxEntries ? maxEntries : 1 ), bucketBits_( 1 ), used_( 0 ), head_( NIL ), tail_( NIL )
+{
+	// About two buckets per entry keeps the chains short
+	while ( ( 1UL << bucketBits_ ) < 2 * entries_.size() )
+		++bucketBits_;
+
+	buckets_.assign( 1UL << bucketBits_, NIL );
+}
+
+bool DecisionCache::find( uint64_t gfn, uint64_t rip, unsigned int access, HVAction &action,
+                          unsigned short &instructionSize )
+{
+	uint32_t *link;
+	uint32_t index = lookup( gfn, rip, access, link );
+
+	if ( index == NIL )
+		return false;
+
+	if ( index != head_ ) {
+		unlink( index );
+		pushFront( index );
+	}
+
+	action = entries_[index].action;
+	instructionSize = entries_[index].instructionSize;
+
+	return true;
+}
+
+void DecisionCache::insert( uint64_t gfn, uint64_t rip, unsigned int access, HVAction action,
+                            unsigned short instructionSize )
+{
+	uint32_t *link;
+	uint32_t index = lookup( gfn, rip, access, link );
+
+	if ( index != NIL ) {
+		unlink( index );
+	} else {
+		if ( used_ < entries_.size() )
+			index = used_++;
+		else {
+			// Recycle the least recently used entry
+			index = tail_;
+			unlink( index );
+
+			uint32_t *oldLink;
+			lookup( entries_[index].gfn, entries_[index].rip, entries_[index].access, oldLink );
+			*oldLink = entries_[index].hashNext;
+
+			// The chain we're about to add to may have changed
+			lookup( gfn, rip, access, link );
+		}
+
+		Entry &e = entries_[index];
+
+		e.gfn = gfn;
+		e.rip = rip;
+		e.access = access;
+		e.hashNext = *link;
+		*link = index;
+	}
+
+	entries_[index].action = action;
+	entries_[index].instructionSize = instructionSize;
+
+	pushFront( index );
+}
+
+void DecisionCache::clear()
+{
+	buckets_.assign( buckets_.size(), NIL );
+	used_ = 0;
+	head_ = tail_ = NIL;
+}
+
+/*
+   Returns the entry's index (or NIL), and in link the place pointing to it (or, if it's not
+   there, the end of its chain).
+*/
+uint32_t DecisionCache::lookup( uint64_t gfn, uint64_t rip, unsigned int access, uint32_t *&link )
+{
+	uint64_t hash = ( gfn * 0x9e3779b97f4a7c15ULL ) ^ ( rip * 0xc2b2ae3d27d4eb4fULL ) ^ access;
+	hash = ( hash * 0x9e3779b97f4a7c15ULL ) >> ( 64 - bucketBits_ );
+
+	link = &buckets_[hash];
+
+	while ( *link != NIL ) {
+		const Entry &e = entries_[*link];
+
+		if ( e.gfn == gfn && e.rip == rip && e.access == access )
+			return *link;
+
+		link = &entries_[*link].hashNext;
+	}
+
+	return NIL;
+}
+
+void DecisionCache::unlink( uint32_t index )
+{
+	Entry &e = entries_[index];
+
+	if ( e.lruPrev != NIL )
+		entries_[e.lruPrev].lruNext = e.lruNext;
+	else
+		head_ = e.lruNext;
+
+	if ( e.lruNext != NIL )
+		entries_[e.lruNext].lruPrev = e.lruPrev;
+	else
+		tail_ = e.lruPrev;
+}
+
+void DecisionCache::pushFront( uint32_t index )
+{
+	Entry &e = entries_[index];
+
+	e.lruPrev = NIL;
+	e.lruNext = head_;
+
+	if ( head_ != NIL )
+		entries_[head_].lruPrev = index;
+	else
+		tail_ = index;
+
+	head_ = index;
+}
+
+} // namespace bdvmi
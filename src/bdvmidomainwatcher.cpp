@@ -15,10 +15,44 @@
 
 #include "bdvmi/domainwatcher.h"
 #include "bdvmi/domainhandler.h"
+#include "bdvmi/statspage.h"
 
 namespace bdvmi {
 
-DomainWatcher::DomainWatcher() : sigStop_( NULL ), stop_( false ), handler_( NULL )
+namespace {
+
+// Hands the stats page slot back however waitForDomains() is left (handlers may throw)
+class SlotGuard {
+
+public:
+	explicit SlotGuard( StatsSlot *slot ) : slot_( slot )
+	{
+	}
+
+	~SlotGuard()
+	{
+		StatsPage::release( slot_ );
+	}
+
+	StatsSlot *slot() const
+	{
+		return slot_;
+	}
+
+private:
+	// Don't allow copying
+	SlotGuard( const SlotGuard & );
+	SlotGuard &operator=( const SlotGuard & );
+
+private:
+	StatsSlot *slot_;
+};
+
+} // end of anonymous namespace
+
+DomainWatcher::DomainWatcher()
+    : sigStop_( NULL ), stop_( false ), stopSignalsOn_( false ), handler_( NULL ), wakeups_( 0 ), domainsSeen_( 0 ),
+      protectedSeen_( 0 )
 {
 }
 
@@ -32,6 +66,12 @@ void DomainWatcher::unprotectDomain( const std::string &domain )
 
 void DomainWatcher::waitForDomains()
 {
+	// A stop variable set by a signal handler can only be noticed by polling it
+	int timeout = ( sigStop_ && !stopSignalsOn_ ) ? 100 : -1;
+
+	// NULL unless StatsPage::open() has been called
+	SlotGuard stats( StatsPage::acquire( StatsSlot::DOMAIN_WATCHER, "domains" ) );
+
 	for ( ;; ) {
 
 		if ( sigStop_ && *sigStop_ )
@@ -42,7 +82,28 @@ void DomainWatcher::waitForDomains()
 
 		std::list<DomainInfo> domains;
 
-		if ( waitForDomainsOrTimeout( domains, 100 ) ) {
+		bool found = waitForDomainsOrTimeout( domains, timeout );
+
+		if ( stats.slot() ) {
+			uint64_t values[StatsSlot::DW_VALUES];
+
+			++wakeups_;
+			domainsSeen_ += domains.size();
+
+			std::list<DomainInfo>::const_iterator i = domains.begin();
+
+			for ( ; i != domains.end(); ++i )
+				if ( protectedDomain( i->name ) )
+					++protectedSeen_;
+
+			values[StatsSlot::DW_WAKEUPS] = wakeups_;
+			values[StatsSlot::DW_DOMAINS] = domainsSeen_;
+			values[StatsSlot::DW_PROTECTED_DOMAINS] = protectedSeen_;
+
+			StatsPage::publish( stats.slot(), values, StatsSlot::DW_VALUES );
+		}
+
+		if ( found ) {
 
 			std::list<DomainInfo>::const_iterator i = domains.begin();
 
@@ -0,0 +1,131 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/eventfilter.h"
+
+namespace bdvmi {
+
+namespace { // Anonymous namespace
+
+// Reserved bits set, so never a valid CR3
+const uint64_t NO_CR3 = ~0ULL;
+
+} // end of anonymous namespace
+
+EventFilter::EventFilter()
+    : newCR3Only_( false ), cr0Mask_( ~0ULL ), cr4Mask_( ~0ULL ), rules_( NULL ), newRules_( NULL ),
+      rulesGeneration_( 0 )
+{
+}
+
+EventFilter::~EventFilter()
+{
+	delete rules_;
+	delete newRules_;
+}
+
+void EventFilter::newCR3Only( bool enable )
+{
+	newCR3Only_ = enable;
+
+	if ( enable && seenCR3_.empty() )
+		seenCR3_.assign( 1 << CR3_CACHE_BITS, NO_CR3 );
+
+	resetCR3();
+}
+
+void EventFilter::resetCR3()
+{
+	if ( !seenCR3_.empty() )
+		seenCR3_.assign( seenCR3_.size(), NO_CR3 );
+}
+
+bool EventFilter::crBits( unsigned short crNumber, uint64_t mask )
+{
+	switch ( crNumber ) {
+		case 0:
+			cr0Mask_ = mask;
+			return true;
+		case 4:
+			cr4Mask_ = mask;
+			return true;
+		default:
+			return false;
+	}
+}
+
+uint64_t EventFilter::crMask( unsigned short crNumber ) const
+{
+	switch ( crNumber ) {
+		case 0:
+			return cr0Mask_;
+		case 4:
+			return cr4Mask_;
+		default:
+			return ~0ULL;
+	}
+}
+
+bool EventFilter::wantsCR( unsigned short crNumber, uint64_t oldValue, uint64_t newValue )
+{
+	switch ( crNumber ) {
+		case 0:
+			return ( ( oldValue ^ newValue ) & cr0Mask_ ) != 0;
+
+		case 4:
+			return ( ( oldValue ^ newValue ) & cr4Mask_ ) != 0;
+
+		case 3: {
+			if ( !newCR3Only_ )
+				return true;
+
+			// Page directories are page aligned, hash the frame number (Fibonacci hashing)
+			uint64_t slot = ( ( newValue >> 12 ) * 0x9e3779b97f4a7c15ULL ) >> ( 64 - CR3_CACHE_BITS );
+
+			if ( seenCR3_[slot] == newValue )
+				return false;
+
+			seenCR3_[slot] = newValue;
+			return true;
+		}
+
+		default:
+			return true;
+	}
+}
+
+void EventFilter::pageFaultRules( const PageFaultRules &rules )
+{
+	PageFaultRules *compiled = new PageFaultRules( rules );
+	compiled->compile();
+
+	// If the loop hasn't picked up the previous set yet, it never will
+	delete __sync_lock_test_and_set( &newRules_, compiled );
+}
+
+bool EventFilter::matchPageFault( uint64_t gfn, unsigned int access, uint64_t rip, uint64_t cr3, HVAction &action )
+{
+	if ( newRules_ ) {
+		PageFaultRules *rules = __sync_lock_test_and_set( &newRules_, ( PageFaultRules * )NULL );
+
+		delete rules_;
+		rules_ = rules;
+		++rulesGeneration_;
+	}
+
+	return rules_ && !rules_->empty() && rules_->match( gfn, access, rip, cr3, action );
+}
+
+} // namespace bdvmi
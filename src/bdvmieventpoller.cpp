@@ -0,0 +1,145 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/eventpoller.h"
+#include "bdvmi/exception.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+namespace bdvmi {
+
+EventPoller::EventPoller() : epollFd_( -1 ), wakeUpFd_( -1 ), signalFd_( -1 ), signalReported_( false )
+{
+	epollFd_ = epoll_create1( EPOLL_CLOEXEC );
+
+	if ( epollFd_ < 0 )
+		throw Exception( "epoll_create1() failed" );
+
+	wakeUpFd_ = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+	if ( wakeUpFd_ < 0 ) {
+		close( epollFd_ );
+		throw Exception( "eventfd() failed" );
+	}
+
+	try {
+		add( wakeUpFd_, WAKE_UP );
+
+	} catch ( ... ) {
+		close( wakeUpFd_ );
+		close( epollFd_ );
+		throw;
+	}
+}
+
+EventPoller::~EventPoller()
+{
+	if ( signalFd_ >= 0 )
+		close( signalFd_ );
+
+	close( wakeUpFd_ );
+	close( epollFd_ );
+}
+
+void EventPoller::add( int fd, unsigned int id )
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = id;
+
+	if ( epoll_ctl( epollFd_, EPOLL_CTL_ADD, fd, &ev ) != 0 )
+		throw Exception( "epoll_ctl() failed" );
+}
+
+void EventPoller::remove( int fd )
+{
+	struct epoll_event ev; // kernels before 2.6.9 want a non-NULL pointer
+
+	epoll_ctl( epollFd_, EPOLL_CTL_DEL, fd, &ev );
+}
+
+bool EventPoller::watchSignals( const sigset_t &signals )
+{
+	int fd = signalfd( signalFd_, &signals, SFD_NONBLOCK | SFD_CLOEXEC );
+
+	if ( fd < 0 )
+		return false;
+
+	if ( signalFd_ < 0 || signalReported_ ) {
+		try {
+			add( fd, STOP_SIGNAL );
+
+		} catch ( const Exception & ) {
+			if ( signalFd_ < 0 )
+				close( fd );
+
+			return false;
+		}
+
+		signalFd_ = fd;
+		signalReported_ = false;
+	}
+
+	return true;
+}
+
+void EventPoller::wakeUp()
+{
+	uint64_t one = 1;
+
+	while ( write( wakeUpFd_, &one, sizeof( one ) ) < 0 && errno == EINTR )
+		;
+}
+
+unsigned int EventPoller::wait( int ms )
+{
+	struct epoll_event events[8];
+
+	int rc = epoll_wait( epollFd_, events, sizeof( events ) / sizeof( events[0] ), ms );
+
+	if ( rc < 0 ) {
+		if ( errno == EINTR ) // interrupted by signal
+			return 0;
+
+		throw Exception( "epoll_wait() failed" );
+	}
+
+	unsigned int ready = 0;
+
+	for ( int i = 0; i < rc; ++i )
+		ready |= events[i].data.u32;
+
+	if ( ready & STOP_SIGNAL ) {
+		// Still pending (and will be), report it this once
+		remove( signalFd_ );
+		signalReported_ = true;
+	}
+
+	if ( ready & WAKE_UP ) {
+		uint64_t count;
+
+		while ( read( wakeUpFd_, &count, sizeof( count ) ) < 0 && errno == EINTR )
+			;
+	}
+
+	return ready;
+}
+
+} // namespace bdvmi
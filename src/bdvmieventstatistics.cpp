@@ -0,0 +1,74 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+#include "bdvmi/eventstatistics.h"
+
+namespace bdvmi {
+
+EventStatistics::EventStatistics()
+    : events( 0 ), spinWakeups( 0 ), sleepWakeups( 0 ), spinTime( 0 ), ackTime( 0 ), maxAckTime( 0 ),
+      filtered( 0 ), deadlineMisses( 0 ), lateDecisions( 0 ), shed( 0 ), governorChanges( 0 )
+{
+	for ( unsigned int i = 0; i < EVENT_TYPES; ++i )
+		requests[i] = 0;
+}
+
+void EventStatistics::merge( const EventStatistics &other )
+{
+	events += other.events;
+	spinWakeups += other.spinWakeups;
+	sleepWakeups += other.sleepWakeups;
+	spinTime += other.spinTime;
+	ackTime += other.ackTime;
+
+	if ( other.maxAckTime > maxAckTime )
+		maxAckTime = other.maxAckTime;
+
+	for ( unsigned int i = 0; i < EVENT_TYPES; ++i ) {
+		requests[i] += other.requests[i];
+		handlerTime[i].merge( other.handlerTime[i] );
+	}
+
+	filtered += other.filtered;
+	deadlineMisses += other.deadlineMisses;
+	lateDecisions += other.lateDecisions;
+	shed += other.shed;
+	governorChanges += other.governorChanges;
+
+	responseTime.merge( other.responseTime );
+	notifyTime.merge( other.notifyTime );
+	ackLatency.merge( other.ackLatency );
+	ringOccupancy.merge( other.ringOccupancy );
+	batchSizes.merge( other.batchSizes );
+}
+
+const char *EventStatistics::eventTypeName( EventType type )
+{
+	switch ( type ) {
+		case PAGE_FAULT:
+			return "page fault";
+		case CR:
+			return "CR";
+		case MSR:
+			return "MSR";
+		case VMCALL:
+			return "VMCALL";
+		case XSETBV:
+			return "XSETBV";
+		default:
+			return "other";
+	}
+}
+
+} // namespace bdvmi
@@ -0,0 +1,244 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/eventtrace.h"
+#include "bdvmi/exception.h"
+#include "clock.h"
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+namespace bdvmi {
+
+namespace { // Anonymous namespace
+
+const uint64_t SYNC_INTERVAL_NS = 1000000000ULL;
+
+size_t roundUp( size_t value, size_t alignment )
+{
+	return ( value + alignment - 1 ) / alignment * alignment;
+}
+
+bool earlierRecord( const EventTraceRecord *a, const EventTraceRecord *b )
+{
+	return a->tsc < b->tsc;
+}
+
+} // end of anonymous namespace
+
+EventTrace::EventTrace( const std::string &path, uint32_t interfaceVersion, uint32_t requestSize,
+                        uint32_t responseSize, uint64_t tscSpeed, size_t chunkSize )
+    : fd_( -1 ), map_( NULL ), mapSize_( 0 ), chunkSize_( roundUp( chunkSize, sysconf( _SC_PAGESIZE ) ) ),
+      used_( sizeof( EventTraceHeader ) ), syncedUpTo_( 0 ),
+      recordSize_( roundUp( sizeof( EventTraceRecord ) + requestSize + responseSize, 8 ) ),
+      lastSyncNs_( coarseNowNs() )
+{
+	fd_ = open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+
+	if ( fd_ < 0 )
+		throw Exception( std::string( "[Event trace] could not create " ) + path + ": " + strerror( errno ) );
+
+	if ( !grow() ) {
+		cleanup();
+		throw Exception( std::string( "[Event trace] could not allocate space for " ) + path );
+	}
+
+	EventTraceHeader *h = header();
+
+	memcpy( h->magic, BDVMI_EVENT_TRACE_MAGIC, sizeof( h->magic ) );
+	h->version = EVENT_TRACE_VERSION;
+	h->headerSize = sizeof( EventTraceHeader );
+	h->interfaceVersion = interfaceVersion;
+	h->requestSize = requestSize;
+	h->responseSize = responseSize;
+	h->tscSpeed = tscSpeed;
+}
+
+EventTrace::~EventTrace()
+{
+	sync( true );
+
+	if ( map_ ) {
+		munmap( map_, mapSize_ );
+		map_ = NULL;
+	}
+
+	// Don't leave the preallocated tail behind (if it fails, readers go by dataSize anyway)
+	if ( ftruncate( fd_, used_ ) ) {
+	}
+
+	cleanup();
+}
+
+bool EventTrace::append( uint64_t tsc, uint64_t latency, uint32_t flags, const void *request, const void *response )
+{
+	if ( used_ + recordSize_ > mapSize_ && !grow() ) {
+		++header()->dropped;
+		return false;
+	}
+
+	EventTraceHeader *h = header();
+	EventTraceRecord *record = reinterpret_cast<EventTraceRecord *>( map_ + used_ );
+	char *data = reinterpret_cast<char *>( record + 1 );
+
+	record->size = recordSize_;
+	record->flags = flags;
+	record->tsc = tsc;
+	record->latency = latency;
+
+	memcpy( data, request, h->requestSize );
+	memcpy( data + h->requestSize, response, h->responseSize );
+
+	used_ += recordSize_;
+	++h->records;
+
+	return true;
+}
+
+void EventTrace::tick()
+{
+	uint64_t now = coarseNowNs();
+
+	if ( now - lastSyncNs_ < SYNC_INTERVAL_NS )
+		return;
+
+	lastSyncNs_ = now;
+	sync( false );
+}
+
+bool EventTrace::grow()
+{
+	size_t newSize = mapSize_ + chunkSize_;
+
+	// Actually reserve the blocks, so that running out of space doesn't SIGBUS us later on
+	if ( posix_fallocate( fd_, 0, newSize ) )
+		return false;
+
+	void *map = map_ ? mremap( map_, mapSize_, newSize, MREMAP_MAYMOVE )
+	                 : mmap( NULL, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0 );
+
+	if ( map == MAP_FAILED )
+		return false;
+
+	map_ = static_cast<char *>( map );
+	mapSize_ = newSize;
+
+	return true;
+}
+
+void EventTrace::sync( bool wait )
+{
+	if ( !map_ )
+		return;
+
+	header()->dataSize = used_ - sizeof( EventTraceHeader );
+
+	// The header page is always dirty, so start there and take everything written since
+	size_t pageSize = sysconf( _SC_PAGESIZE );
+	size_t from = syncedUpTo_ / pageSize * pageSize;
+
+	msync( map_, pageSize, wait ? MS_SYNC : MS_ASYNC );
+
+	if ( used_ > from )
+		msync( map_ + from, used_ - from, wait ? MS_SYNC : MS_ASYNC );
+
+	syncedUpTo_ = used_;
+}
+
+void EventTrace::cleanup()
+{
+	if ( map_ ) {
+		munmap( map_, mapSize_ );
+		map_ = NULL;
+	}
+
+	if ( fd_ >= 0 ) {
+		close( fd_ );
+		fd_ = -1;
+	}
+}
+
+EventTraceReader::EventTraceReader( const std::string &path, uint32_t interfaceVersion, uint32_t requestSize,
+                                    uint32_t responseSize )
+    : map_( NULL ), mapSize_( 0 )
+{
+	int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+
+	if ( fd < 0 )
+		throw Exception( std::string( "[Event trace] could not open " ) + path + ": " + strerror( errno ) );
+
+	struct stat st;
+
+	if ( fstat( fd, &st ) || static_cast<size_t>( st.st_size ) < sizeof( EventTraceHeader ) ) {
+		close( fd );
+		throw Exception( std::string( "[Event trace] " ) + path + " is not a trace file" );
+	}
+
+	mapSize_ = st.st_size;
+
+	void *map = mmap( NULL, mapSize_, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+
+	if ( map == MAP_FAILED )
+		throw Exception( std::string( "[Event trace] could not map " ) + path + ": " + strerror( errno ) );
+
+	map_ = static_cast<char *>( map );
+
+	const EventTraceHeader &h = header();
+	std::string error;
+
+	if ( memcmp( h.magic, BDVMI_EVENT_TRACE_MAGIC, sizeof( h.magic ) ) )
+		error = " is not a trace file";
+	else if ( h.version != EVENT_TRACE_VERSION )
+		error = " has an unsupported version";
+	else if ( h.interfaceVersion != interfaceVersion || h.requestSize != requestSize ||
+	          h.responseSize != responseSize )
+		error = " has been recorded with a different Xen interface version";
+	else if ( h.headerSize < sizeof( EventTraceHeader ) || h.headerSize > mapSize_ )
+		error = " is corrupted";
+
+	if ( !error.empty() ) {
+		munmap( map_, mapSize_ );
+		throw Exception( std::string( "[Event trace] " ) + path + error );
+	}
+
+	// A recorder that didn't get to sync at the end leaves dataSize behind, trust the records
+	size_t minSize = sizeof( EventTraceRecord ) + requestSize + responseSize;
+	size_t offset = h.headerSize;
+
+	while ( offset + minSize <= mapSize_ ) {
+		const EventTraceRecord *record = reinterpret_cast<const EventTraceRecord *>( map_ + offset );
+
+		if ( record->size < minSize || offset + record->size > mapSize_ )
+			break;
+
+		records_.push_back( record );
+		offset += record->size;
+	}
+
+	std::stable_sort( records_.begin(), records_.end(), earlierRecord );
+}
+
+EventTraceReader::~EventTraceReader()
+{
+	munmap( map_, mapSize_ );
+}
+
+} // namespace bdvmi
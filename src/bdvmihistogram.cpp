@@ -0,0 +1,76 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/histogram.h"
+#include <cstring>
+
+namespace bdvmi {
+
+Histogram::Histogram()
+{
+	clear();
+}
+
+void Histogram::merge( const Histogram &other )
+{
+	for ( unsigned int i = 0; i < BUCKETS; ++i )
+		counts_[i] += other.counts_[i];
+
+	count_ += other.count_;
+	sum_ += other.sum_;
+
+	if ( other.max_ > max_ )
+		max_ = other.max_;
+}
+
+void Histogram::clear()
+{
+	memset( counts_, 0, sizeof( counts_ ) );
+	count_ = sum_ = max_ = 0;
+}
+
+uint64_t Histogram::percentile( double percent ) const
+{
+	if ( !count_ )
+		return 0;
+
+	uint64_t rank = static_cast<uint64_t>( percent / 100.0 * count_ + 0.5 );
+	uint64_t seen = 0;
+
+	if ( rank < 1 )
+		rank = 1;
+
+	for ( unsigned int i = 0; i < BUCKETS; ++i ) {
+		seen += counts_[i];
+
+		if ( seen >= rank )
+			return highest( i ) < max_ ? highest( i ) : max_;
+	}
+
+	return max_;
+}
+
+uint64_t Histogram::highest( unsigned int bucket )
+{
+	if ( bucket < SUB_COUNT )
+		return bucket;
+
+	unsigned int shift = bucket / HALF_COUNT - 1;
+	uint64_t sub = bucket % HALF_COUNT + HALF_COUNT;
+
+	return ( ( sub + 1 ) << shift ) - 1;
+}
+
+} // namespace bdvmi
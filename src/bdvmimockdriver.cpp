@@ -0,0 +1,304 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/mockdriver.h"
+#include "bdvmi/exception.h"
+#include "bdvmi/loghelper.h"
+#include "bdvmi/pagewalk.h"
+#include <cstdlib>
+#include <cstring>
+
+namespace bdvmi {
+
+namespace { // Anonymous namespace
+
+const unsigned int PAGE_SHIFT = MockGuest::PAGE_SHIFT;
+
+enum { PROT_R = 1, PROT_W = 2, PROT_X = 4 };
+
+// Leave the bottom of guest memory to the working set
+const uint64_t WORKING_SET_GPA = 0x100000;
+
+} // end of anonymous namespace
+
+const uint64_t MockDriver::WORKING_SET_GVA;
+
+MockDriver::MockDriver( const std::string &domain, const MockOptions &options, LogHelper *logHelper )
+    : options_( options ), logHelper_( logHelper ), uuid_( domain ), guest_( options.vcpus, options.memorySize ),
+      ring_( NULL ), protectionGeneration_( 0 ), shutDown_( false )
+{
+	if ( !options_.pages || WORKING_SET_GPA + ( static_cast<uint64_t>( options_.pages ) << PAGE_SHIFT ) >
+	                                guest_.memorySize() / 2 )
+		throw Exception( "[Mock] the working set doesn't fit in the lower half of guest memory" );
+
+	uint64_t cr3 = guest_.createAddressSpace();
+
+	for ( unsigned int i = 0; i < options_.pages; ++i ) {
+		uint64_t gpa = WORKING_SET_GPA + ( static_cast<uint64_t>( i ) << PAGE_SHIFT );
+
+		if ( !guest_.mapPage( cr3, WORKING_SET_GVA + ( static_cast<uint64_t>( i ) << PAGE_SHIFT ), gpa ) )
+			throw Exception( "[Mock] could not set up the guest page tables" );
+
+		workingSet_.push_back( gpa );
+	}
+
+	for ( unsigned int vcpu = 0; vcpu < options_.vcpus; ++vcpu )
+		guest_.longMode( vcpu, cr3, WORKING_SET_GVA );
+
+	void *ring = NULL;
+
+	if ( posix_memalign( &ring, XC_PAGE_SIZE, XC_PAGE_SIZE ) )
+		throw Exception( "[Mock] could not allocate the ring page" );
+
+	memset( ring, 0, XC_PAGE_SIZE );
+	ring_ = static_cast<mem_event_sring_t *>( ring );
+	SHARED_RING_INIT( ring_ );
+}
+
+MockDriver::~MockDriver()
+{
+	free( ring_ );
+}
+
+bool MockDriver::cpuCount( unsigned int &count ) const throw()
+{
+	count = guest_.vcpus();
+	return true;
+}
+
+bool MockDriver::tscSpeed( unsigned long long & /* speed */ ) const throw()
+{
+	// The simulated guest has no clock of its own
+	return false;
+}
+
+bool MockDriver::mtrrType( unsigned long long /* guestAddress */, uint8_t &type ) const throw()
+{
+	type = 6; // write-back
+	return true;
+}
+
+bool MockDriver::setPageProtection( unsigned long long guestAddress, bool read, bool write, bool execute ) throw()
+{
+	unsigned long long gfn = guestAddress >> PAGE_SHIFT;
+	unsigned char bits = ( read ? PROT_R : 0 ) | ( write ? PROT_W : 0 ) | ( execute ? PROT_X : 0 );
+
+	try {
+		if ( bits == ( PROT_R | PROT_W | PROT_X ) )
+			protections_.erase( gfn );
+		else
+			protections_[gfn] = bits;
+
+	} catch ( ... ) {
+		return false;
+	}
+
+	__sync_add_and_fetch( &protectionGeneration_, 1 );
+
+	return true;
+}
+
+bool MockDriver::getPageProtection( unsigned long long guestAddress, bool &read, bool &write,
+                                    bool &execute ) const throw()
+{
+	std::map<unsigned long long, unsigned char>::const_iterator i = protections_.find( guestAddress >> PAGE_SHIFT );
+	unsigned char bits = ( i == protections_.end() ) ? ( PROT_R | PROT_W | PROT_X ) : i->second;
+
+	read = ( bits & PROT_R ) != 0;
+	write = ( bits & PROT_W ) != 0;
+	execute = ( bits & PROT_X ) != 0;
+
+	return true;
+}
+
+bool MockDriver::registers( unsigned short vcpu, Registers &regs ) const throw()
+{
+	if ( vcpu >= guest_.vcpus() )
+		return false;
+
+	regs = guest_.registers( vcpu );
+
+	return true;
+}
+
+bool MockDriver::mtrrs( unsigned short vcpu, Mtrrs &m ) const throw()
+{
+	if ( vcpu >= guest_.vcpus() )
+		return false;
+
+	m = Mtrrs();
+
+	return true;
+}
+
+bool MockDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool setEip ) throw()
+{
+	if ( vcpu >= guest_.vcpus() )
+		return false;
+
+	Registers &current = guest_.registers( vcpu );
+	uint64_t rip = current.rip;
+
+	current = regs;
+
+	if ( !setEip )
+		current.rip = rip;
+
+	return true;
+}
+
+bool MockDriver::writeToPhysAddress( unsigned long long address, void *buffer, size_t length ) throw()
+{
+	return guest_.write( address, buffer, length );
+}
+
+bool MockDriver::enableMsrExit( unsigned int msr, bool &oldValue ) throw()
+{
+	try {
+		oldValue = msrs_.set( msr, true );
+
+	} catch ( ... ) {
+		return false;
+	}
+
+	return true;
+}
+
+bool MockDriver::disableMsrExit( unsigned int msr, bool &oldValue ) throw()
+{
+	oldValue = msrs_.set( msr, false );
+	return true;
+}
+
+MapReturnCode MockDriver::mapPhysMemToHost( unsigned long long address, size_t length, uint32_t /* flags */,
+                                            void *&pointer ) throw()
+{
+	// one-page limit
+	if ( !length || ( address >> PAGE_SHIFT ) != ( ( address + length - 1 ) >> PAGE_SHIFT ) )
+		return MAP_INVALID_PARAMETER;
+
+	// All of guest memory is there, it just doesn't take up host memory until touched
+	char *page = guest_.page( address >> PAGE_SHIFT, true );
+
+	pointer = NULL;
+
+	if ( !page )
+		return MAP_PAGE_NOT_PRESENT;
+
+	pointer = page + ( address & ( ( 1ULL << PAGE_SHIFT ) - 1 ) );
+
+	return MAP_SUCCESS;
+}
+
+bool MockDriver::unmapPhysMem( void * /* hostPtr */ ) throw()
+{
+	return true;
+}
+
+MapReturnCode MockDriver::mapVirtMemToHost( unsigned long long address, size_t length, uint32_t flags,
+                                            unsigned short vcpu, void *&pointer ) throw()
+{
+	// one-page limit
+	if ( !length || ( address >> PAGE_SHIFT ) != ( ( address + length - 1 ) >> PAGE_SHIFT ) )
+		return MAP_INVALID_PARAMETER;
+
+	pointer = NULL;
+
+	if ( vcpu >= guest_.vcpus() )
+		return MAP_INVALID_PARAMETER;
+
+	uint64_t gpa;
+	std::map<unsigned long long, unsigned long long>::const_iterator i = addressCache_.find( address );
+
+	if ( i != addressCache_.end() )
+		gpa = i->second;
+	else if ( !walkPageTables( guest_, guest_.registers( vcpu ), address, gpa ) )
+		return MAP_PAGE_NOT_PRESENT;
+
+	return mapPhysMemToHost( gpa, length, flags, pointer );
+}
+
+bool MockDriver::unmapVirtMem( void * /* hostPtr */ ) throw()
+{
+	return true;
+}
+
+bool MockDriver::cacheGuestVirtAddr( unsigned long long address ) throw()
+{
+	uint64_t gpa;
+
+	if ( !walkPageTables( guest_, guest_.registers( 0 ), address, gpa ) ) {
+		if ( logHelper_ )
+			logHelper_->error( "[Mock] could not translate the address to cache" );
+
+		return false;
+	}
+
+	try {
+		addressCache_[address] = gpa;
+
+	} catch ( ... ) {
+		return false;
+	}
+
+	return true;
+}
+
+bool MockDriver::requestPageFault( int vcpu, uint64_t addressSpace, uint64_t virtualAddress,
+                                   uint32_t /* writeAccess */ ) throw()
+{
+	if ( vcpu < 0 || static_cast<unsigned int>( vcpu ) >= guest_.vcpus() )
+		return false;
+
+	uint64_t gpa;
+
+	try {
+		if ( walkPageTables( guest_, guest_.registers( vcpu ), virtualAddress, gpa ) )
+			return true; // already there
+
+		return guest_.mapPage( addressSpace, virtualAddress, guest_.allocPage() );
+
+	} catch ( ... ) {
+		return false;
+	}
+}
+
+bool MockDriver::disableRepOptimizations() throw()
+{
+	return true;
+}
+
+bool MockDriver::shutdown() throw()
+{
+	shutDown_ = true;
+	return true;
+}
+
+bool MockDriver::pause() throw()
+{
+	return true;
+}
+
+bool MockDriver::unpause() throw()
+{
+	return true;
+}
+
+bool MockDriver::setPageCacheLimit( size_t /* limit */ ) throw()
+{
+	return true;
+}
+
+} // namespace bdvmi
@@ -0,0 +1,373 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/mockeventmanager.h"
+#include "bdvmi/mockdriver.h"
+#include "bdvmi/exception.h"
+#include "clock.h"
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+
+namespace bdvmi {
+
+namespace { // Anonymous namespace
+
+const uint32_t MSR_LSTAR = 0xc0000082;
+
+void signalFd( int fd )
+{
+	uint64_t one = 1;
+
+	// Only fails if the counter is about to overflow, i.e. the fd is readable anyway
+	ssize_t written = write( fd, &one, sizeof( one ) );
+	( void )written;
+}
+
+void clearFd( int fd )
+{
+	uint64_t count;
+
+	ssize_t bytes = read( fd, &count, sizeof( count ) );
+	( void )bytes;
+}
+
+} // end of anonymous namespace
+
+MockEventManager::MockEventManager( MockDriver &driver, unsigned short handlerFlags, LogHelper *logHelper )
+    : XenEventManager( driver, handlerFlags, logHelper, driver.ring() ), driver_( driver ), requestsFd_( -1 ),
+      responsesFd_( -1 ), running_( false ), quit_( false ), async_( 0 ), paused_( driver.guest().vcpus(), false ),
+      sequence_( 0 ), injectedAt_( driver.guest().vcpus(), 0 ), asyncInFlight_( driver.guest().vcpus(), 0 ),
+      snapshots_( driver.guest().vcpus() ), injected_( 0 ), answered_( 0 ), backlog_( 0 )
+{
+#ifdef DISABLE_MEM_EVENT
+	throw Exception( "[Mock] libbdvmi was built without mem_event support" );
+#endif // DISABLE_MEM_EVENT
+
+	pthread_mutex_init( &lock_, NULL );
+
+	// Start over if the driver's ring has been used before
+	SHARED_RING_INIT( driver_.ring() );
+	FRONT_RING_INIT( &frontRing_, driver_.ring(), XC_PAGE_SIZE );
+
+	requestsFd_ = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	responsesFd_ = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+	if ( requestsFd_ < 0 || responsesFd_ < 0 ) {
+		cleanup();
+		throw Exception( "[Mock] could not create the ring notification fds" );
+	}
+
+	watchLocalRing( requestsFd_ );
+
+	if ( pthread_create( &thread_, NULL, hypervisorMain, this ) != 0 ) {
+		cleanup();
+		throw Exception( "[Mock] could not start the hypervisor thread" );
+	}
+
+	running_ = true;
+}
+
+MockEventManager::~MockEventManager()
+{
+	stopHypervisor();
+
+	// Answer what's still on the ring while this object is still around
+	if ( !stopping() ) {
+		stop();
+
+		try {
+			waitForEvents();
+
+		} catch ( ... ) {
+			// Exceptions not allowed to escape destructors
+		}
+	}
+
+	cleanup();
+}
+
+void MockEventManager::cleanup()
+{
+	pthread_mutex_destroy( &lock_ );
+
+	if ( requestsFd_ >= 0 ) {
+		close( requestsFd_ );
+		requestsFd_ = -1;
+	}
+
+	if ( responsesFd_ >= 0 ) {
+		close( responsesFd_ );
+		responsesFd_ = -1;
+	}
+}
+
+void MockEventManager::asyncFlagsChanged( unsigned short flags )
+{
+	async_ = flags;
+}
+
+void MockEventManager::notifyLocalRing()
+{
+	signalFd( responsesFd_ );
+}
+
+void MockEventManager::stopHypervisor()
+{
+	if ( !running_ )
+		return;
+
+	quit_ = true;
+	signalFd( responsesFd_ );
+
+	pthread_join( thread_, NULL );
+	running_ = false;
+}
+
+void *MockEventManager::hypervisorMain( void *arg )
+{
+	static_cast<MockEventManager *>( arg )->hypervisor();
+	return NULL;
+}
+
+void MockEventManager::hypervisor()
+{
+	const MockOptions &options = driver_.options();
+	uint64_t interval = options.rate ? 1000000000ULL / options.rate : 0;
+	uint64_t due = nowNs();
+	uint64_t published = due;
+	unsigned int vcpus = paused_.size();
+	unsigned int next = 0;
+
+	while ( !quit_ ) {
+		collect();
+
+		bool done = ( options.events && injected_ >= options.events ) || driver_.shutDown();
+
+		if ( done && injected_ == answered_ ) {
+			publishLatencies();
+			stop();
+			break;
+		}
+
+		// Every 10 ms is plenty for takeLatencies(), and keeps the lock out of the way
+		if ( latencies_.count() ) {
+			uint64_t now = nowNs();
+
+			if ( now - published >= 10000000ULL ) {
+				publishLatencies();
+				published = now;
+			}
+		}
+
+		bool pushed = false;
+		int timeout = -1;
+
+		for ( unsigned int i = 0; i < vcpus && !done && !RING_FULL( &frontRing_ ); ++i ) {
+			unsigned short vcpu = ( next + i ) % vcpus;
+
+			if ( paused_[vcpu] )
+				continue;
+
+			// A page fault moves the RIP in the register file, which the handlers of the VCPU's
+			// async requests may be using, so it waits until they've been answered
+			if ( asyncInFlight_[vcpu] && nextRequest() == PAGE_FAULT )
+				continue;
+
+			if ( interval ) {
+				uint64_t now = nowNs();
+
+				if ( now < due ) {
+					timeout = static_cast<int>( ( due - now + 999999 ) / 1000000 );
+					break;
+				}
+
+				due += interval;
+			}
+
+			if ( !inject( vcpu ) ) {
+				timeout = 100; // nothing enabled yet, check the handler flags again later
+				break;
+			}
+
+			pushed = true;
+			done = options.events && injected_ >= options.events;
+		}
+
+		next = ( next + 1 ) % vcpus;
+
+		if ( interval ) {
+			uint64_t now = nowNs();
+
+			backlog_ = ( now > due ) ? ( now - due ) / interval : 0;
+		}
+
+		if ( pushed ) {
+			int notify = 0;
+
+			RING_PUSH_REQUESTS_AND_CHECK_NOTIFY( &frontRing_, notify );
+
+			if ( notify )
+				signalFd( requestsFd_ );
+
+			continue;
+		}
+
+		// Ask for a notification on the next response, then make sure none slipped in meanwhile
+		int moreResponses = 0;
+
+		RING_FINAL_CHECK_FOR_RESPONSES( &frontRing_, moreResponses );
+
+		if ( moreResponses )
+			continue;
+
+		struct pollfd pfd = { responsesFd_, POLLIN, 0 };
+
+		if ( poll( &pfd, 1, timeout ) > 0 )
+			clearFd( responsesFd_ );
+	}
+}
+
+MockEventManager::RequestKind MockEventManager::nextRequest() const
+{
+	const MockOptions &options = driver_.options();
+	unsigned short flags = handlerFlags();
+	unsigned int pageFaults = ( flags & ENABLE_MEMORY ) ? options.pageFaults : 0;
+	unsigned int crWrites = ( flags & ENABLE_CR ) ? options.crWrites : 0;
+	unsigned int msrWrites = ( flags & ENABLE_MSR ) ? options.msrWrites : 0;
+	unsigned int vmcalls = ( flags & ENABLE_VMCALL ) ? options.vmcalls : 0;
+	unsigned int total = pageFaults + crWrites + msrWrites + vmcalls;
+
+	if ( !total )
+		return NO_REQUEST;
+
+	uint64_t hash = sequence_ * 2654435761ULL; // spreads the types (and pages) out, rather than in runs
+	unsigned int pick = hash % total;
+
+	if ( pick < pageFaults )
+		return PAGE_FAULT;
+
+	if ( pick < pageFaults + crWrites )
+		return CR_WRITE;
+
+	if ( pick < pageFaults + crWrites + msrWrites )
+		return MSR_WRITE;
+
+	return VMCALL;
+}
+
+bool MockEventManager::inject( unsigned short vcpu )
+{
+	const MockOptions &options = driver_.options();
+	RequestKind kind = nextRequest();
+
+	if ( kind == NO_REQUEST )
+		return false;
+
+	uint64_t n = sequence_;
+	uint64_t hash = n * 2654435761ULL;
+	MockGuest &guest = driver_.guest();
+	mem_event_request_t *req = RING_GET_REQUEST( &frontRing_, frontRing_.req_prod_pvt );
+
+	// The register file belongs to the handlers while the VCPU has async requests in flight (it's
+	// running), the requests are then built from the registers as they were before those
+	if ( !asyncInFlight_[vcpu] )
+		snapshots_[vcpu] = guest.registers( vcpu );
+
+	Registers &regs = snapshots_[vcpu];
+
+	if ( kind == PAGE_FAULT ) {
+		// Spread the faults over the working set, from a handful of instructions
+		unsigned int page = static_cast<unsigned int>( hash % options.pages );
+		uint64_t offset = ( n * 64 ) & ( ( 1ULL << MockGuest::PAGE_SHIFT ) - 1 );
+		uint64_t gpa = driver_.workingSetGpa( page ) + offset;
+		uint64_t gla = driver_.workingSetGva() + ( static_cast<uint64_t>( page ) << MockGuest::PAGE_SHIFT );
+
+		regs.rip = driver_.workingSetGva() + ( n % 64 ) * 16;
+		guest.registers( vcpu ).rip = regs.rip; // nothing's running, see hypervisor()
+
+		pageFaultRequest( *req, vcpu, regs, gpa, gla + offset, ( n & 1 ) != 0, false );
+
+	} else if ( kind == CR_WRITE ) {
+		crRequest( *req, vcpu, regs, 3, regs.cr3, regs.cr3 );
+
+		if ( async_ & ENABLE_CR )
+			req->flags &= ~MEM_EVENT_FLAG_VCPU_PAUSED;
+
+	} else if ( kind == MSR_WRITE ) {
+		msrRequest( *req, vcpu, regs, MSR_LSTAR, regs.msr_lstar );
+
+	} else {
+		vmcallRequest( *req, vcpu, regs );
+
+		if ( async_ & ENABLE_VMCALL )
+			req->flags &= ~MEM_EVENT_FLAG_VCPU_PAUSED;
+	}
+
+	paused_[vcpu] = ( req->flags & MEM_EVENT_FLAG_VCPU_PAUSED ) != 0;
+
+	if ( paused_[vcpu] )
+		injectedAt_[vcpu] = nowNs();
+	else
+		++asyncInFlight_[vcpu];
+
+	++frontRing_.req_prod_pvt;
+	++sequence_;
+	++injected_;
+
+	return true;
+}
+
+void MockEventManager::collect()
+{
+	uint64_t now = 0;
+
+	while ( RING_HAS_UNCONSUMED_RESPONSES( &frontRing_ ) ) {
+		const mem_event_response_t *rsp = RING_GET_RESPONSE( &frontRing_, frontRing_.rsp_cons );
+
+		if ( ( rsp->flags & MEM_EVENT_FLAG_VCPU_PAUSED ) && rsp->vcpu_id < paused_.size() ) {
+			if ( !now )
+				now = nowNs();
+
+			paused_[rsp->vcpu_id] = false;
+			latencies_.add( now - injectedAt_[rsp->vcpu_id] );
+
+		} else if ( rsp->vcpu_id < asyncInFlight_.size() && asyncInFlight_[rsp->vcpu_id] )
+			--asyncInFlight_[rsp->vcpu_id];
+
+		++frontRing_.rsp_cons;
+		++answered_;
+	}
+}
+
+void MockEventManager::publishLatencies()
+{
+	pthread_mutex_lock( &lock_ );
+	published_.merge( latencies_ );
+	pthread_mutex_unlock( &lock_ );
+
+	latencies_.clear();
+}
+
+void MockEventManager::takeLatencies( Histogram &latencies )
+{
+	pthread_mutex_lock( &lock_ );
+	latencies.merge( published_ );
+	published_.clear();
+	pthread_mutex_unlock( &lock_ );
+}
+
+} // namespace bdvmi
@@ -0,0 +1,178 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/mockguest.h"
+#include "bdvmi/exception.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace bdvmi {
+
+namespace { // Anonymous namespace
+
+const uint64_t PAGE_SIZE_4K = 1ULL << MockGuest::PAGE_SHIFT;
+const uint64_t PRESENT = 1ULL << 0;
+const uint64_t WRITABLE = 1ULL << 1;
+const uint64_t USER = 1ULL << 2;
+const uint64_t ADDRESS_MASK = 0x000ffffffffff000ULL;
+
+} // end of anonymous namespace
+
+const unsigned int MockGuest::PAGE_SHIFT;
+
+MockGuest::MockGuest( unsigned int vcpus, uint64_t memorySize )
+    : pages_( memorySize >> PAGE_SHIFT, static_cast<char *>( NULL ) ), regs_( vcpus ), nextFree_( pages_.size() )
+{
+	if ( pages_.empty() || !vcpus )
+		throw Exception( "[Mock] the guest needs at least one VCPU and one page of memory" );
+}
+
+MockGuest::~MockGuest()
+{
+	for ( size_t i = 0; i < pages_.size(); ++i )
+		free( pages_[i] );
+}
+
+char *MockGuest::page( uint64_t gfn, bool create )
+{
+	if ( gfn >= pages_.size() )
+		return NULL;
+
+	char *p = pages_[gfn];
+
+	if ( p || !create )
+		return p;
+
+	void *fresh = NULL;
+
+	if ( posix_memalign( &fresh, PAGE_SIZE_4K, PAGE_SIZE_4K ) )
+		return NULL;
+
+	memset( fresh, 0, PAGE_SIZE_4K );
+
+	// Somebody else may have gotten there first
+	if ( !__sync_bool_compare_and_swap( &pages_[gfn], static_cast<char *>( NULL ), static_cast<char *>( fresh ) ) )
+		free( fresh );
+
+	return pages_[gfn];
+}
+
+bool MockGuest::read( uint64_t gpa, void *buffer, size_t size ) const
+{
+	char *dest = static_cast<char *>( buffer );
+
+	if ( gpa >= memorySize() || size > memorySize() - gpa )
+		return false;
+
+	while ( size ) {
+		size_t offset = gpa & ( PAGE_SIZE_4K - 1 );
+		size_t chunk = std::min<size_t>( size, PAGE_SIZE_4K - offset );
+		const char *p = pages_[gpa >> PAGE_SHIFT];
+
+		if ( p )
+			memcpy( dest, p + offset, chunk );
+		else
+			memset( dest, 0, chunk );
+
+		dest += chunk;
+		gpa += chunk;
+		size -= chunk;
+	}
+
+	return true;
+}
+
+bool MockGuest::write( uint64_t gpa, const void *buffer, size_t size )
+{
+	const char *src = static_cast<const char *>( buffer );
+
+	if ( gpa >= memorySize() || size > memorySize() - gpa )
+		return false;
+
+	while ( size ) {
+		size_t offset = gpa & ( PAGE_SIZE_4K - 1 );
+		size_t chunk = std::min<size_t>( size, PAGE_SIZE_4K - offset );
+		char *p = page( gpa >> PAGE_SHIFT, true );
+
+		if ( !p )
+			return false;
+
+		memcpy( p + offset, src, chunk );
+
+		src += chunk;
+		gpa += chunk;
+		size -= chunk;
+	}
+
+	return true;
+}
+
+uint64_t MockGuest::allocPage()
+{
+	uint64_t gfn = __sync_sub_and_fetch( &nextFree_, 1 );
+
+	if ( gfn >= pages_.size() || !page( gfn, true ) )
+		throw Exception( "[Mock] out of guest memory" );
+
+	return gfn << PAGE_SHIFT;
+}
+
+uint64_t MockGuest::createAddressSpace()
+{
+	return allocPage();
+}
+
+bool MockGuest::mapPage( uint64_t cr3, uint64_t gva, uint64_t gpa, bool writable )
+{
+	uint64_t table = cr3 & ADDRESS_MASK;
+
+	for ( int shift = 39; shift > 12; shift -= 9 ) {
+		uint64_t entryAddress = table + ( ( gva >> shift ) & 0x1ff ) * 8;
+		uint64_t entry = 0;
+
+		if ( !read( entryAddress, &entry, sizeof( entry ) ) )
+			return false;
+
+		if ( !( entry & PRESENT ) ) {
+			entry = allocPage() | PRESENT | WRITABLE | USER;
+
+			if ( !write( entryAddress, &entry, sizeof( entry ) ) )
+				return false;
+		}
+
+		table = entry & ADDRESS_MASK;
+	}
+
+	uint64_t pte = ( gpa & ADDRESS_MASK ) | PRESENT | USER | ( writable ? WRITABLE : 0 );
+
+	return write( table + ( ( gva >> 12 ) & 0x1ff ) * 8, &pte, sizeof( pte ) );
+}
+
+void MockGuest::longMode( unsigned short vcpu, uint64_t cr3, uint64_t rip )
+{
+	Registers &regs = regs_[vcpu];
+
+	regs.cr0 = 0x80050033;   // PG | WP | NE | ET | MP | PE
+	regs.cr3 = cr3;
+	regs.cr4 = 0x000006f0;   // OSXMMEXCPT | OSFXSR | PGE | MCE | PAE | PSE
+	regs.msr_efer = 0xd01;   // NXE | LMA | LME | SCE
+	regs.cs_arbytes = 0xa9b; // G | L | P | S | code, execute / read, accessed
+	regs.rflags = 0x202;
+	regs.rip = rip;
+	regs.guest_x86_mode = Registers::CS_TYPE_64;
+}
+
+} // namespace bdvmi
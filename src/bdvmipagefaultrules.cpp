@@ -0,0 +1,113 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/pagefaultrules.h"
+#include <algorithm>
+
+namespace bdvmi {
+
+const uint64_t PageFaultRules::ANY_CR3 = ~0ULL;
+
+bool PageFaultRules::add( uint64_t gfnStart, uint64_t gfnEnd, unsigned int access, uint64_t ripStart,
+                          uint64_t ripEnd, uint64_t cr3, HVAction action )
+{
+	if ( gfnStart > gfnEnd || ripStart > ripEnd || !( access & ( ACCESS_R | ACCESS_W | ACCESS_X ) ) )
+		return false;
+
+	if ( action == SKIP_INSTRUCTION || action == EMULATE_SET_CTXT )
+		return false;
+
+	Rule rule = { gfnStart, gfnEnd, ripStart, ripEnd, cr3, access, action };
+	rules_.push_back( rule );
+
+	return true;
+}
+
+void PageFaultRules::clear()
+{
+	rules_.clear();
+	segmentStarts_.clear();
+	segmentFirst_.clear();
+	segmentRules_.clear();
+}
+
+void PageFaultRules::compile()
+{
+	std::vector<uint64_t> bounds;
+
+	segmentStarts_.clear();
+	segmentFirst_.clear();
+	segmentRules_.clear();
+
+	for ( std::vector<Rule>::const_iterator i = rules_.begin(); i != rules_.end(); ++i ) {
+		bounds.push_back( i->gfnStart );
+
+		if ( i->gfnEnd != ~0ULL )
+			bounds.push_back( i->gfnEnd + 1 );
+	}
+
+	std::sort( bounds.begin(), bounds.end() );
+	bounds.erase( std::unique( bounds.begin(), bounds.end() ), bounds.end() );
+
+	// No rule starts or ends inside a segment, so checking its first GFN is enough. Segments
+	// with the same rules as the previous one are merged into it.
+	std::vector<size_t> previous, current;
+
+	for ( std::vector<uint64_t>::const_iterator b = bounds.begin(); b != bounds.end(); ++b ) {
+		current.clear();
+
+		for ( size_t r = 0; r < rules_.size(); ++r )
+			if ( rules_[r].gfnStart <= *b && *b <= rules_[r].gfnEnd )
+				current.push_back( r );
+
+		if ( !segmentStarts_.empty() && current == previous )
+			continue;
+
+		segmentStarts_.push_back( *b );
+		segmentFirst_.push_back( segmentRules_.size() );
+
+		for ( std::vector<size_t>::const_iterator r = current.begin(); r != current.end(); ++r )
+			segmentRules_.push_back( rules_[*r] );
+
+		previous.swap( current );
+	}
+
+	segmentFirst_.push_back( segmentRules_.size() ); // end marker
+}
+
+bool PageFaultRules::match( uint64_t gfn, unsigned int access, uint64_t rip, uint64_t cr3, HVAction &action ) const
+{
+	std::vector<uint64_t>::const_iterator i =
+	        std::upper_bound( segmentStarts_.begin(), segmentStarts_.end(), gfn );
+
+	if ( i == segmentStarts_.begin() )
+		return false;
+
+	size_t segment = ( i - segmentStarts_.begin() ) - 1;
+
+	for ( size_t r = segmentFirst_[segment]; r < segmentFirst_[segment + 1]; ++r ) {
+		const Rule &rule = segmentRules_[r];
+
+		if ( ( access & ~rule.access ) == 0 && rip >= rule.ripStart && rip <= rule.ripEnd &&
+		     ( rule.cr3 == ANY_CR3 || rule.cr3 == cr3 ) ) {
+			action = rule.action;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+} // namespace bdvmi
@@ -0,0 +1,339 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/replaydriver.h"
+#include "bdvmi/exception.h"
+#include "bdvmi/pagewalk.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+
+namespace bdvmi {
+
+namespace { // Anonymous namespace
+
+const unsigned int PAGE_SHIFT = 12;
+const unsigned long long PAGE_SIZE_4K = 1ULL << PAGE_SHIFT;
+
+enum { PROT_R = 1, PROT_W = 2, PROT_X = 4 };
+
+} // end of anonymous namespace
+
+ReplayDriver::ReplayDriver( const std::string &tracePath, const ReplayOptions &options, LogHelper *logHelper )
+    : trace_( tracePath, __XEN_LATEST_INTERFACE_VERSION__, sizeof( mem_event_request_t ),
+              sizeof( mem_event_response_t ) ),
+      options_( options ), logHelper_( logHelper ), uuid_( tracePath ), memory_( NULL ), memorySize_( 0 ),
+      ring_( NULL ), cpuCount_( 0 ), protectionGeneration_( 0 )
+{
+	for ( size_t i = 0; i < trace_.size(); ++i ) {
+		const mem_event_request_t *req = static_cast<const mem_event_request_t *>( trace_.request( i ) );
+
+		if ( req->vcpu_id >= cpuCount_ )
+			cpuCount_ = req->vcpu_id + 1;
+	}
+
+	requests_.resize( cpuCount_ );
+	hasRequest_.assign( cpuCount_, false );
+	setRegisters_.resize( cpuCount_ );
+	registersSet_.assign( cpuCount_, false );
+
+	if ( !options_.memoryImage.empty() ) {
+		int fd = open( options_.memoryImage.c_str(), O_RDONLY | O_CLOEXEC );
+		struct stat st;
+
+		if ( fd < 0 || fstat( fd, &st ) ) {
+			if ( fd >= 0 )
+				close( fd );
+
+			throw Exception( std::string( "[Replay] could not open " ) + options_.memoryImage + ": " +
+			                 strerror( errno ) );
+		}
+
+		memorySize_ = st.st_size;
+
+		// Private, so that the guest (i.e. the handler) writing to its memory doesn't change the image
+		void *map = memorySize_ ? mmap( NULL, memorySize_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 ) : NULL;
+		close( fd );
+
+		if ( map == MAP_FAILED )
+			throw Exception( std::string( "[Replay] could not map " ) + options_.memoryImage + ": " +
+			                 strerror( errno ) );
+
+		memory_ = static_cast<char *>( map );
+	}
+
+	void *ring = NULL;
+
+	if ( posix_memalign( &ring, XC_PAGE_SIZE, XC_PAGE_SIZE ) ) {
+		cleanup();
+		throw Exception( "[Replay] could not allocate the ring page" );
+	}
+
+	memset( ring, 0, XC_PAGE_SIZE );
+	ring_ = static_cast<mem_event_sring_t *>( ring );
+	SHARED_RING_INIT( ring_ );
+}
+
+ReplayDriver::~ReplayDriver()
+{
+	cleanup();
+}
+
+void ReplayDriver::cleanup()
+{
+	if ( memory_ ) {
+		munmap( memory_, memorySize_ );
+		memory_ = NULL;
+	}
+
+	free( ring_ );
+	ring_ = NULL;
+}
+
+bool ReplayDriver::cpuCount( unsigned int &count ) const throw()
+{
+	count = cpuCount_;
+	return true;
+}
+
+bool ReplayDriver::tscSpeed( unsigned long long &speed ) const throw()
+{
+	speed = trace_.header().tscSpeed;
+	return speed != 0;
+}
+
+bool ReplayDriver::mtrrType( unsigned long long /* guestAddress */, uint8_t &type ) const throw()
+{
+	type = 6; // write-back, what guest RAM normally is
+	return true;
+}
+
+bool ReplayDriver::setPageProtection( unsigned long long guestAddress, bool read, bool write, bool execute ) throw()
+{
+	unsigned long long gfn = guestAddress >> PAGE_SHIFT;
+	unsigned char bits = ( read ? PROT_R : 0 ) | ( write ? PROT_W : 0 ) | ( execute ? PROT_X : 0 );
+
+	try {
+		if ( bits == ( PROT_R | PROT_W | PROT_X ) )
+			protections_.erase( gfn );
+		else
+			protections_[gfn] = bits;
+
+	} catch ( ... ) {
+		return false;
+	}
+
+	__sync_add_and_fetch( &protectionGeneration_, 1 );
+
+	// The trace decides which faults happen, this is only for getPageProtection()
+	return true;
+}
+
+bool ReplayDriver::getPageProtection( unsigned long long guestAddress, bool &read, bool &write,
+                                      bool &execute ) const throw()
+{
+	std::map<unsigned long long, unsigned char>::const_iterator i = protections_.find( guestAddress >> PAGE_SHIFT );
+	unsigned char bits = ( i == protections_.end() ) ? ( PROT_R | PROT_W | PROT_X ) : i->second;
+
+	read = ( bits & PROT_R ) != 0;
+	write = ( bits & PROT_W ) != 0;
+	execute = ( bits & PROT_X ) != 0;
+
+	return true;
+}
+
+bool ReplayDriver::registers( unsigned short vcpu, Registers &regs ) const throw()
+{
+	if ( vcpu >= cpuCount_ )
+		return false;
+
+	if ( registersSet_[vcpu] ) {
+		regs = setRegisters_[vcpu];
+		return true;
+	}
+
+	if ( !hasRequest_[vcpu] )
+		return false;
+
+	XenEventManager::requestRegisters( requests_[vcpu], regs );
+
+	return true;
+}
+
+bool ReplayDriver::mtrrs( unsigned short vcpu, Mtrrs &m ) const throw()
+{
+	if ( vcpu >= cpuCount_ )
+		return false;
+
+	m = Mtrrs();
+
+	return true;
+}
+
+bool ReplayDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool setEip ) throw()
+{
+	Registers current;
+
+	if ( !registers( vcpu, current ) )
+		return false;
+
+	setRegisters_[vcpu] = regs;
+
+	if ( !setEip )
+		setRegisters_[vcpu].rip = current.rip;
+
+	registersSet_[vcpu] = true;
+
+	return true;
+}
+
+bool ReplayDriver::writeToPhysAddress( unsigned long long address, void *buffer, size_t length ) throw()
+{
+	if ( address >= memorySize_ || length > memorySize_ - address )
+		return false;
+
+	memcpy( memory_ + address, buffer, length );
+
+	return true;
+}
+
+bool ReplayDriver::enableMsrExit( unsigned int msr, bool &oldValue ) throw()
+{
+	try {
+		oldValue = msrs_.set( msr, true );
+
+	} catch ( ... ) {
+		return false;
+	}
+
+	return true;
+}
+
+bool ReplayDriver::disableMsrExit( unsigned int msr, bool &oldValue ) throw()
+{
+	oldValue = msrs_.set( msr, false );
+	return true;
+}
+
+MapReturnCode ReplayDriver::mapPhysMemToHost( unsigned long long address, size_t length, uint32_t /* flags */,
+                                              void *&pointer ) throw()
+{
+	// one-page limit
+	if ( !length || ( address >> PAGE_SHIFT ) != ( ( address + length - 1 ) >> PAGE_SHIFT ) )
+		return MAP_INVALID_PARAMETER;
+
+	pointer = NULL;
+
+	if ( address >= memorySize_ || length > memorySize_ - address )
+		return MAP_PAGE_NOT_PRESENT;
+
+	pointer = memory_ + address;
+
+	return MAP_SUCCESS;
+}
+
+bool ReplayDriver::unmapPhysMem( void * /* hostPtr */ ) throw()
+{
+	return true;
+}
+
+MapReturnCode ReplayDriver::mapVirtMemToHost( unsigned long long address, size_t length, uint32_t flags,
+                                              unsigned short vcpu, void *&pointer ) throw()
+{
+	// one-page limit
+	if ( !length || ( address >> PAGE_SHIFT ) != ( ( address + length - 1 ) >> PAGE_SHIFT ) )
+		return MAP_INVALID_PARAMETER;
+
+	Registers regs;
+	uint64_t gpa;
+
+	pointer = NULL;
+
+	if ( !registers( vcpu, regs ) )
+		return MAP_INVALID_PARAMETER;
+
+	if ( !walkPageTables( *this, regs, address, gpa ) )
+		return MAP_PAGE_NOT_PRESENT;
+
+	return mapPhysMemToHost( gpa, length, flags, pointer );
+}
+
+bool ReplayDriver::unmapVirtMem( void * /* hostPtr */ ) throw()
+{
+	return true;
+}
+
+bool ReplayDriver::cacheGuestVirtAddr( unsigned long long /* addr */ ) throw()
+{
+	return true;
+}
+
+bool ReplayDriver::requestPageFault( int /* vcpu */, uint64_t /* addressSpace */, uint64_t /* virtualAddress */,
+                                     uint32_t /* writeAccess */ ) throw()
+{
+	// The guest can't be made to do anything it hasn't done in the recording
+	return false;
+}
+
+bool ReplayDriver::disableRepOptimizations() throw()
+{
+	return true;
+}
+
+bool ReplayDriver::shutdown() throw()
+{
+	return true;
+}
+
+bool ReplayDriver::pause() throw()
+{
+	return true;
+}
+
+bool ReplayDriver::unpause() throw()
+{
+	return true;
+}
+
+bool ReplayDriver::setPageCacheLimit( size_t /* limit */ ) throw()
+{
+	return true;
+}
+
+void ReplayDriver::currentRequest( unsigned short vcpu, const mem_event_request_t *req )
+{
+	if ( vcpu >= cpuCount_ )
+		return;
+
+	requests_[vcpu] = *req;
+	hasRequest_[vcpu] = true;
+	registersSet_[vcpu] = false;
+}
+
+bool ReplayDriver::read( uint64_t gpa, void *buffer, size_t size ) const
+{
+	if ( gpa >= memorySize_ || size > memorySize_ - gpa )
+		return false;
+
+	memcpy( buffer, memory_ + gpa, size );
+
+	return true;
+}
+
+} // namespace bdvmi
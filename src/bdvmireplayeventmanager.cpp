@@ -0,0 +1,208 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/replayeventmanager.h"
+#include "bdvmi/replaydriver.h"
+#include "bdvmi/eventtrace.h"
+#include "bdvmi/exception.h"
+#include "clock.h"
+
+namespace bdvmi {
+
+ReplayEventManager::ReplayEventManager( ReplayDriver &driver, unsigned short handlerFlags, LogHelper *logHelper )
+    : XenEventManager( driver, handlerFlags, logHelper, driver.ring() ), driver_( driver ), next_( 0 ), loop_( 0 ),
+      startNs_( 0 ), startTsc_( 0 ), outstanding_( 0 ), replayed_( 0 ), mismatches_( 0 )
+{
+#ifdef DISABLE_MEM_EVENT
+	throw Exception( "[Replay] libbdvmi was built without mem_event support" );
+#endif // DISABLE_MEM_EVENT
+
+	unsigned int vcpus = 0;
+	driver_.cpuCount( vcpus );
+
+	onRing_.resize( vcpus );
+	paused_.assign( vcpus, false );
+
+	// Start over if the driver's ring has been used before
+	SHARED_RING_INIT( driver_.ring() );
+	FRONT_RING_INIT( &frontRing_, driver_.ring(), XC_PAGE_SIZE );
+}
+
+ReplayEventManager::~ReplayEventManager()
+{
+	// Collect what's still on the ring while this object is still around
+	if ( !stopping() ) {
+		stop();
+
+		try {
+			waitForEvents();
+
+		} catch ( ... ) {
+			// Exceptions not allowed to escape destructors
+		}
+	}
+}
+
+void ReplayEventManager::waitForEvents()
+{
+	for ( ;; ) {
+		bool more = runOnce( feed(), 0 );
+
+		collect();
+
+		if ( !more )
+			break;
+	}
+}
+
+bool ReplayEventManager::processPending( unsigned int maxEvents )
+{
+	feed();
+
+	bool more = runOnce( 0, maxEvents );
+
+	collect();
+
+	return more;
+}
+
+bool ReplayEventManager::parallelDispatch( unsigned int workers )
+{
+	if ( workers && driver_.options().deterministic )
+		return false;
+
+	return XenEventManager::parallelDispatch( workers );
+}
+
+void ReplayEventManager::beginRequest( const mem_event_request_t &req )
+{
+	driver_.currentRequest( req.vcpu_id, &req );
+}
+
+int ReplayEventManager::feed()
+{
+	if ( stopping() )
+		return 0;
+
+	const EventTraceReader &trace = driver_.trace();
+	const ReplayOptions &options = driver_.options();
+	bool pushed = false;
+	int wait = -1;
+
+	while ( !RING_FULL( &frontRing_ ) ) {
+
+		if ( next_ == trace.size() ) {
+			if ( ( options.loops && loop_ + 1 >= options.loops ) || trace.size() == 0 ) {
+				if ( !outstanding_ && !pushed ) {
+					stop();
+					return 0;
+				}
+
+				break;
+			}
+
+			// Wait for the previous round to be over, the recorded timing starts anew
+			if ( outstanding_ || pushed )
+				break;
+
+			++loop_;
+			next_ = 0;
+		}
+
+		const mem_event_request_t *req = static_cast<const mem_event_request_t *>( trace.request( next_ ) );
+		unsigned short vcpu = req->vcpu_id;
+
+		// The VCPU is still waiting for its previous request to be answered
+		if ( paused_[vcpu] )
+			break;
+
+		if ( options.realTime && trace.header().tscSpeed ) {
+			uint64_t tsc = trace.record( next_ ).tsc;
+			uint64_t now = nowNs();
+
+			if ( next_ == 0 ) {
+				startNs_ = now;
+				startTsc_ = tsc;
+			}
+
+			double speed = options.speed > 0 ? options.speed : 1.0;
+			uint64_t due = startNs_ + static_cast<uint64_t>( ( tsc - startTsc_ ) * 1e9 /
+			                                                  trace.header().tscSpeed / speed );
+
+			if ( due > now ) {
+				wait = static_cast<int>( ( due - now + 999999 ) / 1000000 );
+				break;
+			}
+		}
+
+		*RING_GET_REQUEST( &frontRing_, frontRing_.req_prod_pvt ) = *req;
+		++frontRing_.req_prod_pvt;
+
+		onRing_[vcpu].push_back( next_ );
+
+		if ( req->flags & MEM_EVENT_FLAG_VCPU_PAUSED )
+			paused_[vcpu] = true;
+
+		++outstanding_;
+		++next_;
+		pushed = true;
+	}
+
+	if ( !pushed )
+		return wait;
+
+	RING_PUSH_REQUESTS( &frontRing_ );
+
+	return 0;
+}
+
+void ReplayEventManager::collect()
+{
+	const EventTraceReader &trace = driver_.trace();
+	int moreResponses = 0;
+
+	do {
+		while ( RING_HAS_UNCONSUMED_RESPONSES( &frontRing_ ) ) {
+			const mem_event_response_t *rsp = RING_GET_RESPONSE( &frontRing_, frontRing_.rsp_cons );
+			unsigned short vcpu = rsp->vcpu_id;
+
+			++frontRing_.rsp_cons;
+
+			if ( vcpu >= onRing_.size() || onRing_[vcpu].empty() ) {
+				++mismatches_;
+				continue;
+			}
+
+			const mem_event_response_t *recorded =
+			        static_cast<const mem_event_response_t *>( trace.response( onRing_[vcpu].front() ) );
+
+			if ( rsp->flags != recorded->flags )
+				++mismatches_;
+
+			onRing_[vcpu].pop_front();
+
+			if ( onRing_[vcpu].empty() )
+				paused_[vcpu] = false;
+
+			--outstanding_;
+			++replayed_;
+		}
+
+		RING_FINAL_CHECK_FOR_RESPONSES( &frontRing_, moreResponses );
+
+	} while ( moreResponses );
+}
+
+} // namespace bdvmi
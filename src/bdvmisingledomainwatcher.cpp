@@ -0,0 +1,56 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/singledomainwatcher.h"
+
+namespace bdvmi {
+
+SingleDomainWatcher::SingleDomainWatcher( const std::string &name ) : name_( name ), reported_( false )
+{
+}
+
+bool SingleDomainWatcher::waitForDomainsOrTimeout( std::list<DomainInfo> &domains, int ms )
+{
+	domains.clear();
+
+	if ( !reported_ && !name_.empty() ) {
+		DomainInfo domain;
+
+		domain.name = name_;
+		domain.isAlreadyRunning = true;
+		domains.push_back( domain );
+
+		reported_ = true;
+		return true;
+	}
+
+	// Nothing else will ever show up, just wait to be stopped
+	if ( poller_.wait( ms ) & EventPoller::STOP_SIGNAL )
+		stop();
+
+	return false;
+}
+
+void SingleDomainWatcher::wakeUp()
+{
+	poller_.wakeUp();
+}
+
+bool SingleDomainWatcher::watchStopSignals( const sigset_t &signals )
+{
+	return poller_.watchSignals( signals );
+}
+
+} // namespace bdvmi
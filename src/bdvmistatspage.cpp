@@ -0,0 +1,333 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+#include "bdvmi/statspage.h"
+#include "clock.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <cstring>
+#include <sstream>
+
+namespace bdvmi {
+
+namespace { // Anonymous namespace
+
+pthread_mutex_t slotsLock = PTHREAD_MUTEX_INITIALIZER; // acquire() / release() vs. each other
+
+const char *const eventManagerValues[StatsSlot::EM_VALUES] = {
+	"events",      "page_faults",     "cr",       "msr",       "vmcall",  "xsetbv",       "other",
+	"filtered",    "in_flight",       "spin_wakeups", "sleep_wakeups", "spin_ns", "handler_ns", "responses",
+	"response_ns", "response_p99_ns", "notifies", "notify_ns", "batches",
+	"deadline_misses", "late_decisions", "shed", "governor_level"
+};
+
+const char *const driverValues[StatsSlot::DRV_VALUES] = {
+	"hypercalls", "cache_hits", "cache_misses", "cache_evictions", "cache_pages", "map_failures"
+};
+
+const char *const domainWatcherValues[StatsSlot::DW_VALUES] = { "wakeups", "domains", "protected_domains" };
+
+std::string shmName( pid_t pid )
+{
+	std::stringstream ss;
+
+	ss << "/bdvmi-stats." << pid;
+
+	return ss.str();
+}
+
+// The writer's side of the seqlock
+inline void beginWrite( StatsSlot *slot )
+{
+	slot->sequence = slot->sequence + 1;
+	__sync_synchronize();
+}
+
+inline void endWrite( StatsSlot *slot )
+{
+	__sync_synchronize();
+	slot->sequence = slot->sequence + 1;
+}
+
+} // end of anonymous namespace
+
+StatsPageHeader *StatsPage::page_ = NULL;
+size_t StatsPage::size_ = 0;
+
+bool StatsPage::open( unsigned int slots )
+{
+	pthread_mutex_lock( &slotsLock );
+
+	if ( page_ ) {
+		pthread_mutex_unlock( &slotsLock );
+		return true;
+	}
+
+	std::string name = shmName( getpid() );
+	size_t size = sizeof( StatsPageHeader ) + slots * sizeof( StatsSlot );
+	int fd = shm_open( name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+	void *page = MAP_FAILED;
+
+	if ( fd >= 0 ) {
+		if ( ftruncate( fd, size ) == 0 )
+			page = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+
+		::close( fd );
+
+		if ( page == MAP_FAILED )
+			shm_unlink( name.c_str() );
+	}
+
+	if ( page == MAP_FAILED ) {
+		pthread_mutex_unlock( &slotsLock );
+		return false;
+	}
+
+	// The pages start out zeroed, i.e. with all the slots FREE
+	StatsPageHeader *header = static_cast<StatsPageHeader *>( page );
+
+	header->version = StatsPageHeader::VERSION;
+	header->pid = getpid();
+	header->slots = slots;
+	__sync_synchronize();
+	header->magic = StatsPageHeader::MAGIC;
+
+	page_ = header;
+	size_ = size;
+
+	pthread_mutex_unlock( &slotsLock );
+
+	return true;
+}
+
+void StatsPage::close()
+{
+	pthread_mutex_lock( &slotsLock );
+
+	// Not unmapped, the components publishing there may be still at it
+	if ( page_ ) {
+		shm_unlink( shmName( getpid() ).c_str() );
+		page_ = NULL;
+	}
+
+	pthread_mutex_unlock( &slotsLock );
+}
+
+StatsSlot *StatsPage::acquire( StatsSlot::Kind kind, const std::string &name )
+{
+	StatsSlot *found = NULL;
+
+	pthread_mutex_lock( &slotsLock );
+
+	if ( page_ ) {
+		StatsSlot *slots = reinterpret_cast<StatsSlot *>( page_ + 1 );
+
+		for ( unsigned int i = 0; i < page_->slots && !found; ++i ) {
+			if ( slots[i].kind == StatsSlot::FREE )
+				found = &slots[i];
+		}
+	}
+
+	if ( found ) {
+		beginWrite( found );
+
+		strncpy( found->name, name.c_str(), StatsSlot::NAME_SIZE - 1 );
+		found->name[StatsSlot::NAME_SIZE - 1] = '\0';
+		found->updated = nowNs();
+
+		for ( unsigned int i = 0; i < StatsSlot::VALUES; ++i )
+			found->values[i] = 0;
+
+		found->kind = kind;
+
+		endWrite( found );
+	}
+
+	pthread_mutex_unlock( &slotsLock );
+
+	return found;
+}
+
+void StatsPage::release( StatsSlot *slot )
+{
+	if ( !slot )
+		return;
+
+	pthread_mutex_lock( &slotsLock );
+
+	beginWrite( slot );
+	slot->kind = StatsSlot::FREE;
+	endWrite( slot );
+
+	pthread_mutex_unlock( &slotsLock );
+}
+
+void StatsPage::publish( StatsSlot *slot, const uint64_t *values, unsigned int count )
+{
+	if ( !slot )
+		return;
+
+	if ( count > StatsSlot::VALUES )
+		count = StatsSlot::VALUES;
+
+	beginWrite( slot );
+
+	for ( unsigned int i = 0; i < count; ++i )
+		slot->values[i] = values[i];
+
+	slot->updated = nowNs();
+
+	endWrite( slot );
+}
+
+std::string StatsPage::path( pid_t pid )
+{
+	return "/dev/shm" + shmName( pid );
+}
+
+const char *StatsPage::kindName( uint32_t kind )
+{
+	switch ( kind ) {
+		case StatsSlot::EVENT_MANAGER:
+			return "events";
+		case StatsSlot::DRIVER:
+			return "driver";
+		case StatsSlot::DOMAIN_WATCHER:
+			return "domain watcher";
+		default:
+			return NULL;
+	}
+}
+
+const char *StatsPage::valueName( uint32_t kind, unsigned int index )
+{
+	switch ( kind ) {
+		case StatsSlot::EVENT_MANAGER:
+			return index < StatsSlot::EM_VALUES ? eventManagerValues[index] : NULL;
+		case StatsSlot::DRIVER:
+			return index < StatsSlot::DRV_VALUES ? driverValues[index] : NULL;
+		case StatsSlot::DOMAIN_WATCHER:
+			return index < StatsSlot::DW_VALUES ? domainWatcherValues[index] : NULL;
+		default:
+			return NULL;
+	}
+}
+
+bool StatsPage::valueIsCounter( uint32_t kind, unsigned int index )
+{
+	switch ( kind ) {
+		case StatsSlot::EVENT_MANAGER:
+			return index != StatsSlot::EM_IN_FLIGHT && index != StatsSlot::EM_RESPONSE_P99 &&
+			       index != StatsSlot::EM_GOVERNOR_LEVEL;
+		case StatsSlot::DRIVER:
+			return index != StatsSlot::DRV_CACHE_PAGES;
+		default:
+			return true;
+	}
+}
+
+StatsPageReader::StatsPageReader() : page_( NULL ), size_( 0 )
+{
+}
+
+StatsPageReader::~StatsPageReader()
+{
+	detach();
+}
+
+bool StatsPageReader::attach( pid_t pid )
+{
+	detach();
+
+	int fd = shm_open( shmName( pid ).c_str(), O_RDONLY, 0 );
+
+	if ( fd < 0 )
+		return false;
+
+	struct stat st;
+	void *page = MAP_FAILED;
+
+	if ( fstat( fd, &st ) == 0 && static_cast<size_t>( st.st_size ) >= sizeof( StatsPageHeader ) )
+		page = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+
+	::close( fd );
+
+	if ( page == MAP_FAILED )
+		return false;
+
+	const StatsPageHeader *header = static_cast<const StatsPageHeader *>( page );
+
+	if ( header->magic != StatsPageHeader::MAGIC || header->version != StatsPageHeader::VERSION ||
+	     sizeof( StatsPageHeader ) + header->slots * sizeof( StatsSlot ) > static_cast<size_t>( st.st_size ) ) {
+		munmap( page, st.st_size );
+		return false;
+	}
+
+	page_ = header;
+	size_ = st.st_size;
+
+	return true;
+}
+
+void StatsPageReader::detach()
+{
+	if ( page_ ) {
+		munmap( const_cast<StatsPageHeader *>( page_ ), size_ );
+		page_ = NULL;
+		size_ = 0;
+	}
+}
+
+bool StatsPageReader::read( unsigned int index, StatsSlot &slot ) const
+{
+	if ( !page_ || index >= page_->slots )
+		return false;
+
+	const StatsSlot &src = reinterpret_cast<const StatsSlot *>( page_ + 1 )[index];
+
+	for ( int tries = 0; tries < 1000; ++tries ) {
+		uint32_t before = src.sequence;
+
+		if ( before & 1 ) { // being written right now
+			sched_yield();
+			continue;
+		}
+
+		__sync_synchronize();
+
+		slot.kind = src.kind;
+		memcpy( slot.name, src.name, sizeof( slot.name ) );
+		slot.updated = src.updated;
+
+		for ( unsigned int i = 0; i < StatsSlot::VALUES; ++i )
+			slot.values[i] = src.values[i];
+
+		__sync_synchronize();
+
+		if ( src.sequence == before ) {
+			slot.sequence = before;
+			slot.name[StatsSlot::NAME_SIZE - 1] = '\0';
+
+			return slot.kind != StatsSlot::FREE;
+		}
+	}
+
+	return false;
+}
+
+} // namespace bdvmi
@@ -15,6 +15,8 @@
 
 #include "bdvmi/loghelper.h"
 #include "bdvmi/xencache.h"
+#include "tracepoints.h"
+#include "scopedlock.h"
 #include <sys/mman.h>
 #include <cstring>
 #include <sstream>
@@ -35,14 +37,18 @@ static bool check_pages( void *addr, size_t size )
 }
 
 XenPageCache::XenPageCache( xc_interface *xci, domid_t domain, LogHelper *logHelper )
-    : xci_( NULL ), domain_( -1 ), cacheLimit_( MAX_CACHE_SIZE_DEFAULT ), logHelper_( logHelper )
+    : xci_( NULL ), domain_( -1 ), cacheLimit_( MAX_CACHE_SIZE_DEFAULT ), logHelper_( logHelper ), hits_( 0 ),
+      misses_( 0 ), evictions_( 0 ), failures_( 0 )
 {
+	pthread_mutex_init( &lock_, NULL );
 	init( xci, domain );
 }
 
 XenPageCache::XenPageCache( LogHelper *logHelper )
-    : xci_( NULL ), domain_( -1 ), cacheLimit_( MAX_CACHE_SIZE_DEFAULT ), logHelper_( logHelper )
+    : xci_( NULL ), domain_( -1 ), cacheLimit_( MAX_CACHE_SIZE_DEFAULT ), logHelper_( logHelper ), hits_( 0 ),
+      misses_( 0 ), evictions_( 0 ), failures_( 0 )
 {
+	pthread_mutex_init( &lock_, NULL );
 }
 
 void XenPageCache::init( xc_interface *xci, domid_t domain )
@@ -56,6 +62,8 @@ bool XenPageCache::setLimit( size_t limit )
 	if ( limit < 50 ) // magic number!
 		return false;
 
+	ScopedLock lock( lock_ );
+
 	cacheLimit_ = limit;
 	return true;
 }
@@ -70,22 +78,26 @@ XenPageCache::~XenPageCache()
 		// don't need to do anything else, std::map::~map() will
 		// take care of itself
 	}
+
+	pthread_mutex_destroy( &lock_ );
 }
 
 MapReturnCode XenPageCache::update( unsigned long gfn, void *&pointer )
 {
-	if ( !xci_ ) {
-		pointer = NULL;
-		return MAP_FAILED_GENERIC;
-	}
+	ScopedLock lock( lock_ );
 
 	cache_t::iterator i = cache_.find( gfn );
 
-	if ( i == cache_.end() ) // not found
+	if ( i == cache_.end() ) { // not found
+		++misses_;
+		BDVMI_TRACE2( cache_miss, domain_, gfn );
 		return insertNew( gfn, pointer );
+	}
+
+	++hits_;
 
 	i->second.accessed = generateIndex();
-	i->second.in_use = true;
+	++i->second.users;
 
 	pointer = i->second.pointer;
 	return MAP_SUCCESS;
@@ -93,6 +105,8 @@ MapReturnCode XenPageCache::update( unsigned long gfn, void *&pointer )
 
 void XenPageCache::release( void *pointer )
 {
+	ScopedLock lock( lock_ );
+
 	reverse_cache_t::const_iterator ri = reverseCache_.find( pointer );
 
 	if ( ri == reverseCache_.end() )
@@ -103,24 +117,32 @@ void XenPageCache::release( void *pointer )
 	if ( ci == cache_.end() )
 		return; // this should be impossible
 
-	ci->second.in_use = false; // mark for collection
+	if ( ci->second.users )
+		--ci->second.users; // collected once nobody's using it
 }
 
-MapReturnCode XenPageCache::insertNew( unsigned long gfn, void *&pointer )
+void XenPageCache::statistics( DriverStatistics &stats ) const
 {
-	if ( !xci_ ) {
-		pointer = NULL;
-		return MAP_FAILED_GENERIC;
-	}
+	ScopedLock lock( lock_ );
 
+	stats.cacheHits = hits_;
+	stats.cacheMisses = misses_;
+	stats.cacheEvictions = evictions_;
+	stats.cachePages = cache_.size();
+	stats.mapFailures = failures_;
+}
+
+MapReturnCode XenPageCache::insertNew( unsigned long gfn, void *&pointer )
+{
 	if ( cache_.size() >= cacheLimit_ )
 		cleanup();
 
 	CacheInfo ci;
 
 	ci.accessed = generateIndex();
-	ci.in_use = true;
-	ci.pointer = xc_map_foreign_range( xci_, domain_, XC_PAGE_SIZE, PROT_READ | PROT_WRITE, gfn );
+	ci.pointer = mapPage( gfn );
+
+	BDVMI_TRACE3( cache_map, domain_, gfn, ci.pointer );
 
 	if ( !ci.pointer ) {
 
@@ -136,6 +158,8 @@ MapReturnCode XenPageCache::insertNew( unsigned long gfn, void *&pointer )
 		}
 		*/
 
+		++failures_;
+
 		pointer = NULL;
 		return MAP_FAILED_GENERIC;
 	}
@@ -152,6 +176,8 @@ MapReturnCode XenPageCache::insertNew( unsigned long gfn, void *&pointer )
 
 		munmap( ci.pointer, XC_PAGE_SIZE );
 
+		++failures_;
+
 		pointer = NULL;
 		return MAP_PAGE_NOT_PRESENT;
 	}
@@ -163,13 +189,21 @@ MapReturnCode XenPageCache::insertNew( unsigned long gfn, void *&pointer )
 	return MAP_SUCCESS;
 }
 
+void *XenPageCache::mapPage( unsigned long gfn )
+{
+	if ( !xci_ )
+		return NULL;
+
+	return xc_map_foreign_range( xci_, domain_, XC_PAGE_SIZE, PROT_READ | PROT_WRITE, gfn );
+}
+
 void XenPageCache::cleanup()
 {
 	std::multimap<unsigned long, unsigned long> timeOrderedGFNs;
 	cache_t::iterator ci = cache_.begin();
 
 	for ( ; ci != cache_.end(); ++ci ) {
-		if ( !ci->second.in_use )
+		if ( !ci->second.users )
 			timeOrderedGFNs.insert(
 			        std::pair<unsigned long, unsigned long>( ci->second.accessed, ci->first ) );
 	}
@@ -187,6 +221,8 @@ void XenPageCache::cleanup()
 		if ( ci == cache_.end() )
 			continue;
 
+		BDVMI_TRACE2( cache_evict, domain_, ti->second );
+
 		munmap( ci->second.pointer, XC_PAGE_SIZE );
 		reverseCache_.erase( ci->second.pointer );
 		cache_.erase( ci );
@@ -194,6 +230,8 @@ void XenPageCache::cleanup()
 		++unmapped;
 	}
 
+	evictions_ += unmapped;
+
 	if ( logHelper_ ) {
 		std::stringstream ss;
 
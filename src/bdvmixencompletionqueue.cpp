@@ -0,0 +1,82 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/exception.h"
+#include "bdvmi/xencompletionqueue.h"
+#include "xenpendingevent.h"
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <unistd.h>
+
+namespace bdvmi {
+
+XenCompletionQueue::XenCompletionQueue() : head_( NULL ), fd_( -1 )
+{
+	fd_ = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+	if ( fd_ < 0 )
+		throw Exception( "[Xen events] eventfd() failed" );
+}
+
+XenCompletionQueue::~XenCompletionQueue()
+{
+	close( fd_ );
+}
+
+void XenCompletionQueue::push( XenPendingEvent *ev )
+{
+	XenPendingEvent *old;
+
+	do {
+		old = head_;
+		ev->next = old;
+	} while ( !__sync_bool_compare_and_swap( &head_, old, ev ) );
+
+	// Only wake up the consumer for the first event it hasn't seen yet
+	if ( !old ) {
+		uint64_t one = 1;
+		ssize_t ret;
+
+		do {
+			ret = write( fd_, &one, sizeof( one ) );
+		} while ( ret < 0 && errno == EINTR );
+	}
+}
+
+XenPendingEvent *XenCompletionQueue::popAll()
+{
+	XenPendingEvent *ev = __sync_lock_test_and_set( &head_, NULL );
+	XenPendingEvent *fifo = NULL;
+
+	// The list is newest first, reverse it
+	while ( ev ) {
+		XenPendingEvent *next = ev->next;
+		ev->next = fifo;
+		fifo = ev;
+		ev = next;
+	}
+
+	return fifo;
+}
+
+void XenCompletionQueue::clearNotification()
+{
+	uint64_t count;
+
+	while ( read( fd_, &count, sizeof( count ) ) < 0 && errno == EINTR )
+		;
+}
+
+} // namespace bdvmi
@@ -17,13 +17,15 @@
 #include "bdvmi/xendomainwatcher.h"
 #include "bdvmi/xeninlines.h"
 #include <errno.h>
-#include <poll.h>
 #include <cstdlib>
 #include <sstream>
 #include <cstring>
 
 namespace bdvmi {
 
+// EventPoller id
+enum { XENSTORE_READY = 1 };
+
 XenDomainWatcher::XenDomainWatcher( LogHelper *logHelper )
     : xsh_( NULL ), xci_( NULL ), introduceToken_( "introduce" ), releaseToken_( "release" ), logHelper_( logHelper )
 {
@@ -51,6 +53,17 @@ XenDomainWatcher::XenDomainWatcher( LogHelper *logHelper )
 		xs_close( xsh_ );
 		throw Exception( "xc_interface_init() failed" );
 	}
+
+	try {
+		poller_.add( xs_fileno( xsh_ ), XENSTORE_READY );
+
+	} catch ( ... ) {
+		xs_unwatch( xsh_, "@introduceDomain", introduceToken_.c_str() );
+		xs_unwatch( xsh_, "@releaseDomain", releaseToken_.c_str() );
+		xs_close( xsh_ );
+		xc_interface_close( xci_ );
+		throw;
+	}
 }
 
 XenDomainWatcher::~XenDomainWatcher()
@@ -64,21 +77,15 @@ XenDomainWatcher::~XenDomainWatcher()
 
 bool XenDomainWatcher::waitForDomainsOrTimeout( std::list<DomainInfo> &domains, int ms )
 {
-	struct pollfd fd;
 	bool ret = false;
-
-	fd.revents = 0;
-	fd.fd = xs_fileno( xsh_ );
-	fd.events = POLLIN | POLLERR;
-
-	int rc = poll( &fd, 1, ms );
+	unsigned int ready = poller_.wait( ms );
 
 	domains.clear();
 
-	if ( rc == 0 )
-		return false; // timeout
+	if ( ready & EventPoller::STOP_SIGNAL )
+		stop();
 
-	if ( fd.revents & POLLIN ) {
+	if ( ready & XENSTORE_READY ) {
 
 		unsigned int num;
 		char **vec = xs_read_watch( xsh_, &num );
@@ -197,5 +204,15 @@ bool XenDomainWatcher::waitForDomainsOrTimeout( std::list<DomainInfo> &domains,
 	return ret;
 }
 
+void XenDomainWatcher::wakeUp()
+{
+	poller_.wakeUp();
+}
+
+bool XenDomainWatcher::watchStopSignals( const sigset_t &signals )
+{
+	return poller_.watchSignals( signals );
+}
+
 } // namespace bdvmi
 
@@ -17,6 +17,8 @@
 #include "bdvmi/exception.h"
 #include "bdvmi/loghelper.h"
 #include "bdvmi/xeninlines.h"
+#include "tracepoints.h"
+#include "scopedlock.h"
 #include <algorithm>
 #include <cstdlib>
 #include <cstring>
@@ -75,14 +77,18 @@ static bool check_page( void *addr )
 #endif
 
 XenDriver::XenDriver( domid_t domain, LogHelper *logHelper, bool hvmOnly )
-    : xsh_( NULL ), domain_( domain ), pageCache_( logHelper ), guestWidth_( 8 ), logHelper_( logHelper )
+    : xsh_( NULL ), domain_( domain ), pageCache_( logHelper ), msrExitsOn_( true ), guestWidth_( 8 ), logHelper_( logHelper ),
+      protectionGeneration_( 0 ), hypercalls_( 0 )
 {
+	pthread_mutex_init( &lock_, NULL );
 	init( domain, hvmOnly );
 }
 
 XenDriver::XenDriver( const std::string &domainName, LogHelper *logHelper, bool hvmOnly )
-    : xsh_( NULL ), pageCache_( logHelper ), guestWidth_( 8 ), logHelper_( logHelper )
+    : xsh_( NULL ), pageCache_( logHelper ), msrExitsOn_( true ), guestWidth_( 8 ), logHelper_( logHelper ),
+      protectionGeneration_( 0 ), hypercalls_( 0 )
 {
+	pthread_mutex_init( &lock_, NULL );
 	domain_ = getDomainId( domainName );
 	init( domain_, hvmOnly );
 }
@@ -90,28 +96,40 @@ XenDriver::XenDriver( const std::string &domainName, LogHelper *logHelper, bool
 XenDriver::~XenDriver()
 {
 	cleanup();
+	pthread_mutex_destroy( &lock_ );
 }
 
-#define hvm_long_mode_enabled( regs ) ( regs.msr_efer & EFER_LMA )
+inline void XenDriver::countHypercall( const char *name ) const
+{
+	__sync_add_and_fetch( &hypercalls_, 1 );
+	BDVMI_TRACE2( hypercall, domain_, name );
+}
 
 int32_t XenDriver::guestX86Mode( const Registers &regs )
 {
-	if ( !( regs.cr0 & X86_CR0_PE ) )
+	return guestX86Mode( regs.cr0, regs.rflags, regs.msr_efer, regs.cs_arbytes );
+}
+
+int32_t XenDriver::guestX86Mode( uint64_t cr0, uint64_t rflags, uint64_t msr_efer, uint32_t cs_arbytes )
+{
+	if ( !( cr0 & X86_CR0_PE ) )
 		return 0;
 
-	if ( regs.rflags & X86_EFLAGS_VM )
+	if ( rflags & X86_EFLAGS_VM )
 		return 1;
 
-	if ( hvm_long_mode_enabled( regs ) && ( regs.cs_arbytes & CS_AR_BYTES_L ) )
+	if ( ( msr_efer & EFER_LMA ) && ( cs_arbytes & CS_AR_BYTES_L ) )
 		return 8;
 
-	return ( ( regs.cs_arbytes & CS_AR_BYTES_D ) ? 4 : 2 );
+	return ( ( cs_arbytes & CS_AR_BYTES_D ) ? 4 : 2 );
 }
 
 bool XenDriver::cpuCount( unsigned int &count ) const throw()
 {
 	xc_dominfo_t info;
 
+	countHypercall( "xc_domain_getinfo" );
+
 	if ( xc_domain_getinfo( xci_, domain_, 1, &info ) != 1 ) {
 
 		if ( logHelper_ )
@@ -131,6 +149,8 @@ bool XenDriver::tscSpeed( unsigned long long &speed ) const throw()
 	uint64_t elapsed_nsec;
 	uint32_t tsc_mode, gtsc_khz, incarnation;
 
+	countHypercall( "xc_domain_get_tsc_info" );
+
 	if ( xc_domain_get_tsc_info( xci_, domain_, &tsc_mode, &elapsed_nsec, &gtsc_khz, &incarnation ) != 0 ) {
 		if ( logHelper_ )
 			logHelper_->error( std::string( "xc_domain_get_tsc_info() failed: " ) + strerror( errno ) );
@@ -155,6 +175,8 @@ bool XenDriver::mtrrType( unsigned long long guestAddress, uint8_t &type ) const
 	static struct hvm_hw_mtrr hwMtrr;
 
 	if ( !hwMtrrInit ) {
+		countHypercall( "xc_domain_hvm_getcontext_partial" );
+
 		if ( xc_domain_hvm_getcontext_partial( xci_, domain_, HVM_SAVE_CODE( MTRR ), 0, &hwMtrr,
 		                                       sizeof( hwMtrr ) ) != 0 ) {
 
@@ -267,6 +289,8 @@ const access_t access_rx2rw = XENMEM_access_rx2rw;
 
 #define set_mem_access xc_set_mem_access
 #define get_mem_access xc_get_mem_access
+#define SET_MEM_ACCESS_NAME "xc_set_mem_access" // for the hypercall tracepoint
+#define GET_MEM_ACCESS_NAME "xc_get_mem_access"
 
 #else
 
@@ -284,7 +308,20 @@ const access_t access_rx2rw = HVMMEM_access_rx2rw;
 
 #define set_mem_access xc_hvm_set_mem_access
 #define get_mem_access xc_hvm_get_mem_access
+#define SET_MEM_ACCESS_NAME "xc_hvm_set_mem_access"
+#define GET_MEM_ACCESS_NAME "xc_hvm_get_mem_access"
 
+#endif
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040800
+int monitorMsr( xc_interface *xci, domid_t domain, unsigned int msr, bool enable )
+{
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040b00
+	return xc_monitor_mov_to_msr( xci, domain, msr, enable, false );
+#else
+	return xc_monitor_mov_to_msr( xci, domain, msr, enable );
+#endif
+}
 #endif
 }
 
@@ -315,6 +352,11 @@ bool XenDriver::setPageProtection( unsigned long long guestAddress, bool read, b
 
 	unsigned long gfn = paddr_to_pfn( guestAddress );
 
+	// Decisions based on the old protection are stale now (see XenEventManager::decisionCache())
+	__sync_add_and_fetch( &protectionGeneration_, 1 );
+
+	countHypercall( SET_MEM_ACCESS_NAME );
+
 	if ( set_mem_access( xci_, domain_, memaccess, gfn, 1 ) ) {
 
 		if ( logHelper_ )
@@ -332,6 +374,8 @@ bool XenDriver::getPageProtection( unsigned long long guestAddress, bool &read,
 	access_t memaccess;
 	unsigned long gfn = paddr_to_pfn( guestAddress );
 
+	countHypercall( GET_MEM_ACCESS_NAME );
+
 	if ( get_mem_access( xci_, domain_, gfn, &memaccess ) ) {
 
 		if ( logHelper_ )
@@ -387,6 +431,8 @@ bool XenDriver::registers( unsigned short vcpu, Registers &regs ) const throw()
 {
 	struct hvm_hw_cpu hwCpu;
 
+	countHypercall( "xc_domain_hvm_getcontext_partial" );
+
 	if ( xc_domain_hvm_getcontext_partial( xci_, domain_, HVM_SAVE_CODE( CPU ), vcpu, &hwCpu, sizeof( hwCpu ) ) !=
 	     0 ) {
 		if ( logHelper_ )
@@ -480,6 +526,8 @@ bool XenDriver::mtrrs( unsigned short vcpu, Mtrrs &m ) const throw()
 {
 	struct hvm_hw_mtrr hwMtrr;
 
+	countHypercall( "xc_domain_hvm_getcontext_partial" );
+
 	if ( xc_domain_hvm_getcontext_partial( xci_, domain_, HVM_SAVE_CODE( MTRR ), vcpu, &hwMtrr,
 	                                       sizeof( hwMtrr ) ) != 0 ) {
 		if ( logHelper_ )
@@ -500,6 +548,8 @@ bool XenDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool s
 {
 	vcpu_guest_context_any_t ctxt;
 
+	countHypercall( "xc_vcpu_getcontext" );
+
 	if ( xc_vcpu_getcontext( xci_, domain_, vcpu, &ctxt ) != 0 ) {
 
 		if ( logHelper_ )
@@ -545,6 +595,8 @@ bool XenDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool s
 			ctxt.x64.user_regs.eip = regs.rip;
 	}
 
+	countHypercall( "xc_vcpu_setcontext" );
+
 	if ( xc_vcpu_setcontext( xci_, domain_, vcpu, &ctxt ) == -1 ) {
 
 		if ( logHelper_ )
@@ -561,6 +613,8 @@ bool XenDriver::writeToPhysAddress( unsigned long long address, void *buffer, si
 	unsigned long gfn = paddr_to_pfn( address );
 	unsigned long mfn = paddr_to_pfn( ( unsigned long )buffer );
 
+	countHypercall( "xc_copy_to_domain_page" );
+
 	// Copy the whole page - can't find another way to do it with libxc.
 	if ( xc_copy_to_domain_page( xci_, domain_, gfn, ( const char * )mfn ) ) {
 
@@ -577,18 +631,32 @@ bool XenDriver::enableMsrExit( unsigned int msr, bool &oldValue ) throw()
 {
 	oldValue = false;
 
+	// Keep msrs_ in step with what the hypervisor's been told
+	ScopedLock lock( lock_ );
+
 	try {
+		oldValue = msrs_.set( msr, true );
 
-		if ( msrs_.find( msr ) != msrs_.end() ) {
-			oldValue = true;
-			return true;
-		}
+	} catch ( ... ) {
+		return false;
+	}
 
-		msrs_.insert( msr );
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040800
+	if ( oldValue || !msrExitsOn_ )
+		return true;
+
+	countHypercall( "xc_monitor_mov_to_msr" );
+
+	// Have the hypervisor trap writes to this MSR only
+	if ( monitorMsr( xci_, domain_, msr, true ) ) {
+		msrs_.set( msr, false );
+
+		if ( logHelper_ )
+			logHelper_->error( std::string( "xc_monitor_mov_to_msr() failed: " ) + strerror( errno ) );
 
-	} catch ( ... ) {
 		return false;
 	}
+#endif
 
 	return true;
 }
@@ -597,23 +665,75 @@ bool XenDriver::disableMsrExit( unsigned int msr, bool &oldValue ) throw()
 {
 	oldValue = false;
 
+	ScopedLock lock( lock_ );
+
 	try {
-		std::set<unsigned int>::iterator it = msrs_.find( msr );
+		oldValue = msrs_.set( msr, false );
 
-		if ( it != msrs_.end() ) {
-			msrs_.erase( it );
-			oldValue = true;
-		}
+	} catch ( ... ) {
+		return false;
+	}
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040800
+	if ( oldValue && msrExitsOn_ ) {
+		countHypercall( "xc_monitor_mov_to_msr" );
+		monitorMsr( xci_, domain_, msr, false );
+	}
+#endif
+
+	return true;
+}
+
+bool XenDriver::msrExits( bool enable ) const throw()
+{
+	ScopedLock lock( lock_ );
+
+	if ( msrExitsOn_ == enable )
+		return true;
+
+	msrExitsOn_ = enable;
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040800
+	std::vector<unsigned int> msrs;
+
+	try {
+		msrs_.list( msrs );
 
 	} catch ( ... ) {
 		return false;
 	}
 
+	bool ok = true;
+
+	for ( size_t i = 0; i < msrs.size(); ++i ) {
+		countHypercall( "xc_monitor_mov_to_msr" );
+
+		if ( monitorMsr( xci_, domain_, msrs[i], enable ) && enable ) {
+			if ( logHelper_ )
+				logHelper_->error( std::string( "xc_monitor_mov_to_msr() failed: " ) +
+				                   strerror( errno ) );
+			ok = false;
+		}
+	}
+
+	return ok;
+#else
+	return true;
+#endif
+}
+
+bool XenDriver::isMsrEnabled( unsigned int msr, bool &enabled ) const throw()
+{
+	ScopedLock lock( lock_ );
+
+	enabled = msrs_.test( msr );
 	return true;
 }
 
 bool XenDriver::shutdown() throw()
 {
+	countHypercall( "xc_domain_shutdown" );
+
 	if ( xc_domain_shutdown( xci_, domain_, SHUTDOWN_poweroff ) ) {
 
 		if ( logHelper_ )
@@ -763,6 +883,7 @@ MapReturnCode XenDriver::mapPhysMemToHost( unsigned long long address, size_t le
 		void *mapped = NULL;
 
 #ifdef DISABLE_PAGE_CACHE
+		countHypercall( "xc_map_foreign_range" );
 		mapped = xc_map_foreign_range( xci_, domain_, XC_PAGE_SIZE, PROT_READ | PROT_WRITE, gfn );
 
 		/*
@@ -829,12 +950,25 @@ MapReturnCode XenDriver::mapVirtMemToHost( unsigned long long address, size_t le
 	pointer = NULL;
 
 	try {
-		std::map<unsigned long long, unsigned long>::const_iterator ait = addressCache_.find( address );
+		bool cached = false;
+
+		{
+			ScopedLock lock( lock_ );
 
-		if ( ait != addressCache_.end() ) {
-			gfn = ait->second;
+			std::map<unsigned long long, unsigned long>::const_iterator ait =
+			        addressCache_.find( address );
+
+			if ( ait != addressCache_.end() ) {
+				gfn = ait->second;
+				cached = true;
+			}
+		}
+
+		if ( cached ) {
+			BDVMI_TRACE5( translate, domain_, vcpu, address, gfn, 1 );
 		}
 		else {
+			countHypercall( "xc_translate_foreign_address" );
 			gfn = xc_translate_foreign_address( xci_, domain_, vcpu, address );
 
 			if ( gfn == 0 ) {
@@ -851,11 +985,14 @@ MapReturnCode XenDriver::mapVirtMemToHost( unsigned long long address, size_t le
 
 				return MAP_FAILED_GENERIC;
 			}
+
+			BDVMI_TRACE5( translate, domain_, vcpu, address, gfn, 0 );
 		}
 
 		void *mapped = NULL;
 
 #ifdef DISABLE_PAGE_CACHE
+		countHypercall( "xc_map_foreign_range" );
 		mapped = xc_map_foreign_range( xci_, domain_, XC_PAGE_SIZE, PROT_READ | PROT_WRITE, gfn );
 
 		if ( mapped && !check_page( mapped ) ) {
@@ -898,6 +1035,8 @@ bool XenDriver::unmapVirtMem( void *hostPtr ) throw()
 
 bool XenDriver::cacheGuestVirtAddr( unsigned long long address ) throw()
 {
+	countHypercall( "xc_translate_foreign_address" );
+
 	unsigned long gfn = xc_translate_foreign_address( xci_, domain_, 0, address );
 
 	if ( gfn == 0 ) {
@@ -909,6 +1048,8 @@ bool XenDriver::cacheGuestVirtAddr( unsigned long long address ) throw()
 	}
 
 	try {
+		ScopedLock lock( lock_ );
+
 		addressCache_[address] = gfn;
 
 	} catch ( ... ) {
@@ -933,6 +1074,8 @@ bool XenDriver::requestPageFault( int vcpu, uint64_t addressSpace, uint64_t virt
 	// address space for "vcpu" here - otherwise things will likely
 	// explode. If something does explode here, check that those
 	// conditions hold HV-side.
+	countHypercall( "xc_hvm_inject_trap" );
+
 	if ( xc_hvm_inject_trap( xci_, domain_, vcpu, TRAP_page_fault, X86_EVENTTYPE_HW_EXCEPTION, error_code, 0,
 	                         virtualAddress /*, addressSpace */ ) != 0 ) {
 		if ( logHelper_ )
@@ -947,6 +1090,8 @@ bool XenDriver::requestPageFault( int vcpu, uint64_t addressSpace, uint64_t virt
 bool XenDriver::disableRepOptimizations() throw()
 {
 #if __XEN_LATEST_INTERFACE_VERSION__ == 0x00040400
+	countHypercall( "xc_domain_set_emulated_reps" );
+
 	if ( xc_domain_set_emulated_reps( xci_, domain_, 0 ) != 0 ) {
 		if ( logHelper_ )
 			logHelper_->error( std::string( "xc_domain_set_emulated_reps() failed: " ) + strerror( errno ) );
@@ -956,6 +1101,8 @@ bool XenDriver::disableRepOptimizations() throw()
 
 	return true;
 #elif __XEN_LATEST_INTERFACE_VERSION__ == 0x00040700
+	countHypercall( "xc_monitor_emulate_each_rep" );
+
 	if ( xc_monitor_emulate_each_rep( xci_, domain_, 1 ) != 0 ) {
 		if ( logHelper_ )
 			logHelper_->error( std::string( "xc_domain_emulate_each_rep() failed: " ) + strerror( errno ) );
@@ -971,6 +1118,8 @@ bool XenDriver::disableRepOptimizations() throw()
 
 bool XenDriver::pause() throw()
 {
+	countHypercall( "xc_domain_pause" );
+
 	if ( xc_domain_pause( xci_, domain_ ) != 0 ) {
 
 		if ( logHelper_ )
@@ -984,6 +1133,8 @@ bool XenDriver::pause() throw()
 
 bool XenDriver::unpause() throw()
 {
+	countHypercall( "xc_domain_unpause" );
+
 	if ( xc_domain_unpause( xci_, domain_ ) != 0 ) {
 
 		if ( logHelper_ )
@@ -1000,6 +1151,16 @@ bool XenDriver::setPageCacheLimit( size_t limit ) throw()
 	return pageCache_.setLimit( limit );
 }
 
+bool XenDriver::statistics( DriverStatistics &stats ) const throw()
+{
+	pageCache_.statistics( stats );
+
+	// Every page cache miss maps a page
+	stats.hypercalls = hypercalls_ + stats.cacheMisses;
+
+	return true;
+}
+
 unsigned int XenDriver::cpuid_eax( unsigned int op ) const
 {
 	unsigned int eax = 0;
@@ -16,11 +16,17 @@
 #include "bdvmi/exception.h"
 #include "bdvmi/xendriver.h"
 #include "bdvmi/xeneventmanager.h"
+#include "bdvmi/xenvcpudispatcher.h"
 #include "bdvmi/eventhandler.h"
 #include "bdvmi/loghelper.h"
+#include "tracepoints.h"
+#include "xenpendingevent.h"
+#include "clock.h"
 #include <sys/mman.h>
-#include <poll.h>
+#include <sys/timerfd.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
 #include <cstring>
 #include <cstdlib>
 #include <sstream>
@@ -79,19 +85,66 @@ extern "C" {
 #define MEM_EVENT_FLAG_DENY MEM_EVENT_FLAG_SKIP_MSR_WRITE
 #endif
 
+/*
+   From Xen 4.6 on requests and responses are the same structure, sharing the same ring
+   slots, so requests can be handled without copying them out of the ring and responses
+   can be built in place. Define DISABLE_ZERO_COPY_RING to go back to copying them.
+*/
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600 && !defined( DISABLE_ZERO_COPY_RING )
+#define ZERO_COPY_RING
+#endif
+
+// EventPoller ids
+enum {
+	XENSTORE_READY = 1,
+	EVTCHN_READY = ( 1 << 1 ),
+	COMPLETIONS_READY = ( 1 << 2 ),
+	LOCAL_RING_READY = ( 1 << 3 ),
+	DEADLINE_READY = ( 1 << 4 ),
+	NOTIFY_READY = ( 1 << 5 )
+};
+
 #define LOG_ERROR( x )                                                                                                 \
 	{                                                                                                              \
 		if ( logHelper_ )                                                                                      \
 			logHelper_->error( x );                                                                        \
 	}
 
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+namespace {
+
+// From Xen 4.10 on, writes that only change bits in ignoredBits don't even leave the guest (Xen's
+// write_ctrlreg_mask lists the bits to ignore, not the ones to watch)
+int monitorCR( xc_interface *xci, domid_t domain, uint16_t index, bool enable, bool sync, uint64_t ignoredBits )
+{
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040a00
+	return xc_monitor_write_ctrlreg( xci, domain, index, enable, sync, ignoredBits, 1 );
+#else
+	( void )ignoredBits;
+	return xc_monitor_write_ctrlreg( xci, domain, index, enable, sync, 1 );
+#endif
+}
+
+} // end of anonymous namespace
+#endif
+
 namespace bdvmi {
 
 XenEventManager::XenEventManager( const XenDriver &driver, unsigned short hndlFlags, LogHelper *logHelper )
     : driver_( driver ), xci_( driver.nativeHandle() ), domain_( driver.id() ), stop_( false ), xce_( NULL ),
       port_( -1 ), xsh_( NULL ), evtchnPort_( 0 ), ringPage_( NULL ), memAccessOn_( false ), evtchnOn_( false ),
       evtchnBindOn_( false ), handlerFlags_( 0 ), guestStillRunning_( true ), logHelper_( logHelper ),
-      firstReleaseWatch_( true )
+      firstReleaseWatch_( true ), dispatcher_( NULL ), eventsInFlight_( 0 ), maxSpinNs_( 0 ), avgGapNs_( 0 ),
+      lastBatchNs_( 0 ), asyncFlags_( 0 ), pausedResponses_( false ), pendingNotify_( false ), resumedUpTo_( 0 ),
+      decisions_( NULL ), decisionsGeneration_( 0 ), invalidations_( 0 ),
+      trace_( NULL ), traceTsc_( 0 ), arrivalNs_( 0 ), localRing_( false ), localRingFd_( -1 ),
+      statsSlot_( NULL ), driverSlot_( NULL ), publishedNs_( 0 ), deadlineNs_( 0 ), deadlineAction_( NONE ),
+      deadlineFd_( -1 ), deadlineArmed_( false ), expiredInFlight_( 0 ), serial_( 0 ), notifyFd_( -1 ),
+      deferredNs_( 0 ), cpuBudget_( 0 ),
+      rateBudget_( 0 ), maxGovernorLevel_( GOVERNOR_SAMPLED ), governorLevel_( GOVERNOR_FULL ),
+      governorWindowNs_( 0 ), governorEvents_( 0 ), governorBusyNs_( 0 ), calmSinceNs_( 0 ), appAsyncFlags_( 0 ),
+      governorAsyncFlags_( 0 ),
+      sampled_( 0 )
 {
 	initXenStore();
 
@@ -103,14 +156,54 @@ XenEventManager::XenEventManager( const XenDriver &driver, unsigned short hndlFl
 		throw Exception( "[Xen events] could not set up events" );
 	}
 
+#endif // DISABLE_MEM_EVENT
+
+	try {
+		poller_.add( xs_fileno( xsh_ ), XENSTORE_READY );
+#ifndef DISABLE_MEM_EVENT
+		poller_.add( xc_evtchn_fd( xce_ ), EVTCHN_READY );
+		poller_.add( completions_.fd(), COMPLETIONS_READY );
+#endif // DISABLE_MEM_EVENT
+
+	} catch ( ... ) {
+		cleanup();
+		throw;
+	}
+}
+
+XenEventManager::XenEventManager( const Driver &driver, unsigned short hndlFlags, LogHelper *logHelper,
+                                  mem_event_sring_t *sring )
+    : driver_( driver ), xci_( NULL ), domain_( driver.id() ), stop_( false ), xce_( NULL ), port_( -1 ),
+      xsh_( NULL ), evtchnPort_( 0 ), ringPage_( NULL ), memAccessOn_( false ), evtchnOn_( false ),
+      evtchnBindOn_( false ), handlerFlags_( hndlFlags ), guestStillRunning_( true ), logHelper_( logHelper ),
+      firstReleaseWatch_( true ), dispatcher_( NULL ), eventsInFlight_( 0 ), maxSpinNs_( 0 ), avgGapNs_( 0 ),
+      lastBatchNs_( 0 ), asyncFlags_( 0 ), pausedResponses_( false ), pendingNotify_( false ), resumedUpTo_( 0 ),
+      decisions_( NULL ), decisionsGeneration_( 0 ), invalidations_( 0 ),
+      trace_( NULL ), traceTsc_( 0 ), arrivalNs_( 0 ), localRing_( true ), localRingFd_( -1 ),
+      statsSlot_( NULL ), driverSlot_( NULL ), publishedNs_( 0 ), deadlineNs_( 0 ), deadlineAction_( NONE ),
+      deadlineFd_( -1 ), deadlineArmed_( false ), expiredInFlight_( 0 ), serial_( 0 ), notifyFd_( -1 ),
+      deferredNs_( 0 ), cpuBudget_( 0 ),
+      rateBudget_( 0 ), maxGovernorLevel_( GOVERNOR_SAMPLED ), governorLevel_( GOVERNOR_FULL ),
+      governorWindowNs_( 0 ), governorEvents_( 0 ), governorBusyNs_( 0 ), calmSinceNs_( 0 ), appAsyncFlags_( 0 ),
+      governorAsyncFlags_( 0 ),
+      sampled_( 0 )
+{
+#ifndef DISABLE_MEM_EVENT
+	BACK_RING_INIT( &backRing_, sring, XC_PAGE_SIZE );
+
+	poller_.add( completions_.fd(), COMPLETIONS_READY );
+#else
+	( void )sring;
 #endif // DISABLE_MEM_EVENT
 }
 
 XenEventManager::~XenEventManager()
 {
 #if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-	xc_monitor_guest_request( xci_, domain_, 0, 1 );
-	xc_monitor_write_ctrlreg( xci_, domain_, VM_EVENT_X86_XCR0, 0, 1, 1 );
+	if ( !localRing_ ) {
+		xc_monitor_guest_request( xci_, domain_, 0, 1 );
+		monitorCR( xci_, domain_, VM_EVENT_X86_XCR0, false, true, 0 );
+	}
 #endif
 
 	if ( !stop_ ) {
@@ -125,6 +218,33 @@ XenEventManager::~XenEventManager()
 		}
 	}
 
+	delete dispatcher_;
+	delete decisions_;
+	delete trace_;
+
+	// Late decisions for events answered with the deadline fallback action (see expireEvents())
+	XenPendingEvent *late = completions_.popAll();
+
+	while ( late ) {
+		XenPendingEvent *next = late->next;
+		delete late;
+		late = next;
+	}
+
+	std::vector<XenPendingEvent *>::const_iterator i = freeEvents_.begin();
+
+	for ( ; i != freeEvents_.end(); ++i )
+		delete *i;
+
+	StatsPage::release( statsSlot_ );
+	StatsPage::release( driverSlot_ );
+
+	if ( deadlineFd_ >= 0 )
+		close( deadlineFd_ );
+
+	if ( notifyFd_ >= 0 )
+		close( notifyFd_ );
+
 	cleanup();
 }
 
@@ -159,34 +279,41 @@ void XenEventManager::cleanup()
 
 bool XenEventManager::handlerFlags( unsigned short flags )
 {
+	if ( localRing_ ) {
+		handlerFlags_ = flags;
+		return true;
+	}
+
 	if ( flags & ENABLE_CR ) {
 
 		if ( ( handlerFlags_ & ENABLE_CR ) == 0 ) {
 #if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-			if ( xc_monitor_write_ctrlreg( xci_, domain_, VM_EVENT_X86_CR0, 1, 1, 1) ) {
+			if ( monitorCR( xci_, domain_, VM_EVENT_X86_CR0, true, syncEvents( ENABLE_CR ),
+			                ~eventFilter().crMask( 0 ) ) ) {
 #else
 			if ( xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_CR0,
-			                       HVMPME_onchangeonly | HVMPME_mode_sync ) ) {
+			                       HVMPME_onchangeonly | hvmpmeMode( ENABLE_CR ) ) ) {
 #endif
 				LOG_ERROR( "[Xen events] could not set up CR0 event handler" );
 				return false;
 			}
 
 #if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-			if ( xc_monitor_write_ctrlreg( xci_, domain_, VM_EVENT_X86_CR3, 1, 1, 1) ) {
+			if ( monitorCR( xci_, domain_, VM_EVENT_X86_CR3, true, syncEvents( ENABLE_CR ), 0 ) ) {
 #else
 			if ( xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_CR3,
-			                       HVMPME_onchangeonly | HVMPME_mode_sync ) ) {
+			                       HVMPME_onchangeonly | hvmpmeMode( ENABLE_CR ) ) ) {
 #endif
 				LOG_ERROR( "[Xen events] could not set up CR3 event handler" );
 				return false;
 			}
 
 #if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-			if ( xc_monitor_write_ctrlreg( xci_, domain_, VM_EVENT_X86_CR4, 1, 1, 1) ) {
+			if ( monitorCR( xci_, domain_, VM_EVENT_X86_CR4, true, syncEvents( ENABLE_CR ),
+			                ~eventFilter().crMask( 4 ) ) ) {
 #else
 			if ( xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_CR4,
-			                       HVMPME_onchangeonly | HVMPME_mode_sync ) ) {
+			                       HVMPME_onchangeonly | hvmpmeMode( ENABLE_CR ) ) ) {
 #endif
 				LOG_ERROR( "[Xen events] could not set up CR4 event handler" );
 				return false;
@@ -196,9 +323,9 @@ bool XenEventManager::handlerFlags( unsigned short flags )
 	else {
 		if ( handlerFlags_ & ENABLE_CR ) {
 #if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-			xc_monitor_write_ctrlreg( xci_, domain_, VM_EVENT_X86_CR0, 0, 1, 1);
-			xc_monitor_write_ctrlreg( xci_, domain_, VM_EVENT_X86_CR3, 0, 1, 1);
-			xc_monitor_write_ctrlreg( xci_, domain_, VM_EVENT_X86_CR4, 0, 1, 1);
+			monitorCR( xci_, domain_, VM_EVENT_X86_CR0, false, true, 0 );
+			monitorCR( xci_, domain_, VM_EVENT_X86_CR3, false, true, 0 );
+			monitorCR( xci_, domain_, VM_EVENT_X86_CR4, false, true, 0 );
 #else
 			xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_CR0, HVMPME_mode_disabled );
 			xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_CR3, HVMPME_mode_disabled );
@@ -207,6 +334,16 @@ bool XenEventManager::handlerFlags( unsigned short flags )
 		}
 	}
 
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040800
+	/*
+	   MSR exits are set up per MSR by the driver (XenDriver::enableMsrExit()), the same
+	   way memory events are. ENABLE_MSR switches all of them on or off at once.
+	*/
+	if ( !static_cast<const XenDriver &>( driver_ ).msrExits( ( flags & ENABLE_MSR ) != 0 ) ) {
+		LOG_ERROR( "[Xen events] could not set up MSR event handler" );
+		return false;
+	}
+#else
 	if ( flags & ENABLE_MSR ) {
 
 		if ( ( handlerFlags_ & ENABLE_MSR ) == 0 ) {
@@ -214,7 +351,7 @@ bool XenEventManager::handlerFlags( unsigned short flags )
 #if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
 			if ( xc_monitor_mov_to_msr( xci_, domain_, 1, 1 ) ) {
 #else
-			if ( xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_MSR, HVMPME_mode_sync ) ) {
+			if ( xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_MSR, hvmpmeMode( ENABLE_MSR ) ) ) {
 #endif
 				LOG_ERROR( "[Xen events] could not set up MSR event handler" );
 				return false;
@@ -229,12 +366,13 @@ bool XenEventManager::handlerFlags( unsigned short flags )
 			xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_MSR, HVMPME_mode_disabled );
 #endif
 	}
+#endif // 0x00040800
 
 #if __XEN_LATEST_INTERFACE_VERSION__ == 0x00040500
 	/* Always on in Xen 4.4. */
 	if ( flags & ENABLE_VMCALL ) {
 		if ( ( handlerFlags_ & ENABLE_VMCALL ) == 0 &&
-		     xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_VMCALL, HVMPME_mode_sync ) ) {
+		     xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_VMCALL, hvmpmeMode( ENABLE_VMCALL ) ) ) {
 			LOG_ERROR( "[Xen events] could not set up VMCALL event handler" );
 			return false;
 		}
@@ -258,6 +396,20 @@ bool XenEventManager::handlerFlags( unsigned short flags )
 	return true;
 }
 
+inline Registers::GuestX86Mode toGuestX86Mode( int32_t x86Mode )
+{
+	switch ( x86Mode ) {
+		case 2:
+			return Registers::CS_TYPE_16;
+		case 4:
+			return Registers::CS_TYPE_32;
+		case 8:
+			return Registers::CS_TYPE_64;
+		default:
+			return Registers::ERROR;
+	}
+}
+
 inline void copyRegisters( Registers &regs, const mem_event_request_t &req )
 {
 	regs.sysenter_cs = REGS( req ).sysenter_cs;
@@ -298,270 +450,1611 @@ inline void copyRegisters( Registers &regs, const mem_event_request_t &req )
 	regs.cr3 = REGS( req ).cr3;
 	regs.cr4 = REGS( req ).cr4;
 
-	regs.cs_arbytes = REGS( req ).cs_arbytes;
+	regs.cs_arbytes = REGS( req ).cs_arbytes;
+
+	regs.guest_x86_mode = toGuestX86Mode( XenDriver::guestX86Mode( regs ) );
+}
+
+inline void initRequest( mem_event_request_t &req, unsigned short vcpu, const Registers &regs )
+{
+	memset( &req, 0, sizeof( req ) );
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+	req.version = VM_EVENT_INTERFACE_VERSION;
+#endif
+	req.vcpu_id = vcpu;
+	req.flags = MEM_EVENT_FLAG_VCPU_PAUSED;
+
+	REGS( req ).sysenter_cs = regs.sysenter_cs;
+	REGS( req ).sysenter_esp = regs.sysenter_esp;
+	REGS( req ).sysenter_eip = regs.sysenter_eip;
+	REGS( req ).msr_efer = regs.msr_efer;
+	REGS( req ).msr_star = regs.msr_star;
+	REGS( req ).msr_lstar = regs.msr_lstar;
+	REGS( req ).fs_base = regs.fs_base;
+	REGS( req ).gs_base = regs.gs_base;
+	REGS( req ).rflags = regs.rflags;
+	REGS( req ).rax = regs.rax;
+	REGS( req ).rcx = regs.rcx;
+	REGS( req ).rdx = regs.rdx;
+	REGS( req ).rbx = regs.rbx;
+	REGS( req ).rsp = regs.rsp;
+	REGS( req ).rbp = regs.rbp;
+	REGS( req ).rsi = regs.rsi;
+	REGS( req ).rdi = regs.rdi;
+	REGS( req ).r8 = regs.r8;
+	REGS( req ).r9 = regs.r9;
+	REGS( req ).r10 = regs.r10;
+	REGS( req ).r11 = regs.r11;
+	REGS( req ).r12 = regs.r12;
+	REGS( req ).r13 = regs.r13;
+	REGS( req ).r14 = regs.r14;
+	REGS( req ).r15 = regs.r15;
+	REGS( req ).rip = regs.rip;
+	REGS( req ).dr7 = regs.dr7;
+	REGS( req ).cr0 = regs.cr0;
+	REGS( req ).cr2 = regs.cr2;
+	REGS( req ).cr3 = regs.cr3;
+	REGS( req ).cr4 = regs.cr4;
+
+	REGS( req ).cs_arbytes = regs.cs_arbytes;
+}
+
+namespace {
+
+/*
+ * RegistersView straight over the request in the ring: single registers are read
+ * on demand, and the Registers structure is only filled in if the handler asks for it.
+ */
+class XenRegistersView : public RegistersView {
+
+public:
+	XenRegistersView( const mem_event_request_t &req, Registers &storage )
+	    : req_( req ), regs_( storage ), materialized_( false )
+	{
+	}
+
+public:
+	virtual uint64_t sysenter_cs() const
+	{
+		return REGS( req_ ).sysenter_cs;
+	}
+
+	virtual uint64_t sysenter_esp() const
+	{
+		return REGS( req_ ).sysenter_esp;
+	}
+
+	virtual uint64_t sysenter_eip() const
+	{
+		return REGS( req_ ).sysenter_eip;
+	}
+
+	virtual uint64_t msr_efer() const
+	{
+		return REGS( req_ ).msr_efer;
+	}
+
+	virtual uint64_t msr_star() const
+	{
+		return REGS( req_ ).msr_star;
+	}
+
+	virtual uint64_t msr_lstar() const
+	{
+		return REGS( req_ ).msr_lstar;
+	}
+
+	virtual uint64_t fs_base() const
+	{
+		return REGS( req_ ).fs_base;
+	}
+
+	virtual uint64_t gs_base() const
+	{
+		return REGS( req_ ).gs_base;
+	}
+
+	virtual uint64_t rax() const
+	{
+		return REGS( req_ ).rax;
+	}
+
+	virtual uint64_t rcx() const
+	{
+		return REGS( req_ ).rcx;
+	}
+
+	virtual uint64_t rdx() const
+	{
+		return REGS( req_ ).rdx;
+	}
+
+	virtual uint64_t rbx() const
+	{
+		return REGS( req_ ).rbx;
+	}
+
+	virtual uint64_t rsp() const
+	{
+		return REGS( req_ ).rsp;
+	}
+
+	virtual uint64_t rbp() const
+	{
+		return REGS( req_ ).rbp;
+	}
+
+	virtual uint64_t rsi() const
+	{
+		return REGS( req_ ).rsi;
+	}
+
+	virtual uint64_t rdi() const
+	{
+		return REGS( req_ ).rdi;
+	}
+
+	virtual uint64_t r8() const
+	{
+		return REGS( req_ ).r8;
+	}
+
+	virtual uint64_t r9() const
+	{
+		return REGS( req_ ).r9;
+	}
+
+	virtual uint64_t r10() const
+	{
+		return REGS( req_ ).r10;
+	}
+
+	virtual uint64_t r11() const
+	{
+		return REGS( req_ ).r11;
+	}
+
+	virtual uint64_t r12() const
+	{
+		return REGS( req_ ).r12;
+	}
+
+	virtual uint64_t r13() const
+	{
+		return REGS( req_ ).r13;
+	}
+
+	virtual uint64_t r14() const
+	{
+		return REGS( req_ ).r14;
+	}
+
+	virtual uint64_t r15() const
+	{
+		return REGS( req_ ).r15;
+	}
+
+	virtual uint64_t rflags() const
+	{
+		return REGS( req_ ).rflags;
+	}
+
+	virtual uint64_t rip() const
+	{
+		return REGS( req_ ).rip;
+	}
+
+	virtual uint64_t dr7() const
+	{
+		return REGS( req_ ).dr7;
+	}
+
+	virtual uint64_t cr0() const
+	{
+		return REGS( req_ ).cr0;
+	}
+
+	virtual uint64_t cr2() const
+	{
+		return REGS( req_ ).cr2;
+	}
+
+	virtual uint64_t cr3() const
+	{
+		return REGS( req_ ).cr3;
+	}
+
+	virtual uint64_t cr4() const
+	{
+		return REGS( req_ ).cr4;
+	}
+
+	virtual uint32_t cs_arbytes() const
+	{
+		return REGS( req_ ).cs_arbytes;
+	}
+
+	virtual Registers::GuestX86Mode guestX86Mode() const
+	{
+		return toGuestX86Mode( XenDriver::guestX86Mode( REGS( req_ ).cr0, REGS( req_ ).rflags,
+		                                                REGS( req_ ).msr_efer, REGS( req_ ).cs_arbytes ) );
+	}
+
+	virtual const Registers &registers() const
+	{
+		if ( !materialized_ ) {
+			copyRegisters( regs_, req_ );
+			materialized_ = true;
+		}
+
+		return regs_;
+	}
+
+private:
+	const mem_event_request_t &req_;
+	Registers &regs_;
+	mutable bool materialized_;
+};
+
+unsigned short crNumber( const mem_event_request_t &req )
+{
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+	switch ( req.u.write_ctrlreg.index ) {
+		case VM_EVENT_X86_CR0:
+			return 0;
+		case VM_EVENT_X86_CR4:
+			return 4;
+		case VM_EVENT_X86_CR3:
+		default:
+			return 3;
+	}
+#else
+	switch ( req.reason ) {
+		case MEM_EVENT_REASON_CR0:
+			return 0;
+		case MEM_EVENT_REASON_CR4:
+			return 4;
+		case MEM_EVENT_REASON_CR3:
+		default:
+			return 3;
+	}
+#endif
+}
+
+EventStatistics::EventType eventType( const mem_event_request_t &req )
+{
+	switch ( req.reason ) {
+		case MEM_EVENT_REASON_VIOLATION:
+			return EventStatistics::PAGE_FAULT;
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+		case VM_EVENT_REASON_WRITE_CTRLREG:
+			if ( req.u.write_ctrlreg.index == VM_EVENT_X86_XCR0 )
+				return EventStatistics::XSETBV;
+
+			return EventStatistics::CR;
+#else
+		case MEM_EVENT_REASON_CR0:
+		case MEM_EVENT_REASON_CR3:
+		case MEM_EVENT_REASON_CR4:
+			return EventStatistics::CR;
+
+		case MEM_EVENT_REASON_XSETBV:
+			return EventStatistics::XSETBV;
+#endif
+		case MEM_EVENT_REASON_MSR:
+			return EventStatistics::MSR;
+
+		case MEM_EVENT_REASON_VMCALL:
+			return EventStatistics::VMCALL;
+
+		default:
+			return EventStatistics::OTHER;
+	}
+}
+
+// The event whose handler callback is running on this thread, for deferResponse()
+struct DeferralContext {
+	const XenEventManager *manager;
+	const mem_event_request_t *req;
+	XenPendingEvent *ev; // NULL while the request is still in the ring
+	bool deferred;
+	bool cacheable; // see cacheDecision()
+};
+
+__thread DeferralContext *currentDeferral = NULL;
+
+unsigned int pageFaultAccess( const mem_event_request_t &req )
+{
+	return ( ACCESS_R( req ) ? PageFaultRules::ACCESS_R : 0 ) | ( ACCESS_W( req ) ? PageFaultRules::ACCESS_W : 0 ) |
+	       ( ACCESS_X( req ) ? PageFaultRules::ACCESS_X : 0 );
+}
+
+class DeferralScope {
+
+public:
+	DeferralScope( DeferralContext &context ) : saved_( currentDeferral )
+	{
+		currentDeferral = &context;
+	}
+
+	~DeferralScope()
+	{
+		currentDeferral = saved_;
+	}
+
+private:
+	DeferralContext *saved_;
+};
+
+// Arm the timerfd to go off at when (CLOCK_MONOTONIC nanoseconds)
+bool armTimer( int fd, uint64_t when )
+{
+	struct itimerspec its;
+
+	memset( &its, 0, sizeof( its ) );
+	its.it_value.tv_sec = when / 1000000000ULL;
+	its.it_value.tv_nsec = when % 1000000000ULL;
+
+	return timerfd_settime( fd, TFD_TIMER_ABSTIME, &its, NULL ) == 0;
+}
+
+// How long Xen may wait for the ring slots of put off responses to async events (see resumePages())
+const uint64_t NOTIFY_DELAY_NS = 1000000ULL;
+
+// The events asyncEvents() can switch to asynchronous mode
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+// There's no synchronous / asynchronous switch for MSR events
+const unsigned short ASYNC_CAPABLE =
+        EventManager::ENABLE_CR | EventManager::ENABLE_VMCALL | EventManager::ENABLE_XSETBV;
+#elif __XEN_LATEST_INTERFACE_VERSION__ == 0x00040500
+const unsigned short ASYNC_CAPABLE = EventManager::ENABLE_CR | EventManager::ENABLE_MSR | EventManager::ENABLE_VMCALL;
+#else
+const unsigned short ASYNC_CAPABLE = EventManager::ENABLE_CR | EventManager::ENABLE_MSR;
+#endif
+
+// Overhead governor: the load measurement window, how long the load has to stay under half the
+// budget before monitoring goes back up a level, and GOVERNOR_SAMPLED's rate
+const uint64_t GOVERNOR_WINDOW_NS = 250000000ULL;
+const uint64_t GOVERNOR_RESTORE_NS = 1000000000ULL;
+const unsigned int GOVERNOR_SAMPLING = 8;
+
+// What GOVERNOR_ASYNC makes asynchronous. Never VMCALLs: the handler sets their return registers
+// before the guest goes on.
+const unsigned short GOVERNOR_ASYNC_FLAGS = ( EventManager::ENABLE_CR | EventManager::ENABLE_MSR ) & ASYNC_CAPABLE;
+
+const char *governorLevelName( EventManager::GovernorLevel level )
+{
+	switch ( level ) {
+		case EventManager::GOVERNOR_FULL:
+			return "full monitoring";
+		case EventManager::GOVERNOR_NO_CR3:
+			return "no CR3 events";
+		case EventManager::GOVERNOR_ASYNC:
+			return "asynchronous events";
+		default:
+			return "sampled events";
+	}
+}
+
+inline void cpuRelax()
+{
+#if defined( __i386__ ) || defined( __x86_64__ )
+	__asm__ __volatile__( "pause" : : : "memory" );
+#else
+	__sync_synchronize();
+#endif
+}
+
+} // end of anonymous namespace
+
+void XenEventManager::waitForEvents()
+{
+	// A stop variable set by a signal handler can only be noticed by polling it
+	int timeout = ( sigStop_ && !poller_.watchingSignals() ) ? 100 : -1;
+
+	while ( runOnce( timeout, 0 ) )
+		;
+}
+
+bool XenEventManager::runOnce( int ms, unsigned int budget )
+{
+	bool spun = false;
+
+#ifndef DISABLE_MEM_EVENT
+	if ( ms && maxSpinNs_ && !stop_ )
+		spun = spinForRequests();
+#endif // DISABLE_MEM_EVENT
+
+	if ( !spun )
+		waitForEventOrTimeout( ms );
+
+	if ( sigStop_ && *sigStop_ && !stop_ )
+		stop();
+
+	bool shuttingDown = stop_;
+
+#ifndef DISABLE_MEM_EVENT
+	unsigned int events = drainRing( budget );
+
+	if ( events )
+		noteBatch( events, spun );
+
+	if ( !watched_.empty() )
+		expireEvents();
+
+	if ( cpuBudget_ || rateBudget_ )
+		runGovernor();
+
+	// The ring went quiet with put off responses still on it, give Xen their slots back
+	if ( deferredNs_ && nowNs() - deferredNs_ >= NOTIFY_DELAY_NS )
+		resumePages( true );
+#else
+	( void )budget;
+#endif // DISABLE_MEM_EVENT
+
+	if ( StatsPage::enabled() )
+		publishStatistics();
+
+	// Don't leave VCPUs paused waiting for events still being handled, nor handlers holding tokens
+	// (even for events expireEvents() has answered) that completeResponse() would find freed
+	return !shuttingDown || eventsInFlight_ || expiredInFlight_;
+}
+
+bool XenEventManager::processPending( unsigned int maxEvents )
+{
+	return runOnce( 0, maxEvents );
+}
+
+bool XenEventManager::hasPendingEvents()
+{
+#ifndef DISABLE_MEM_EVENT
+	return RING_HAS_UNCONSUMED_REQUESTS( &backRing_ ) != 0;
+#else
+	return false;
+#endif // DISABLE_MEM_EVENT
+}
+
+#ifndef DISABLE_MEM_EVENT
+
+unsigned int XenEventManager::drainRing( unsigned int budget )
+{
+#ifndef ZERO_COPY_RING
+	mem_event_request_t req;
+	mem_event_response_t rsp;
+#else
+	mem_event_request_t traced; // the response overwrites the request in the ring
+#endif
+	unsigned int total = 0;
+	unsigned int consumed = 0;
+	int moreRequests = 0;
+
+	do {
+		unsigned int batch = 0;
+		unsigned int available = RING_HAS_UNCONSUMED_REQUESTS( &backRing_ );
+		EventHandler *h = available ? handler() : NULL;
+
+		if ( budget && available > budget - consumed )
+			available = budget - consumed;
+
+		if ( available )
+			stats_.ringOccupancy.add( available );
+
+		// Requests arriving meanwhile get handled as part of this batch too
+		if ( h )
+			h->runPreBatch( available );
+
+		while ( RING_HAS_UNCONSUMED_REQUESTS( &backRing_ ) && ( !budget || consumed < budget ) ) {
+
+			++consumed;
+
+			if ( trace_ )
+				traceTsc_ = EventTrace::tsc();
+
+			arrivalNs_ = nowNs();
+
+			// Events the filter turns down get answered right away, without involving the handler
+			const mem_event_request_t &next = *RING_GET_REQUEST( &backRing_, backRing_.req_cons );
+			HVAction action;
+			unsigned short instructionSize;
+			bool wanted = wantsEvent( next, action, instructionSize );
+
+			++stats_.requests[eventType( next )];
+
+			if ( wanted && governorLevel_ != GOVERNOR_FULL && shedEvent( next ) ) {
+				wanted = false;
+				action = NONE;
+				instructionSize = 0;
+				++stats_.shed;
+			}
+			else if ( !wanted )
+				++stats_.filtered;
+
+			if ( dispatcher_ && wanted ) {
+				XenPendingEvent *ev = allocEvent();
+
+				getRequest( &ev->req );
+				ev->handler = handler();
+				ev->handlerFlags = handlerFlags_;
+				ev->preEventHook = preEventHook();
+				ev->generation = decisions_ ? decisionsGeneration() : 0;
+				ev->tsc = traceTsc_;
+				ev->arrivalNs = arrivalNs_;
+				++eventsInFlight_;
+
+				watchDeadline( ev );
+				dispatcher_->dispatch( ev ); // the response comes back via completions_
+				continue;
+			}
+
+#ifdef ZERO_COPY_RING
+			mem_event_response_t &slot = *getRequestInPlace();
+
+			if ( trace_ )
+				traced = slot;
+
+			if ( !wanted )
+				applyAction( slot, slot, action, NULL, 0, instructionSize );
+			else if ( !handleRequest( slot, slot, eventRegs_, NULL, stats_ ) )
+				continue; // deferred, completeResponse() will hand it back
+
+			if ( trace_ )
+				traceEvent( traced, slot, traceTsc_, wanted ? 0 : EventTraceRecord::FILTERED );
+
+			putResponseInPlace();
+			arrivals_.push_back( arrivalNs_ );
+#else
+			getRequest( &req );
+			initResponse( req, rsp );
+
+			if ( !wanted )
+				applyAction( req, rsp, action, NULL, 0, instructionSize );
+			else if ( !handleRequest( req, rsp, eventRegs_, NULL, stats_ ) )
+				continue; // deferred, completeResponse() will hand it back
+
+			if ( trace_ )
+				traceEvent( req, rsp, traceTsc_, wanted ? 0 : EventTraceRecord::FILTERED );
+
+			putResponse( &rsp );
+			arrivals_.push_back( arrivalNs_ );
+#endif
+			++batch;
+		}
+
+		batch += reapCompletions();
+
+		// Publish the whole batch at once, with (at most) a single notification
+		if ( batch )
+			resumePages(); // will throw on error!
+
+		if ( h )
+			h->runPostBatch();
+
+		if ( trace_ )
+			trace_->tick();
+
+		total += batch;
+
+		// Out of budget, the caller will come back for the rest (see hasPendingEvents())
+		if ( budget && consumed >= budget )
+			break;
+
+		// Ask for a notification on the next request, then make sure none slipped in meanwhile
+		RING_FINAL_CHECK_FOR_REQUESTS( &backRing_, moreRequests );
+
+	} while ( moreRequests );
+
+	// Don't leave put off notifications behind
+	if ( stop_ && backRing_.rsp_prod_pvt != resumedUpTo_ )
+		resumePages();
+
+	return total;
+}
+
+bool XenEventManager::wantsEvent( const mem_event_request_t &req, HVAction &action, unsigned short &instructionSize )
+{
+	action = NONE;
+	instructionSize = 0;
+
+	switch ( req.reason ) {
+
+		case MEM_EVENT_REASON_VIOLATION: {
+			unsigned int access = pageFaultAccess( req );
+#if __XEN_LATEST_INTERFACE_VERSION__ == 0x00040500
+			if ( req.fault_in_gpt )
+				return true;
+#elif __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+			if ( req.u.mem_access.flags & MEM_ACCESS_FAULT_IN_GPT )
+				return true;
+#endif
+			uint64_t rip = REGS( req ).rip;
+
+			if ( eventFilter().matchPageFault( GFN( req ), access, rip, REGS( req ).cr3, action ) )
+				return false;
+
+			if ( decisions_ ) {
+				checkDecisions();
+				return !decisions_->find( GFN( req ), rip, access, action, instructionSize );
+			}
+
+			return true;
+		}
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+		case VM_EVENT_REASON_WRITE_CTRLREG:
+			if ( req.u.write_ctrlreg.index == VM_EVENT_X86_XCR0 )
+				return true;
+#else
+		case MEM_EVENT_REASON_CR0:
+		case MEM_EVENT_REASON_CR3:
+		case MEM_EVENT_REASON_CR4:
+#endif
+			return eventFilter().wantsCR( crNumber( req ), CR_OLD_VALUE( req ), CR_NEW_VALUE( req ) );
+
+		case MEM_EVENT_REASON_MSR: {
+			bool msrEnabled = false;
+			driver_.isMsrEnabled( MSR_TYPE( req ), msrEnabled );
+
+			return msrEnabled;
+		}
+
+		default:
+			return true;
+	}
+}
+
+bool XenEventManager::shedEvent( const mem_event_request_t &req )
+{
+	EventStatistics::EventType type = eventType( req );
+
+	// Still on the ring from before the switch, or the hypervisor can't turn CR3 off by itself
+	if ( type == EventStatistics::CR && crNumber( req ) == 3 )
+		return true;
+
+	if ( governorLevel_ < GOVERNOR_SAMPLED )
+		return false;
+
+	// VMCALLs are the guest talking to us, and XSETBVs are rare anyway
+	if ( type != EventStatistics::PAGE_FAULT && type != EventStatistics::CR && type != EventStatistics::MSR )
+		return false;
+
+	return ( ++sampled_ % GOVERNOR_SAMPLING ) != 0;
+}
+
+unsigned int XenEventManager::reapCompletions()
+{
+	if ( !eventsInFlight_ && !expiredInFlight_ )
+		return 0;
+
+	XenPendingEvent *ev = completions_.popAll();
+	unsigned int count = 0;
+
+	while ( ev ) {
+		XenPendingEvent *next = ev->next;
+
+		// Too late, the fallback action has been sent already
+		if ( ev->expired ) {
+			++stats_.lateDecisions;
+			--expiredInFlight_;
+			freeEvent( ev );
+
+			ev = next;
+			continue;
+		}
+
+		// Not if page protections or rules changed while the worker was deciding
+		if ( ev->cacheable && decisions_ && ev->generation == decisionsGeneration() )
+			rememberDecision( ev->req, ev->action, ev->instructionSize, NULL );
+
+		if ( trace_ )
+			traceEvent( ev->req, ev->rsp, ev->tsc, 0 );
+
+		putResponse( &ev->rsp );
+		arrivals_.push_back( ev->arrivalNs );
+		freeEvent( ev );
+
+		--eventsInFlight_;
+		++count;
+
+		ev = next;
+	}
+
+	return count;
+}
+
+void XenEventManager::watchDeadline( XenPendingEvent *ev )
+{
+	if ( !deadlineNs_ )
+		return;
+
+	watched_.push_back( std::make_pair( ev, ev->serial ) );
+
+	if ( !deadlineArmed_ )
+		armDeadline( ev->arrivalNs + deadlineNs_ );
+}
+
+unsigned int XenEventManager::expireEvents()
+{
+	uint64_t now = nowNs();
+	unsigned int expired = 0;
+
+	while ( !watched_.empty() ) {
+		XenPendingEvent *ev = watched_.front().first;
+
+		// Answered by the handler already (and maybe reused since)
+		if ( ev->serial != watched_.front().second ) {
+			watched_.pop_front();
+			continue;
+		}
+
+		// Deadlines come in the same order as the events
+		if ( now - ev->arrivalNs < deadlineNs_ )
+			break;
+
+		watched_.pop_front();
+
+		mem_event_response_t rsp;
+
+		initResponse( ev->req, rsp );
+		applyAction( ev->req, rsp, deadlineAction_, NULL, 0, 0 );
+
+		if ( trace_ )
+			traceEvent( ev->req, rsp, ev->tsc, EventTraceRecord::EXPIRED );
+
+		putResponse( &rsp );
+		arrivals_.push_back( ev->arrivalNs );
+
+		BDVMI_TRACE3( deadline_miss, domain_, ev->req.vcpu_id, eventType( ev->req ) );
+
+		// The handler still has it, it will come back through completions_ to be dropped
+		ev->expired = true;
+		--eventsInFlight_;
+		++expiredInFlight_;
+		++expired;
+	}
+
+	if ( expired ) {
+		stats_.deadlineMisses += expired;
+		resumePages();
+
+		if ( logHelper_ ) {
+			std::stringstream ss;
+			ss << "[Xen events] " << expired << " event(s) missed the handler deadline, answered with the "
+			   << "fallback action";
+
+			logHelper_->warning( ss.str() );
+		}
+	}
+
+	if ( !watched_.empty() && !deadlineArmed_ )
+		armDeadline( watched_.front().first->arrivalNs + deadlineNs_ );
+
+	return expired;
+}
+
+void XenEventManager::armDeadline( uint64_t when )
+{
+	if ( !armTimer( deadlineFd_, when ) )
+		throw Exception( "[Xen events] could not arm the handler deadline timer" );
+
+	deadlineArmed_ = true;
+}
+
+bool XenEventManager::handleEvent( XenPendingEvent &ev, Registers &regs, EventStatistics &stats )
+{
+	initResponse( ev.req, ev.rsp );
+	return handleRequest( ev.req, ev.rsp, regs, &ev, stats );
+}
+
+XenPendingEvent *XenEventManager::allocEvent()
+{
+	XenPendingEvent *ev;
+
+	if ( freeEvents_.empty() )
+		ev = new XenPendingEvent;
+	else {
+		ev = freeEvents_.back();
+		freeEvents_.pop_back();
+
+		ev->cacheable = false;
+		ev->expired = false;
+	}
+
+	ev->serial = ++serial_;
+
+	return ev;
+}
+
+void XenEventManager::freeEvent( XenPendingEvent *ev )
+{
+	ev->serial = 0; // stale for watched_
+	freeEvents_.push_back( ev );
+}
+
+void XenEventManager::initResponse( const mem_event_request_t &req, mem_event_response_t &rsp )
+{
+	memset( &rsp, 0, sizeof( rsp ) );
+	rsp.vcpu_id = req.vcpu_id;
+	rsp.flags = req.flags;
+	rsp.reason = req.reason;
+	REGS( rsp ) = REGS( req );
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+	rsp.version = VM_EVENT_INTERFACE_VERSION;
+	rsp.u.mem_access.flags = req.u.mem_access.flags;
+#else
+	rsp.access_r = req.access_r;
+	rsp.access_w = req.access_w;
+	rsp.access_x = req.access_x;
+#endif
+}
+
+/*
+   Note that req and rsp may be the very same ring slot (see ZERO_COPY_RING), so a request
+   field must never be read after the response field that overlaps it has been written.
+*/
+bool XenEventManager::handleRequest( const mem_event_request_t &req, mem_event_response_t &rsp,
+                                     Registers &regsStorage, XenPendingEvent *ev, EventStatistics &stats )
+{
+	// Worker threads only go by what the event was dispatched with (see XenPendingEvent)
+	EventHandler *h = ev ? ev->handler : handler();
+	unsigned short hndlFlags = ev ? ev->handlerFlags : handlerFlags_;
+	bool runPreEvent = ev ? ev->preEventHook : preEventHook();
+	HVAction action = NONE;
+	uint8_t emulatorCtx[sizeof( RESPONSE_DATA( rsp ).data )];
+	uint32_t rspDataSize = sizeof( emulatorCtx );
+	unsigned short instructionSize = 0;
+	DeferralContext deferral = { this, &req, ev, false, false };
+	EventStatistics::EventType type = eventType( req );
+	uint64_t start = h ? nowNs() : 0;
+
+	if ( h )
+		beginRequest( req );
+
+	if ( h && runPreEvent )
+		h->runPreEvent();
+
+	if ( h )
+		BDVMI_TRACE3( handler_entry, domain_, req.vcpu_id, type );
+
+	switch ( req.reason ) {
+
+		case MEM_EVENT_REASON_VIOLATION: {
+			XenRegistersView regs( req, regsStorage );
+
+			if ( h && ( hndlFlags & ENABLE_MEMORY ) ) {
+				uint64_t gva = 0;
+				bool read = ( ACCESS_R( req ) != 0 );
+				bool write = ( ACCESS_W( req ) != 0 );
+				bool execute = ( ACCESS_X( req ) != 0 );
+
+				if ( GLA_VALID( req ) )
+					gva = GLA( req );
+
+				uint64_t gpa = ( GFN( req ) << XC_PAGE_SHIFT ) + OFFSET( req );
+#if __XEN_LATEST_INTERFACE_VERSION__ == 0x00040500
+				if ( req.fault_in_gpt )
+					break;
+#elif __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+				if ( req.u.mem_access.flags & MEM_ACCESS_FAULT_IN_GPT )
+					break;
+#endif
+				DeferralScope scope( deferral );
+
+				// The emulator context overlaps the registers in the response, so it only gets
+				// copied there if the handler actually asks for it.
+				h->handlePageFault( req.vcpu_id, regs, gpa, gva, read, write, execute,
+				                    action, emulatorCtx, rspDataSize, instructionSize );
+			}
+
+			break;
+		}
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+		case VM_EVENT_REASON_WRITE_CTRLREG: {
+#else
+		case MEM_EVENT_REASON_CR0:
+		case MEM_EVENT_REASON_CR3:
+		case MEM_EVENT_REASON_CR4: {
+#endif
+			XenRegistersView regs( req, regsStorage );
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+			if ( req.u.write_ctrlreg.index == VM_EVENT_X86_XCR0 ) {
+				if ( h && ( hndlFlags & ENABLE_XSETBV ) )
+					h->handleXSETBV( req.vcpu_id, req.u.write_ctrlreg.new_value );
+
+				break;
+			}
+#endif
+			if ( h && ( hndlFlags & ENABLE_CR ) ) {
+				DeferralScope scope( deferral );
+
+				h->handleCR( req.vcpu_id, crNumber( req ), regs, CR_OLD_VALUE( req ),
+				             CR_NEW_VALUE( req ), action );
+			}
+
+			break;
+		}
+
+		case MEM_EVENT_REASON_MSR:
+
+			// Only enabled MSRs get here (see wantsEvent())
+			if ( h && ( hndlFlags & ENABLE_MSR ) ) {
+				DeferralScope scope( deferral );
+
+				// old value == new value (can't get the old one)
+				h->handleMSR( req.vcpu_id, MSR_TYPE( req ), MSR_VALUE( req ), MSR_VALUE( req ), action );
+			}
+
+			break;
+
+		case MEM_EVENT_REASON_VMCALL: {
+			XenRegistersView regs( req, regsStorage );
+
+			if ( h && ( hndlFlags & ENABLE_VMCALL ) )
+				h->handleVMCALL( req.vcpu_id, regs, VMCALL_RIP( req ), VMCALL_RAX( req ) );
+
+			break;
+		}
+
+#if __XEN_LATEST_INTERFACE_VERSION__ < 0x00040600
+		case MEM_EVENT_REASON_XSETBV:
+
+			if ( h && ( hndlFlags & ENABLE_XSETBV ) )
+				h->handleXSETBV( req.vcpu_id, GFN( req ) );
+
+			break;
+#endif
+		default:
+			// unknown reason code
+			break;
+	}
+
+	if ( h ) {
+		uint64_t end = nowNs();
+
+		stats.handlerTime[type].add( end - start );
+		BDVMI_TRACE4( handler_return, domain_, req.vcpu_id, type, action );
+
+		// Late, but on the event loop thread, so there was no way to answer it meanwhile
+		if ( !ev && !deferral.deferred && deadlineNs_ && end - arrivalNs_ > deadlineNs_ )
+			++stats.deadlineMisses;
+	}
+
+	// The handler will call completeResponse() later on, don't touch ev (or the ring slot) anymore
+	if ( deferral.deferred )
+		return false;
+
+	// req may share its ring slot with rsp (ZERO_COPY_RING), so do this before applyAction()
+	if ( deferral.cacheable && action != EMULATE_SET_CTXT )
+		rememberDecision( req, action, instructionSize, ev );
+
+	applyAction( req, rsp, action, emulatorCtx, rspDataSize, instructionSize );
+
+	return true;
+}
+
+void XenEventManager::applyAction( const mem_event_request_t &req, mem_event_response_t &rsp, HVAction action,
+                                   const uint8_t *emulatorCtx, uint32_t emuCtxSize,
+                                   unsigned short instructionSize )
+{
+#if __XEN_LATEST_INTERFACE_VERSION__ == 0x00040600
+	( void )instructionSize; // SKIP_INSTRUCTION means EMULATE_NOWRITE here
+#endif
+
+	// The VCPU has moved on already (async event), Xen only wants the ring slot back
+	if ( !( req.flags & MEM_EVENT_FLAG_VCPU_PAUSED ) )
+		return;
+
+	switch ( req.reason ) {
+
+		case MEM_EVENT_REASON_VIOLATION:
+			rsp.flags |= MEM_EVENT_FLAG_EMULATE;
+			GFN( rsp ) = GFN( req );
+#if __XEN_LATEST_INTERFACE_VERSION__ < 0x00040600
+			rsp.p2mt = req.p2mt;
+#endif
+			switch ( action ) {
+				case EMULATE_NOWRITE:
+#if __XEN_LATEST_INTERFACE_VERSION__ == 0x00040600
+				case SKIP_INSTRUCTION:
+#endif
+					rsp.flags |= MEM_EVENT_FLAG_EMULATE_NOWRITE;
+					break;
+#if __XEN_LATEST_INTERFACE_VERSION__ != 0x00040600
+				case SKIP_INSTRUCTION:
+					REGS( rsp ).rip = REGS( req ).rip + instructionSize;
+					rsp.flags |= MEM_EVENT_FLAG_SKIP_INSTR;
+					break;
+#endif
+				case ALLOW_VIRTUAL:
+					// go on, but don't emulate (monitoring application changed EIP)
+					rsp.flags &= ~MEM_EVENT_FLAG_EMULATE;
+					break;
+
+				case EMULATE_SET_CTXT:
+					if ( emuCtxSize > sizeof( RESPONSE_DATA( rsp ).data ) )
+						emuCtxSize = sizeof( RESPONSE_DATA( rsp ).data );
+
+					memcpy( RESPONSE_DATA( rsp ).data, emulatorCtx, emuCtxSize );
+					RESPONSE_DATA( rsp ).size = emuCtxSize;
+					rsp.flags |= MEM_EVENT_FLAG_EMUL_SET_CONTEXT;
+					break;
+
+				case NONE:
+				default:
+					break;
+			}
+
+			break;
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+		case VM_EVENT_REASON_WRITE_CTRLREG:
+			rsp.u.write_ctrlreg.index = req.u.write_ctrlreg.index;
+#else
+		case MEM_EVENT_REASON_CR0:
+		case MEM_EVENT_REASON_CR3:
+		case MEM_EVENT_REASON_CR4:
+#endif
+			if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE ) {
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+				rsp.flags |= MEM_EVENT_FLAG_DENY;
+#else
+				vcpu_guest_context_any_t ctx;
+
+				if ( !localRing_ && xc_vcpu_getcontext( xci_, domain_, req.vcpu_id, &ctx ) == 0 ) {
+
+					if ( logHelper_ )
+						logHelper_->debug( "Writing back old CR value" );
+
+					ctx.c.ctrlreg[crNumber( req )] = GLA( req ); // old value
+					// write the old value back
+					xc_vcpu_setcontext( xci_, domain_, req.vcpu_id, &ctx );
+				}
+#endif
+			}
+
+			break;
+
+		case MEM_EVENT_REASON_MSR:
+
+			if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
+				rsp.flags |= MEM_EVENT_FLAG_DENY;
+
+			break;
+
+		default:
+			break;
+	}
+}
+
+#endif // DISABLE_MEM_EVENT
+
+#ifndef DISABLE_MEM_EVENT
+
+EventManager::ResponseToken XenEventManager::deferResponse()
+{
+	DeferralContext *context = currentDeferral;
+
+	if ( !context || context->manager != this || context->deferred )
+		return NULL;
+
+	// An async event's VCPU isn't waiting for anything
+	if ( !( context->req->flags & MEM_EVENT_FLAG_VCPU_PAUSED ) )
+		return NULL;
+
+	if ( !context->ev ) {
+		// Handled in place, on the waitForEvents() thread: move the request off the ring
+		context->ev = allocEvent();
+		context->ev->req = *context->req;
+		context->ev->tsc = traceTsc_;
+		context->ev->arrivalNs = arrivalNs_;
+		++eventsInFlight_;
+
+		watchDeadline( context->ev );
+	}
+
+	context->deferred = true;
+
+	return context->ev;
+}
+
+bool XenEventManager::completeResponse( ResponseToken token, HVAction action, const uint8_t *emulatorCtx,
+                                        uint32_t emuCtxSize, unsigned short instructionSize )
+{
+	if ( !token )
+		return false;
+
+	XenPendingEvent *ev = static_cast<XenPendingEvent *>( token );
+
+	initResponse( ev->req, ev->rsp );
+	applyAction( ev->req, ev->rsp, action, emulatorCtx, emuCtxSize, instructionSize );
+
+	completions_.push( ev ); // wakes up waitForEvents(), which will queue the response
+
+	return true;
+}
+
+bool XenEventManager::decisionCache( size_t maxEntries )
+{
+	delete decisions_;
+	decisions_ = NULL;
+
+	if ( maxEntries ) {
+		decisions_ = new DecisionCache( maxEntries );
+		decisionsGeneration_ = decisionsGeneration();
+	}
+
+	return true;
+}
+
+bool XenEventManager::cacheDecision()
+{
+	DeferralContext *context = currentDeferral;
+
+	if ( !context || context->manager != this || context->deferred )
+		return false;
+
+	if ( context->req->reason != MEM_EVENT_REASON_VIOLATION )
+		return false;
+
+	context->cacheable = true;
+
+	return true;
+}
+
+void XenEventManager::invalidateDecisions()
+{
+	__sync_add_and_fetch( &invalidations_, 1 );
+}
+
+void XenEventManager::rememberDecision( const mem_event_request_t &req, HVAction action, unsigned short instructionSize,
+                                        XenPendingEvent *ev )
+{
+	if ( ev ) {
+		// On a dispatch thread, the cache belongs to the event loop
+		ev->cacheable = true;
+		ev->action = action;
+		ev->instructionSize = instructionSize;
+		return;
+	}
+
+	if ( !decisions_ )
+		return;
+
+	checkDecisions();
+	decisions_->insert( GFN( req ), REGS( req ).rip, pageFaultAccess( req ), action, instructionSize );
+}
+
+bool XenEventManager::traceEvents( const std::string &path )
+{
+	delete trace_;
+	trace_ = NULL;
+
+	if ( path.empty() )
+		return true;
+
+	unsigned long long tscSpeed = 0;
+	driver_.tscSpeed( tscSpeed );
+
+	try {
+		trace_ = new EventTrace( path, __XEN_LATEST_INTERFACE_VERSION__, sizeof( mem_event_request_t ),
+		                         sizeof( mem_event_response_t ), tscSpeed );
+	} catch ( const Exception &e ) {
+		LOG_ERROR( e.what() );
+		return false;
+	}
+
+	return true;
+}
+
+void XenEventManager::traceEvent( const mem_event_request_t &req, const mem_event_response_t &rsp, uint64_t startTsc,
+                                  uint32_t flags )
+{
+	trace_->append( startTsc, EventTrace::tsc() - startTsc, flags, &req, &rsp );
+}
+
+unsigned int XenEventManager::decisionsGeneration()
+{
+	// All of these only ever go up, so the sum changes whenever any of them does
+	return driver_.protectionGeneration() + eventFilter().rulesGeneration() + invalidations_;
+}
+
+void XenEventManager::checkDecisions()
+{
+	unsigned int generation = decisionsGeneration();
+
+	if ( generation != decisionsGeneration_ ) {
+		decisions_->clear();
+		decisionsGeneration_ = generation;
+	}
+}
+
+#else
+
+EventManager::ResponseToken XenEventManager::deferResponse()
+{
+	return NULL;
+}
+
+bool XenEventManager::completeResponse( ResponseToken, HVAction, const uint8_t *, uint32_t, unsigned short )
+{
+	return false;
+}
+
+bool XenEventManager::decisionCache( size_t maxEntries )
+{
+	return maxEntries == 0;
+}
+
+bool XenEventManager::cacheDecision()
+{
+	return false;
+}
+
+void XenEventManager::invalidateDecisions()
+{
+}
+
+bool XenEventManager::traceEvents( const std::string &path )
+{
+	return path.empty();
+}
+
+#endif // DISABLE_MEM_EVENT
+
+#ifndef DISABLE_MEM_EVENT
+
+bool XenEventManager::spinForRequests()
+{
+	// Spinning for longer than twice the usual gap between batches is most likely wasted
+	uint64_t budget = avgGapNs_ * 2;
+
+	if ( budget > maxSpinNs_ )
+		budget = ( avgGapNs_ > maxSpinNs_ ) ? 0 : maxSpinNs_;
+
+	if ( !budget )
+		return false;
+
+	uint64_t start = nowNs();
+	uint64_t now = start;
+	bool found = false;
+
+	do {
+		if ( RING_HAS_UNCONSUMED_REQUESTS( &backRing_ ) || completions_.pending() || stop_ ) {
+			found = true;
+			break;
+		}
+
+		cpuRelax();
+		now = nowNs();
+
+	} while ( now - start < budget );
+
+	stats_.spinTime += now - start;
+
+	return found;
+}
+
+void XenEventManager::noteBatch( unsigned int events, bool spun )
+{
+	uint64_t now = nowNs();
 
-	int32_t x86Mode = XenDriver::guestX86Mode( regs );
+	if ( lastBatchNs_ )
+		avgGapNs_ = ( avgGapNs_ * 7 + ( now - lastBatchNs_ ) ) / 8;
 
-	switch ( x86Mode ) {
-		case 2:
-			regs.guest_x86_mode = Registers::CS_TYPE_16;
-			break;
-		case 4:
-			regs.guest_x86_mode = Registers::CS_TYPE_32;
-			break;
-		case 8:
-			regs.guest_x86_mode = Registers::CS_TYPE_64;
-			break;
-		default:
-			regs.guest_x86_mode = Registers::ERROR;
-			break;
+	lastBatchNs_ = now;
+
+	stats_.events += events;
+
+	if ( spun )
+		++stats_.spinWakeups;
+	else
+		++stats_.sleepWakeups;
+}
+
+#endif // DISABLE_MEM_EVENT
+
+bool XenEventManager::busyPoll( unsigned int maxSpinUs )
+{
+#ifndef DISABLE_MEM_EVENT
+	maxSpinNs_ = static_cast<uint64_t>( maxSpinUs ) * 1000;
+	avgGapNs_ = maxSpinNs_ / 2; // start out optimistic, spinForRequests() uses twice that
+
+	return true;
+#else
+	return !maxSpinUs;
+#endif // DISABLE_MEM_EVENT
+}
+
+bool XenEventManager::handlerDeadline( unsigned int us, HVAction fallback )
+{
+#ifndef DISABLE_MEM_EVENT
+	// The fallback action can't depend on the event (instruction size, emulator context)
+	if ( fallback != NONE && fallback != EMULATE_NOWRITE && fallback != ALLOW_VIRTUAL )
+		return false;
+
+	if ( us && deadlineFd_ < 0 ) {
+		deadlineFd_ = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+
+		if ( deadlineFd_ < 0 ) {
+			LOG_ERROR( "[Xen events] could not create the handler deadline timer" );
+			return false;
+		}
+
+		poller_.add( deadlineFd_, DEADLINE_READY );
 	}
+
+	deadlineNs_ = static_cast<uint64_t>( us ) * 1000;
+	deadlineAction_ = fallback;
+
+	if ( !us )
+		watched_.clear(); // the timer may still go off once, that's harmless
+
+	return true;
+#else
+	( void )fallback;
+	return !us;
+#endif // DISABLE_MEM_EVENT
 }
 
-void XenEventManager::waitForEvents()
+bool XenEventManager::statistics( EventStatistics &stats ) const
 {
-	EventHandler *h = handler();
-	bool shuttingDown = false;
+	stats = stats_;
 
-	for ( ;; ) {
+	if ( dispatcher_ )
+		dispatcher_->statistics( stats );
 
-		waitForEventOrTimeout( 100 );
+	return true;
+}
 
-		if ( sigStop_ && *sigStop_ )
-			stop();
+void XenEventManager::publishStatistics()
+{
+	uint64_t now = nowNs();
 
-		if ( stop_ )
-			shuttingDown = true;
+	if ( now - publishedNs_ < 100000000ULL )
+		return;
 
-#ifndef DISABLE_MEM_EVENT
-		mem_event_request_t req;
-		mem_event_response_t rsp;
+	publishedNs_ = now;
 
-		while ( RING_HAS_UNCONSUMED_REQUESTS( &backRing_ ) ) {
-			unsigned short hndlFlags = handlerFlags();
+	DriverStatistics driverStats;
+	bool driverCounters = driver_.statistics( driverStats );
 
-			getRequest( &req );
+	if ( !statsSlot_ ) {
+		std::string name = driver_.uuid();
 
-			memset( &rsp, 0, sizeof( rsp ) );
-			rsp.vcpu_id = req.vcpu_id;
-			rsp.flags = req.flags;
-			rsp.reason = req.reason;
-			REGS( rsp ) = REGS( req );
+		if ( name.empty() ) {
+			std::stringstream ss;
+			ss << "domain " << driver_.id();
+			name = ss.str();
+		}
 
-#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-			rsp.version = VM_EVENT_INTERFACE_VERSION;
-			rsp.u.mem_access.flags = req.u.mem_access.flags;
-#else
-			rsp.access_r = req.access_r;
-			rsp.access_w = req.access_w;
-			rsp.access_x = req.access_x;
+		statsSlot_ = StatsPage::acquire( StatsSlot::EVENT_MANAGER, name );
+
+		if ( !statsSlot_ )
+			return; // no room, try again next time
+
+		if ( driverCounters )
+			driverSlot_ = StatsPage::acquire( StatsSlot::DRIVER, name );
+	}
+
+	EventStatistics stats;
+	uint64_t values[StatsSlot::VALUES] = {};
+
+	statistics( stats );
+
+	values[StatsSlot::EM_EVENTS] = stats.events;
+	values[StatsSlot::EM_PAGE_FAULTS] = stats.requests[EventStatistics::PAGE_FAULT];
+	values[StatsSlot::EM_CR] = stats.requests[EventStatistics::CR];
+	values[StatsSlot::EM_MSR] = stats.requests[EventStatistics::MSR];
+	values[StatsSlot::EM_VMCALL] = stats.requests[EventStatistics::VMCALL];
+	values[StatsSlot::EM_XSETBV] = stats.requests[EventStatistics::XSETBV];
+	values[StatsSlot::EM_OTHER] = stats.requests[EventStatistics::OTHER];
+	values[StatsSlot::EM_FILTERED] = stats.filtered;
+	values[StatsSlot::EM_IN_FLIGHT] = eventsInFlight_;
+	values[StatsSlot::EM_SPIN_WAKEUPS] = stats.spinWakeups;
+	values[StatsSlot::EM_SLEEP_WAKEUPS] = stats.sleepWakeups;
+	values[StatsSlot::EM_SPIN_TIME] = stats.spinTime;
+
+	for ( unsigned int i = 0; i < EventStatistics::EVENT_TYPES; ++i )
+		values[StatsSlot::EM_HANDLER_TIME] += stats.handlerTime[i].sum();
+
+	values[StatsSlot::EM_RESPONSES] = stats.responseTime.count();
+	values[StatsSlot::EM_RESPONSE_TIME] = stats.responseTime.sum();
+	values[StatsSlot::EM_RESPONSE_P99] = stats.responseTime.percentile( 99 );
+	values[StatsSlot::EM_NOTIFIES] = stats.notifyTime.count();
+	values[StatsSlot::EM_NOTIFY_TIME] = stats.notifyTime.sum();
+	values[StatsSlot::EM_BATCHES] = stats.batchSizes.count();
+	values[StatsSlot::EM_DEADLINE_MISSES] = stats.deadlineMisses;
+	values[StatsSlot::EM_LATE_DECISIONS] = stats.lateDecisions;
+	values[StatsSlot::EM_SHED] = stats.shed;
+	values[StatsSlot::EM_GOVERNOR_LEVEL] = governorLevel_;
+
+	StatsPage::publish( statsSlot_, values, StatsSlot::EM_VALUES );
+
+	if ( driverSlot_ && driverCounters ) {
+		values[StatsSlot::DRV_HYPERCALLS] = driverStats.hypercalls;
+		values[StatsSlot::DRV_CACHE_HITS] = driverStats.cacheHits;
+		values[StatsSlot::DRV_CACHE_MISSES] = driverStats.cacheMisses;
+		values[StatsSlot::DRV_CACHE_EVICTIONS] = driverStats.cacheEvictions;
+		values[StatsSlot::DRV_CACHE_PAGES] = driverStats.cachePages;
+		values[StatsSlot::DRV_MAP_FAILURES] = driverStats.mapFailures;
+
+		StatsPage::publish( driverSlot_, values, StatsSlot::DRV_VALUES );
+	}
+}
+
+bool XenEventManager::overheadBudget( unsigned int cpuPercent, unsigned int maxRate, GovernorLevel maxLevel )
+{
+#ifdef DISABLE_MEM_EVENT
+	if ( cpuPercent || maxRate )
+		return false;
 #endif
+	cpuBudget_ = cpuPercent;
+	rateBudget_ = maxRate;
+	maxGovernorLevel_ = maxLevel;
 
-			if ( h )
-				h->runPreEvent();
+	// Start measuring afresh
+	governorWindowNs_ = 0;
+	calmSinceNs_ = 0;
 
-			switch ( req.reason ) {
+	if ( !cpuPercent && !maxRate )
+		changeGovernorLevel( GOVERNOR_FULL );
+	else if ( governorLevel_ > maxLevel )
+		changeGovernorLevel( maxLevel );
 
-				case MEM_EVENT_REASON_VIOLATION: {
-					Registers regs;
-					uint32_t rspDataSize = sizeof( RESPONSE_DATA( rsp ).data );
+	return true;
+}
 
-					copyRegisters( regs, req );
+void XenEventManager::runGovernor()
+{
+	uint64_t now = nowNs();
 
-					rsp.flags |= MEM_EVENT_FLAG_EMULATE;
-					GFN( rsp ) = GFN( req );
-#if __XEN_LATEST_INTERFACE_VERSION__ < 0x00040600
-					rsp.p2mt = req.p2mt;
-#endif
-					if ( h && ( hndlFlags & ENABLE_MEMORY ) ) {
-						uint64_t gva = 0;
-						bool read = ( ACCESS_R( req ) != 0 );
-						bool write = ( ACCESS_W( req ) != 0 );
-						bool execute = ( ACCESS_X( req ) != 0 );
-						HVAction action = NONE;
-						unsigned short instructionSize = 0;
+	if ( governorWindowNs_ && now - governorWindowNs_ < GOVERNOR_WINDOW_NS )
+		return;
 
-						if ( GLA_VALID( req ) )
-							gva = GLA( req );
+	EventStatistics stats;
+	uint64_t events = 0;
+	uint64_t busyNs = 0;
 
-						uint64_t gpa = ( GFN( req ) << XC_PAGE_SHIFT ) + OFFSET( req );
-#if __XEN_LATEST_INTERFACE_VERSION__ == 0x00040500
-						if ( req.fault_in_gpt )
-							break;
-#elif __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-						if ( req.u.mem_access.flags & MEM_ACCESS_FAULT_IN_GPT )
-							break;
-#endif
-						h->handlePageFault( req.vcpu_id, regs, gpa, gva, read, write, execute,
-						                    action, RESPONSE_DATA( rsp ).data, rspDataSize,
-						                    instructionSize );
+	statistics( stats );
 
-						RESPONSE_DATA( rsp ).size = rspDataSize;
+	for ( unsigned int i = 0; i < EventStatistics::EVENT_TYPES; ++i ) {
+		events += stats.handlerTime[i].count();
+		busyNs += stats.handlerTime[i].sum();
+	}
 
-						switch ( action ) {
-							case EMULATE_NOWRITE:
-#if __XEN_LATEST_INTERFACE_VERSION__ == 0x00040600
-							case SKIP_INSTRUCTION:
-#endif
-								rsp.flags |= MEM_EVENT_FLAG_EMULATE_NOWRITE;
-								break;
-#if __XEN_LATEST_INTERFACE_VERSION__ != 0x00040600
-							case SKIP_INSTRUCTION:
-								REGS( rsp ).rip = REGS( req ).rip + instructionSize;
-								rsp.flags |= MEM_EVENT_FLAG_SKIP_INSTR;
-								break;
-#endif
-							case ALLOW_VIRTUAL:
-								// go on, but don't emulate (monitoring application changed EIP)
-								rsp.flags &= ~MEM_EVENT_FLAG_EMULATE;
-								break;
-
-							case EMULATE_SET_CTXT:
-								rsp.flags |= MEM_EVENT_FLAG_EMUL_SET_CONTEXT;
-								break;
-
-							case NONE:
-							default:
-								break;
-						}
-					}
+	uint64_t windowStart = governorWindowNs_;
+	uint64_t elapsed = now - windowStart;
+	uint64_t windowEvents = events - governorEvents_;
+	uint64_t windowBusyNs = busyNs - governorBusyNs_;
 
-					break;
-				}
+	governorWindowNs_ = now;
+	governorEvents_ = events;
+	governorBusyNs_ = busyNs;
 
-#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-				case VM_EVENT_REASON_WRITE_CTRLREG: {
-#else
-				case MEM_EVENT_REASON_CR0:
-				case MEM_EVENT_REASON_CR3:
-				case MEM_EVENT_REASON_CR4: {
-#endif
-					Registers regs;
-					unsigned short crNumber = 3;
+	if ( !windowStart )
+		return; // that was the first snapshot
 
-#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-                    rsp.u.write_ctrlreg.index = req.u.write_ctrlreg.index;
-
-					if ( req.u.write_ctrlreg.index == VM_EVENT_X86_XCR0 ) {
-						if ( h && ( hndlFlags & ENABLE_XSETBV ) )
-							h->handleXSETBV( req.vcpu_id, req.u.write_ctrlreg.new_value );
-
-						break;
-					}
-
-					switch ( req.u.write_ctrlreg.index ) {
-						case VM_EVENT_X86_CR0:
-							crNumber = 0;
-							break;
-						case VM_EVENT_X86_CR4:
-							crNumber = 4;
-							break;
-						case VM_EVENT_X86_CR3:
-						default:
-							crNumber = 3;
-							break;
-					}
-#else
-					switch ( req.reason ) {
-						case MEM_EVENT_REASON_CR0:
-							crNumber = 0;
-							break;
-						case MEM_EVENT_REASON_CR4:
-							crNumber = 4;
-							break;
-						case MEM_EVENT_REASON_CR3:
-						default:
-							crNumber = 3;
-							break;
-					}
-#endif
-					copyRegisters( regs, req );
-
-					if ( h && ( hndlFlags & ENABLE_CR ) ) {
-						HVAction action = NONE;
-
-						h->handleCR( req.vcpu_id, crNumber, regs, CR_OLD_VALUE( req ),
-						             CR_NEW_VALUE( req ), action );
-
-						if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE ) {
-#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-							rsp.flags |= MEM_EVENT_FLAG_DENY;
-#else
-							vcpu_guest_context_any_t ctx;
+	// The load as a percentage of the budget (the worse of the two)
+	uint64_t load = 0;
 
-							if ( xc_vcpu_getcontext( xci_, domain_, req.vcpu_id, &ctx ) ==
-							     0 ) {
+	if ( cpuBudget_ )
+		load = windowBusyNs * 10000 / ( elapsed * cpuBudget_ );
 
-								if ( logHelper_ )
-									logHelper_->debug(
-									        "Writing back old CR value" );
+	if ( rateBudget_ ) {
+		uint64_t rateLoad = windowEvents * 100000000000ULL / ( elapsed * rateBudget_ );
 
-								ctx.c.ctrlreg[crNumber] = GLA( req ); // old value
-								// write the old value back
-								xc_vcpu_setcontext( xci_, domain_, req.vcpu_id, &ctx );
-							}
-#endif
-						}
-					}
+		if ( rateLoad > load )
+			load = rateLoad;
+	}
 
-					break;
-				}
+	if ( load > 100 ) {
+		calmSinceNs_ = 0;
 
-				case MEM_EVENT_REASON_MSR:
+		if ( governorLevel_ < maxGovernorLevel_ )
+			changeGovernorLevel( static_cast<GovernorLevel>( governorLevel_ + 1 ) );
 
-					if ( h && ( hndlFlags & ENABLE_MSR ) ) {
+		return;
+	}
 
-						HVAction action = NONE;
+	// Going back to handling every event would multiply the load (about) GOVERNOR_SAMPLING times
+	if ( governorLevel_ == GOVERNOR_SAMPLED )
+		load *= GOVERNOR_SAMPLING;
 
-						bool msrEnabled = false;
-						driver_.isMsrEnabled( MSR_TYPE( req ), msrEnabled );
+	if ( load >= 50 ) {
+		calmSinceNs_ = 0;
+		return;
+	}
 
-						if ( msrEnabled ) {
-							// old value == new value (can't get the old one)
-							h->handleMSR( req.vcpu_id, MSR_TYPE( req ), MSR_VALUE( req ),
-							              MSR_VALUE( req ), action );
+	if ( !calmSinceNs_ )
+		calmSinceNs_ = windowStart;
 
-							if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
-								rsp.flags |= MEM_EVENT_FLAG_DENY;
-						}
-					}
+	if ( governorLevel_ != GOVERNOR_FULL && now - calmSinceNs_ >= GOVERNOR_RESTORE_NS ) {
+		changeGovernorLevel( static_cast<GovernorLevel>( governorLevel_ - 1 ) );
+		calmSinceNs_ = now;
+	}
+}
 
-					break;
+void XenEventManager::changeGovernorLevel( GovernorLevel level )
+{
+	if ( level == governorLevel_ )
+		return;
 
-				case MEM_EVENT_REASON_VMCALL: {
-					Registers regs;
-					copyRegisters( regs, req );
+	GovernorLevel old = governorLevel_;
+	bool wasAsync = ( old >= GOVERNOR_ASYNC );
+	bool async = ( level >= GOVERNOR_ASYNC );
 
-					if ( h && ( hndlFlags & ENABLE_VMCALL ) )
-						h->handleVMCALL( req.vcpu_id, regs, VMCALL_RIP( req ), VMCALL_RAX( req ) );
+	governorLevel_ = level;
 
-					break;
-				}
+	// Only ever add and remove the governor's own bits, the application may change its own meanwhile
+	if ( async != wasAsync ) {
+		governorAsyncFlags_ = async ? GOVERNOR_ASYNC_FLAGS : 0;
+		applyAsyncFlags( appAsyncFlags_ | governorAsyncFlags_ );
+	}
 
-#if __XEN_LATEST_INTERFACE_VERSION__ < 0x00040600
-				case MEM_EVENT_REASON_XSETBV:
+	// asyncEvents() turns the CR events off and back on, so this comes last
+	if ( async != wasAsync || ( old >= GOVERNOR_NO_CR3 ) != ( level >= GOVERNOR_NO_CR3 ) )
+		monitorCR3( level < GOVERNOR_NO_CR3 );
 
-					if ( h && ( hndlFlags & ENABLE_XSETBV ) )
-						h->handleXSETBV( req.vcpu_id, GFN( req ) );
+	++stats_.governorChanges;
+	BDVMI_TRACE2( governor, domain_, level );
 
-					break;
+	if ( logHelper_ ) {
+		std::stringstream ss;
+		ss << "[Xen events] overhead governor: " << governorLevelName( old ) << " -> "
+		   << governorLevelName( level );
+
+		logHelper_->warning( ss.str() );
+	}
+}
+
+void XenEventManager::monitorCR3( bool enable )
+{
+	if ( localRing_ || !( handlerFlags_ & ENABLE_CR ) )
+		return;
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+	if ( enable )
+		monitorCR( xci_, domain_, VM_EVENT_X86_CR3, true, syncEvents( ENABLE_CR ), 0 );
+	else
+		monitorCR( xci_, domain_, VM_EVENT_X86_CR3, false, true, 0 );
+#else
+	xc_set_hvm_param( xci_, domain_, HVM_PARAM_MEMORY_EVENT_CR3,
+	                  enable ? HVMPME_onchangeonly | hvmpmeMode( ENABLE_CR ) : HVMPME_mode_disabled );
 #endif
-				default:
-					// unknown reason code
-					break;
-			}
+}
 
-			resumePage( &rsp ); // will throw on error!
-		}
-#endif // DISABLE_MEM_EVENT
+bool XenEventManager::parallelDispatch( unsigned int workers )
+{
+	if ( dispatcher_ && dispatcher_->workers() == workers )
+		return true;
+
+	// Lets the workers finish whatever they've been handed, drainRing() will pick up the responses
+	delete dispatcher_;
+	dispatcher_ = NULL;
 
-		if ( shuttingDown )
-			return;
+	if ( !workers )
+		return true;
+
+	try {
+		dispatcher_ = new XenVcpuDispatcher( *this, completions_, workers );
+
+	} catch ( const std::exception &e ) {
+		LOG_ERROR( e.what() );
+		return false;
 	}
+
+	return true;
 }
 
 void XenEventManager::stop()
 {
+	if ( stop_ )
+		return;
+
 	EventHandler *h = handler();
 
 	if ( h )
@@ -572,6 +2065,87 @@ void XenEventManager::stop()
 #ifndef DISABLE_MEM_EVENT
 	handlerFlags( 0 );
 #endif // DISABLE_MEM_EVENT
+
+	poller_.wakeUp(); // stop() may have been called from another thread
+}
+
+bool XenEventManager::asyncEvents( unsigned short flags )
+{
+	if ( flags & ~ASYNC_CAPABLE ) {
+		LOG_ERROR( "[Xen events] asynchronous mode is not available for some of the requested events" );
+		return false;
+	}
+
+	appAsyncFlags_ = flags;
+
+	return applyAsyncFlags( flags | governorAsyncFlags_ );
+}
+
+bool XenEventManager::applyAsyncFlags( unsigned short flags )
+{
+	if ( flags && notifyFd_ < 0 ) {
+		notifyFd_ = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+
+		if ( notifyFd_ < 0 ) {
+			LOG_ERROR( "[Xen events] could not create the notification timer" );
+			return false;
+		}
+
+		poller_.add( notifyFd_, NOTIFY_READY );
+	}
+
+	unsigned short changed = flags ^ asyncFlags_;
+	unsigned short current = handlerFlags_;
+
+	if ( !changed )
+		return true;
+
+	// Xen won't switch the mode of an event that's being monitored, so turn it off first
+	handlerFlags( current & ~changed );
+
+	asyncFlags_ = flags;
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+	if ( ( changed & ENABLE_VMCALL ) && !localRing_ ) {
+		xc_monitor_guest_request( xci_, domain_, 0, 1 );
+		xc_monitor_guest_request( xci_, domain_, 1, syncEvents( ENABLE_VMCALL ) );
+	}
+
+	if ( ( changed & ENABLE_XSETBV ) && !localRing_ ) {
+		monitorCR( xci_, domain_, VM_EVENT_X86_XCR0, false, true, 0 );
+		monitorCR( xci_, domain_, VM_EVENT_X86_XCR0, true, syncEvents( ENABLE_XSETBV ), 0 );
+	}
+#endif
+
+	bool ok = handlerFlags( current );
+
+	asyncFlagsChanged( asyncFlags_ );
+
+	return ok;
+}
+
+bool XenEventManager::monitorCRBits( unsigned short crNumber, uint64_t mask )
+{
+	if ( !eventFilter().crBits( crNumber, mask ) )
+		return false;
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040a00
+	if ( ( handlerFlags_ & ENABLE_CR ) && !localRing_ ) {
+		uint16_t index = ( crNumber == 0 ) ? VM_EVENT_X86_CR0 : VM_EVENT_X86_CR4;
+
+		if ( monitorCR( xci_, domain_, index, true, syncEvents( ENABLE_CR ), ~mask ) ) {
+			LOG_ERROR( "[Xen events] could not update the CR event bitmask" );
+			return false;
+		}
+	}
+#endif
+
+	return true;
+}
+
+bool XenEventManager::stopSignals( const sigset_t &signals )
+{
+	return poller_.watchSignals( signals );
 }
 
 void XenEventManager::initXenStore()
@@ -658,8 +2232,8 @@ void XenEventManager::initMemAccess()
 	xc_domain_set_access_required( xci_, domain_, 0 );
 
 #if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-	xc_monitor_guest_request( xci_, domain_, 1, 1 );
-	xc_monitor_write_ctrlreg( xci_, domain_, VM_EVENT_X86_XCR0, 1, 1, 1 );
+	xc_monitor_guest_request( xci_, domain_, 1, syncEvents( ENABLE_VMCALL ) );
+	monitorCR( xci_, domain_, VM_EVENT_X86_XCR0, true, syncEvents( ENABLE_XSETBV ), 0 );
 #endif
 }
 
@@ -721,35 +2295,13 @@ void XenEventManager::initMemAccess()
 
 int XenEventManager::waitForEventOrTimeout( int ms )
 {
-#ifndef DISABLE_MEM_EVENT
-	struct pollfd fd[2];
-
-	fd[0].fd = xs_fileno( xsh_ );
-	fd[0].events = POLLIN | POLLERR;
-	fd[1].fd = xc_evtchn_fd( xce_ );
-	fd[1].events = POLLIN | POLLERR;
-
-	int rc = poll( fd, 2, ms );
-#else
-	struct pollfd fd[1];
-
-	fd[0].fd = xs_fileno( xsh_ );
-	fd[0].events = POLLIN | POLLERR;
+	unsigned int ready = poller_.wait( ms );
+	int port = 0;
 
-	int rc = poll( fd, 1, ms );
-#endif
-
-	if ( rc == 0 ) // poll() timeout
-		return 0;
-
-	if ( rc < 0 ) {
-		if ( errno == EINTR ) // interrupted by signal
-			return 0;
-
-		throw Exception( "[Xen events] poll() failed" );
-	}
+	if ( ( ready & EventPoller::STOP_SIGNAL ) && !stop_ )
+		stop();
 
-	if ( fd[0].revents & POLLIN ) { // a @releaseDomain event
+	if ( ready & XENSTORE_READY ) { // a @releaseDomain event
 
 		unsigned int num;
 		char **vec = xs_read_watch( xsh_, &num );
@@ -783,30 +2335,63 @@ int XenEventManager::waitForEventOrTimeout( int ms )
 				stop();
 			}
 		}
-
-			free( vec );
-			return 0;
 		}
 
 		free( vec );
 	}
 
 #ifndef DISABLE_MEM_EVENT
-	if ( fd[1].revents & POLLIN ) { // a mem_event
-		int port = xc_evtchn_pending( xce_ );
+	uint64_t ackStart = ( ready & ( EVTCHN_READY | LOCAL_RING_READY ) ) ? nowNs() : 0;
+
+	if ( ready & EVTCHN_READY ) { // a mem_event
+		port = xc_evtchn_pending( xce_ );
 
 		if ( port == -1 )
 			throw Exception( "[Xen events] failed to read port from event channel" );
 
 		if ( xc_evtchn_unmask( xce_, port ) != 0 )
 			throw Exception( "[Xen events] failed to unmask event channel port" );
+	}
+
+	if ( ready & COMPLETIONS_READY ) // events handled away from the ring are done
+		completions_.clearNotification();
+
+	if ( ready & LOCAL_RING_READY ) {
+		uint64_t count;
+
+		if ( read( localRingFd_, &count, sizeof( count ) ) < 0 && errno != EAGAIN )
+			throw Exception( "[Xen events] failed to read the local ring notification" );
+	}
 
-		return port;
+	if ( ackStart ) {
+		uint64_t ackTime = nowNs() - ackStart;
+
+		stats_.ackTime += ackTime;
+
+		if ( ackTime > stats_.maxAckTime )
+			stats_.maxAckTime = ackTime;
+
+		stats_.ackLatency.add( ackTime );
+	}
+
+	if ( ready & DEADLINE_READY ) { // runOnce() will answer the late events and rearm the timer
+		uint64_t expirations;
+
+		if ( read( deadlineFd_, &expirations, sizeof( expirations ) ) < 0 && errno != EAGAIN )
+			throw Exception( "[Xen events] failed to read the handler deadline timer" );
+
+		deadlineArmed_ = false;
+	}
+
+	if ( ready & NOTIFY_READY ) { // runOnce() will flush the put off notification
+		uint64_t expirations;
+
+		if ( read( notifyFd_, &expirations, sizeof( expirations ) ) < 0 && errno != EAGAIN )
+			throw Exception( "[Xen events] failed to read the notification timer" );
 	}
 #endif
 
-	// shouldn't be here
-	throw Exception( "[Xen events] error getting event" );
+	return port;
 }
 
 void XenEventManager::getRequest( mem_event_request_t *req )
@@ -821,9 +2406,10 @@ void XenEventManager::getRequest( mem_event_request_t *req )
 	memcpy( req, RING_GET_REQUEST( back_ring, req_cons ), sizeof( *req ) );
 	++req_cons;
 
-	/* Update ring */
+	BDVMI_TRACE3( request, domain_, req->vcpu_id, req->reason );
+
+	/* Update ring (req_event gets updated once per batch, in drainRing()) */
 	back_ring->req_cons = req_cons;
-	back_ring->sring->req_event = req_cons + 1;
 }
 
 void XenEventManager::putResponse( mem_event_response_t *rsp )
@@ -838,27 +2424,191 @@ void XenEventManager::putResponse( mem_event_response_t *rsp )
 	memcpy( RING_GET_RESPONSE( back_ring, rsp_prod ), rsp, sizeof( *rsp ) );
 	++rsp_prod;
 
-	/* Update ring */
+	if ( rsp->flags & MEM_EVENT_FLAG_VCPU_PAUSED )
+		pausedResponses_ = true;
+
+	/* Update ring (responses only become visible to Xen in resumePages()) */
 	back_ring->rsp_prod_pvt = rsp_prod;
-	RING_PUSH_RESPONSES( back_ring );
 }
 
-void XenEventManager::resumePage( mem_event_response_t *rsp )
+#ifdef ZERO_COPY_RING
+
+mem_event_response_t *XenEventManager::getRequestInPlace()
+{
+	mem_event_back_ring_t *back_ring = &backRing_;
+
+	mem_event_request_t *req = RING_GET_REQUEST( back_ring, back_ring->req_cons );
+	mem_event_response_t *rsp = RING_GET_RESPONSE( back_ring, back_ring->rsp_prod_pvt );
+
+	++back_ring->req_cons;
+
+	BDVMI_TRACE3( request, domain_, req->vcpu_id, req->reason );
+
+	/*
+	   Requests are answered in order, so the response slot is normally the request
+	   slot itself and the response gets built right on top of the request.
+	*/
+	if ( rsp != req )
+		memcpy( rsp, req, sizeof( *rsp ) );
+
+	return rsp;
+}
+
+void XenEventManager::putResponseInPlace()
+{
+	/* The response is already in its slot, just claim it */
+	if ( RING_GET_RESPONSE( &backRing_, backRing_.rsp_prod_pvt )->flags & MEM_EVENT_FLAG_VCPU_PAUSED )
+		pausedResponses_ = true;
+
+	++backRing_.rsp_prod_pvt;
+}
+
+#endif // ZERO_COPY_RING
+
+void XenEventManager::resumePages( bool flush )
 {
-	/* Put the page info on the ring */
-	putResponse( rsp );
+	int notify = 0;
+
+	/* Put all the responses queued so far on the ring */
+	RING_PUSH_RESPONSES_AND_CHECK_NOTIFY( &backRing_, notify );
+
+	BDVMI_TRACE3( resume_pages, domain_, backRing_.rsp_prod_pvt, notify );
+
+	uint64_t pushed = nowNs();
+
+	if ( !arrivals_.empty() ) {
+		std::vector<uint64_t>::const_iterator i = arrivals_.begin();
+
+		for ( ; i != arrivals_.end(); ++i )
+			stats_.responseTime.add( pushed - *i );
+
+		stats_.batchSizes.add( arrivals_.size() );
+		arrivals_.clear();
+	}
+
+	/*
+	   Nobody is waiting on responses to async events, Xen only needs their ring slots
+	   back before the ring fills up, so they can ride along with the next notification.
+	   If there isn't one within NOTIFY_DELAY_NS, the notify timer makes runOnce() flush them.
+	*/
+	if ( !flush && !pausedResponses_ && !stop_ && notifyFd_ >= 0 &&
+	     backRing_.rsp_prod_pvt - resumedUpTo_ < RING_SIZE( &backRing_ ) / 2 ) {
+		pendingNotify_ = pendingNotify_ || notify;
+
+		if ( !deferredNs_ ) {
+			if ( !armTimer( notifyFd_, pushed + NOTIFY_DELAY_NS ) )
+				throw Exception( "[Xen events] could not arm the notification timer" );
+
+			deferredNs_ = pushed;
+		}
+
+		return;
+	}
+
+	notify = notify || pendingNotify_;
+	pausedResponses_ = false;
+	pendingNotify_ = false;
+	resumedUpTo_ = backRing_.rsp_prod_pvt;
+	deferredNs_ = 0; // the timer may still go off once, that's harmless
+
+	if ( localRing_ ) {
+		if ( notify ) {
+			notifyLocalRing();
+			stats_.notifyTime.add( nowNs() - pushed );
+		}
+
+		return;
+	}
 
-/* Tell Xen page is ready */
+/* Tell Xen the pages are ready */
 #if __XEN_LATEST_INTERFACE_VERSION__ == 0x00040500
 	xc_mem_access_resume( xci_, domain_ );
 #elif __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
-// xc_monitor_resume(xci_, domain_);
+	// xc_monitor_resume(xci_, domain_);
 #else
-	xc_mem_access_resume( xci_, domain_, rsp->gfn );
+	// Xen 4.4 drains all the pending responses, the GFN is not used to filter them
+	xc_mem_access_resume( xci_, domain_, RING_GET_RESPONSE( &backRing_, backRing_.rsp_prod_pvt - 1 )->gfn );
 #endif
 
+	// Only kick the event channel if Xen is not already going to look at the ring
+	if ( !notify )
+		return;
+
 	if ( xc_evtchn_notify( xce_, port_ ) < 0 )
 		throw Exception( "[Xen events] error resuming page" );
+
+	stats_.notifyTime.add( nowNs() - pushed );
+}
+
+void XenEventManager::watchLocalRing( int fd )
+{
+	if ( !localRing_ || localRingFd_ >= 0 )
+		throw Exception( "[Xen events] only one local ring notification fd is supported" );
+
+	localRingFd_ = fd;
+	poller_.add( fd, LOCAL_RING_READY );
+}
+
+void XenEventManager::requestRegisters( const mem_event_request_t &req, Registers &regs )
+{
+	copyRegisters( regs, req );
+}
+
+void XenEventManager::pageFaultRequest( mem_event_request_t &req, unsigned short vcpu, const Registers &regs,
+                                        uint64_t gpa, uint64_t gla, bool write, bool execute )
+{
+	initRequest( req, vcpu, regs );
+
+	req.reason = MEM_EVENT_REASON_VIOLATION;
+	GFN( req ) = gpa >> XC_PAGE_SHIFT;
+	OFFSET( req ) = gpa & ( XC_PAGE_SIZE - 1 );
+	GLA( req ) = gla;
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+	req.u.mem_access.flags = MEM_ACCESS_GLA_VALID | MEM_ACCESS_FAULT_WITH_GLA |
+	                         ( write ? MEM_ACCESS_W : ( execute ? MEM_ACCESS_X : MEM_ACCESS_R ) );
+#else
+	req.gla_valid = 1;
+	req.access_r = !write && !execute;
+	req.access_w = write;
+	req.access_x = !write && execute;
+#endif
+}
+
+void XenEventManager::crRequest( mem_event_request_t &req, unsigned short vcpu, const Registers &regs,
+                                 unsigned short crNumber, uint64_t oldValue, uint64_t newValue )
+{
+	initRequest( req, vcpu, regs );
+
+#if __XEN_LATEST_INTERFACE_VERSION__ >= 0x00040600
+	req.reason = VM_EVENT_REASON_WRITE_CTRLREG;
+	req.u.write_ctrlreg.index =
+	        ( crNumber == 0 ) ? VM_EVENT_X86_CR0 : ( crNumber == 4 ) ? VM_EVENT_X86_CR4 : VM_EVENT_X86_CR3;
+#else
+	req.reason = ( crNumber == 0 ) ? MEM_EVENT_REASON_CR0 :
+	             ( crNumber == 4 ) ? MEM_EVENT_REASON_CR4 : MEM_EVENT_REASON_CR3;
+#endif
+	CR_OLD_VALUE( req ) = oldValue;
+	CR_NEW_VALUE( req ) = newValue;
+}
+
+void XenEventManager::msrRequest( mem_event_request_t &req, unsigned short vcpu, const Registers &regs, uint32_t msr,
+                                  uint64_t value )
+{
+	initRequest( req, vcpu, regs );
+
+	req.reason = MEM_EVENT_REASON_MSR;
+	MSR_TYPE( req ) = msr;
+	MSR_VALUE( req ) = value;
+}
+
+void XenEventManager::vmcallRequest( mem_event_request_t &req, unsigned short vcpu, const Registers &regs )
+{
+	initRequest( req, vcpu, regs );
+
+	req.reason = MEM_EVENT_REASON_VMCALL;
+	VMCALL_RIP( req ) = regs.rip;
+	VMCALL_RAX( req ) = regs.rax;
 }
 
 std::string XenEventManager::uuid()
@@ -0,0 +1,260 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/exception.h"
+#include "bdvmi/loghelper.h"
+#include "bdvmi/eventmanager.h"
+#include "bdvmi/xeneventreactor.h"
+#include <algorithm>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define LOG_ERROR( x )                                                                                                 \
+	{                                                                                                              \
+		if ( logHelper_ )                                                                                      \
+			logHelper_->error( x );                                                                        \
+	}
+
+namespace bdvmi {
+
+// EventPoller id
+enum { MANAGERS_READY = 1 };
+
+XenEventReactor::XenEventReactor( unsigned int batchBudget, LogHelper *logHelper )
+    : batchBudget_( batchBudget ), logHelper_( logHelper ), managersFd_( -1 ), sigStop_( NULL ), stop_( false ),
+      running_( false )
+{
+	managersFd_ = epoll_create1( EPOLL_CLOEXEC );
+
+	if ( managersFd_ < 0 )
+		throw Exception( "[Xen reactor] epoll_create1() failed" );
+
+	try {
+		poller_.add( managersFd_, MANAGERS_READY );
+
+	} catch ( ... ) {
+		close( managersFd_ );
+		throw;
+	}
+
+	pthread_mutex_init( &lock_, NULL );
+	pthread_cond_init( &detached_, NULL );
+}
+
+XenEventReactor::~XenEventReactor()
+{
+	pthread_cond_destroy( &detached_ );
+	pthread_mutex_destroy( &lock_ );
+
+	close( managersFd_ );
+}
+
+void XenEventReactor::add( EventManager *em )
+{
+	pthread_mutex_lock( &lock_ );
+	adds_.push_back( em );
+	pthread_mutex_unlock( &lock_ );
+
+	poller_.wakeUp();
+}
+
+void XenEventReactor::remove( EventManager *em )
+{
+	pthread_mutex_lock( &lock_ );
+
+	if ( !running_ || pthread_equal( thread_, pthread_self() ) ) {
+		adds_.erase( std::remove( adds_.begin(), adds_.end(), em ), adds_.end() );
+		detach( em );
+
+		pthread_mutex_unlock( &lock_ );
+		return;
+	}
+
+	removes_.push_back( em );
+	poller_.wakeUp();
+
+	while ( std::find( removes_.begin(), removes_.end(), em ) != removes_.end() )
+		pthread_cond_wait( &detached_, &lock_ );
+
+	pthread_mutex_unlock( &lock_ );
+}
+
+void XenEventReactor::stop()
+{
+	stop_ = true;
+	poller_.wakeUp();
+}
+
+void XenEventReactor::run()
+{
+	pthread_mutex_lock( &lock_ );
+	running_ = true;
+	thread_ = pthread_self();
+	pthread_mutex_unlock( &lock_ );
+
+	try {
+		for ( ;; ) {
+			int timeout = -1;
+
+			if ( !ready_.empty() )
+				timeout = 0; // there's still work left from the last round
+			else if ( sigStop_ && !poller_.watchingSignals() )
+				timeout = 100;
+
+			unsigned int ready = poller_.wait( timeout );
+
+			if ( ( ready & EventPoller::STOP_SIGNAL ) || ( sigStop_ && *sigStop_ ) )
+				stop_ = true;
+
+			adoptChanges();
+
+			if ( stop_ )
+				stopManagers();
+
+			if ( ready & MANAGERS_READY )
+				collectReady();
+
+			serviceReady();
+
+			if ( stop_ && managers_.empty() )
+				break;
+		}
+
+	} catch ( ... ) {
+		pthread_mutex_lock( &lock_ );
+		running_ = false;
+		pthread_cond_broadcast( &detached_ );
+		pthread_mutex_unlock( &lock_ );
+		throw;
+	}
+
+	pthread_mutex_lock( &lock_ );
+	running_ = false;
+	removes_.clear(); // all the managers are gone by now
+	pthread_cond_broadcast( &detached_ );
+	pthread_mutex_unlock( &lock_ );
+}
+
+void XenEventReactor::adoptChanges()
+{
+	pthread_mutex_lock( &lock_ );
+
+	std::vector<EventManager *>::const_iterator i = adds_.begin();
+
+	for ( ; i != adds_.end(); ++i ) {
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = *i;
+
+		if ( !managers_.insert( *i ).second )
+			continue;
+
+		if ( epoll_ctl( managersFd_, EPOLL_CTL_ADD, ( *i )->pollFd(), &ev ) != 0 ) {
+			managers_.erase( *i );
+			LOG_ERROR( "[Xen reactor] could not watch a new domain" );
+			continue;
+		}
+
+		// Requests might have piled up before the reactor started watching
+		queue( *i );
+	}
+
+	adds_.clear();
+
+	for ( i = removes_.begin(); i != removes_.end(); ++i )
+		detach( *i );
+
+	if ( !removes_.empty() ) {
+		removes_.clear();
+		pthread_cond_broadcast( &detached_ );
+	}
+
+	pthread_mutex_unlock( &lock_ );
+}
+
+void XenEventReactor::collectReady()
+{
+	struct epoll_event events[64];
+
+	int rc = epoll_wait( managersFd_, events, sizeof( events ) / sizeof( events[0] ), 0 );
+
+	for ( int i = 0; i < rc; ++i )
+		queue( static_cast<EventManager *>( events[i].data.ptr ) );
+}
+
+void XenEventReactor::serviceReady()
+{
+	// Only the managers queued so far, the requeued ones wait for the next round
+	size_t count = ready_.size();
+
+	while ( count-- ) {
+		EventManager *em = ready_.front();
+		bool alive = false;
+
+		ready_.pop_front();
+		queued_.erase( em );
+
+		try {
+			alive = em->processPending( batchBudget_ );
+
+		} catch ( const std::exception &e ) {
+			LOG_ERROR( std::string( "[Xen reactor] dropping domain: " ) + e.what() );
+
+			try {
+				em->stop();
+
+			} catch ( ... ) {
+				// Nothing more to do for this one
+			}
+		}
+
+		if ( !alive ) {
+			detach( em );
+			continue;
+		}
+
+		if ( em->hasPendingEvents() )
+			queue( em );
+	}
+}
+
+void XenEventReactor::queue( EventManager *em )
+{
+	if ( queued_.insert( em ).second )
+		ready_.push_back( em );
+}
+
+void XenEventReactor::detach( EventManager *em )
+{
+	if ( managers_.erase( em ) == 0 )
+		return;
+
+	struct epoll_event ev; // kernels before 2.6.9 want a non-NULL pointer
+	epoll_ctl( managersFd_, EPOLL_CTL_DEL, em->pollFd(), &ev );
+
+	if ( queued_.erase( em ) )
+		ready_.erase( std::find( ready_.begin(), ready_.end(), em ) );
+}
+
+void XenEventReactor::stopManagers()
+{
+	std::set<EventManager *>::const_iterator i = managers_.begin();
+
+	for ( ; i != managers_.end(); ++i )
+		( *i )->stop(); // wakes the manager up, so it'll get its last round (no-op if already stopped)
+}
+
+} // namespace bdvmi
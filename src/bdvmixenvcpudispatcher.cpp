@@ -0,0 +1,135 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/exception.h"
+#include "bdvmi/xenvcpudispatcher.h"
+#include "xenpendingevent.h"
+
+namespace bdvmi {
+
+XenVcpuDispatcher::XenVcpuDispatcher( XenEventManager &manager, XenCompletionQueue &completions,
+                                      unsigned int workers )
+    : manager_( manager ), completions_( completions )
+{
+	for ( unsigned int i = 0; i < workers; ++i ) {
+		Worker *w = new Worker( this );
+
+		pthread_mutex_init( &w->lock, NULL );
+		pthread_cond_init( &w->cond, NULL );
+
+		if ( pthread_create( &w->thread, NULL, workerMain, w ) != 0 ) {
+			pthread_cond_destroy( &w->cond );
+			pthread_mutex_destroy( &w->lock );
+			delete w;
+
+			stopWorkers();
+			throw Exception( "[Xen events] could not start dispatch thread" );
+		}
+
+		workers_.push_back( w );
+	}
+}
+
+XenVcpuDispatcher::~XenVcpuDispatcher()
+{
+	stopWorkers();
+}
+
+void XenVcpuDispatcher::dispatch( XenPendingEvent *ev )
+{
+	Worker *w = workers_[ev->req.vcpu_id % workers_.size()];
+
+	pthread_mutex_lock( &w->lock );
+
+	w->queue.push_back( ev );
+
+	if ( w->queue.size() == 1 )
+		pthread_cond_signal( &w->cond );
+
+	pthread_mutex_unlock( &w->lock );
+}
+
+void XenVcpuDispatcher::statistics( EventStatistics &stats ) const
+{
+	std::vector<Worker *>::const_iterator i = workers_.begin();
+
+	for ( ; i != workers_.end(); ++i )
+		stats.merge( ( *i )->stats );
+}
+
+void XenVcpuDispatcher::stopWorkers()
+{
+	std::vector<Worker *>::iterator i = workers_.begin();
+
+	for ( ; i != workers_.end(); ++i ) {
+		pthread_mutex_lock( &( *i )->lock );
+		( *i )->quit = true;
+		pthread_cond_signal( &( *i )->cond );
+		pthread_mutex_unlock( &( *i )->lock );
+	}
+
+	for ( i = workers_.begin(); i != workers_.end(); ++i ) {
+		pthread_join( ( *i )->thread, NULL );
+
+		// Don't lose what the worker has been counting
+		manager_.stats_.merge( ( *i )->stats );
+
+		pthread_cond_destroy( &( *i )->cond );
+		pthread_mutex_destroy( &( *i )->lock );
+		delete *i;
+	}
+
+	workers_.clear();
+}
+
+void *XenVcpuDispatcher::workerMain( void *arg )
+{
+	Worker *w = static_cast<Worker *>( arg );
+	Registers regs; // this thread's storage for materializing event registers
+
+	for ( ;; ) {
+		pthread_mutex_lock( &w->lock );
+
+		while ( w->queue.empty() && !w->quit )
+			pthread_cond_wait( &w->cond, &w->lock );
+
+		if ( w->queue.empty() ) { // quit, and nothing left to do
+			pthread_mutex_unlock( &w->lock );
+			break;
+		}
+
+		XenPendingEvent *ev = w->queue.front();
+		w->queue.pop_front();
+
+		pthread_mutex_unlock( &w->lock );
+
+		bool ready = true;
+
+		try {
+			ready = w->dispatcher->manager_.handleEvent( *ev, regs, w->stats );
+
+		} catch ( ... ) {
+			// Still answer the event (with whatever the response holds), or the VCPU stays paused
+		}
+
+		// Deferred events get pushed by XenEventManager::completeResponse()
+		if ( ready )
+			w->dispatcher->completions_.push( ev );
+	}
+
+	return NULL;
+}
+
+} // namespace bdvmi
@@ -0,0 +1,46 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMICLOCK_H_INCLUDED__
+#define __BDVMICLOCK_H_INCLUDED__
+
+#include <stdint.h>
+#include <time.h>
+
+namespace bdvmi {
+
+// CLOCK_MONOTONIC, in nanoseconds
+inline uint64_t nowNs()
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return static_cast<uint64_t>( ts.tv_sec ) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Same, at tick resolution, for when nowNs() would cost too much
+inline uint64_t coarseNowNs()
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+
+	return static_cast<uint64_t>( ts.tv_sec ) * 1000000000ULL + ts.tv_nsec;
+}
+
+} // namespace bdvmi
+
+#endif // __BDVMICLOCK_H_INCLUDED__
@@ -0,0 +1,49 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMISCOPEDLOCK_H_INCLUDED__
+#define __BDVMISCOPEDLOCK_H_INCLUDED__
+
+#include <pthread.h>
+
+namespace bdvmi {
+
+// Holds a pthread mutex for the lifetime of the object, so early returns and
+// exceptions (std::bad_alloc out of the std::map members) can't leave it locked.
+class ScopedLock {
+
+public:
+	explicit ScopedLock( pthread_mutex_t &lock ) : lock_( lock )
+	{
+		pthread_mutex_lock( &lock_ );
+	}
+
+	~ScopedLock()
+	{
+		pthread_mutex_unlock( &lock_ );
+	}
+
+private:
+	// Don't allow copying
+	ScopedLock( const ScopedLock & );
+	ScopedLock &operator=( const ScopedLock & );
+
+private:
+	pthread_mutex_t &lock_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMISCOPEDLOCK_H_INCLUDED__
@@ -0,0 +1,57 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+#ifndef __BDVMITRACEPOINTS_H_INCLUDED__
+#define __BDVMITRACEPOINTS_H_INCLUDED__
+
+/*
+ * Static user-space (USDT) probes on the hot paths, provider "bdvmi". Built with
+ * ./configure --enable-usdt they're a NOP each until a tracer attaches (bpftrace, perf,
+ * SystemTap), otherwise they compile to nothing and their arguments aren't even evaluated.
+ * List them with `bpftrace -l 'usdt:/path/to/libbdvmi.so:*'`.
+ *
+ *   request( domain, vcpu, reason )                  a request has been taken off the ring
+ *   handler_entry( domain, vcpu, type )              about to call the EventHandler (type is
+ *   handler_return( domain, vcpu, type, action )     an EventStatistics::EventType)
+ *   resume_pages( domain, rsp_prod, notify )         the responses up to rsp_prod pushed on the ring
+ *   cache_miss( domain, gfn )                        XenPageCache lookups that need a mapping
+ *   cache_map( domain, gfn, pointer )                ... and their result (NULL on failure)
+ *   cache_evict( domain, gfn )                       a page unmapped by XenPageCache::cleanup()
+ *   translate( domain, vcpu, gva, gfn, cached )      XenDriver guest virtual address translation
+ *   hypercall( domain, name )                        XenDriver about to call the libxc function name
+ *   deadline_miss( domain, vcpu, type )              an event answered with the handler deadline fallback
+ *   governor( domain, level )                        the overhead governor changed the monitoring level
+ */
+
+#ifdef ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define BDVMI_TRACE2( name, a1, a2 ) DTRACE_PROBE2( bdvmi, name, a1, a2 )
+#define BDVMI_TRACE3( name, a1, a2, a3 ) DTRACE_PROBE3( bdvmi, name, a1, a2, a3 )
+#define BDVMI_TRACE4( name, a1, a2, a3, a4 ) DTRACE_PROBE4( bdvmi, name, a1, a2, a3, a4 )
+#define BDVMI_TRACE5( name, a1, a2, a3, a4, a5 ) DTRACE_PROBE5( bdvmi, name, a1, a2, a3, a4, a5 )
+
+#else
+
+// sizeof() keeps the arguments "used" without evaluating them
+#define BDVMI_TRACE2( name, a1, a2 ) do { ( void )sizeof( a1 ); ( void )sizeof( a2 ); } while ( 0 )
+#define BDVMI_TRACE3( name, a1, a2, a3 ) do { BDVMI_TRACE2( name, a1, a2 ); ( void )sizeof( a3 ); } while ( 0 )
+#define BDVMI_TRACE4( name, a1, a2, a3, a4 ) do { BDVMI_TRACE3( name, a1, a2, a3 ); ( void )sizeof( a4 ); } while ( 0 )
+#define BDVMI_TRACE5( name, a1, a2, a3, a4, a5 ) \
+	do { BDVMI_TRACE4( name, a1, a2, a3, a4 ); ( void )sizeof( a5 ); } while ( 0 )
+
+#endif // ENABLE_USDT
+
+#endif // __BDVMITRACEPOINTS_H_INCLUDED__
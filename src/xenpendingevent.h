@@ -0,0 +1,54 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIXENPENDINGEVENT_H_INCLUDED__
+#define __BDVMIXENPENDINGEVENT_H_INCLUDED__
+
+#include "bdvmi/xeneventmanager.h"
+
+namespace bdvmi {
+
+// A request copied out of the ring, so that it can be handled away from it
+struct XenPendingEvent {
+	XenPendingEvent()
+	    : next( NULL ), handler( NULL ), handlerFlags( 0 ), preEventHook( false ), generation( 0 ),
+	      cacheable( false ), action( NONE ), instructionSize( 0 ), tsc( 0 ), arrivalNs( 0 ), serial( 0 ),
+	      expired( false )
+	{
+	}
+
+	XenPendingEvent *next; // XenCompletionQueue link
+	mem_event_request_t req;
+	mem_event_response_t rsp;
+	// What the event loop was set up with when the event got dispatched, so that worker threads
+	// never read the manager's own copies while the event loop thread changes them
+	EventHandler *handler;
+	unsigned short handlerFlags;
+	bool preEventHook;
+	// The decision to remember once the response gets back to the event loop (see cacheDecision()),
+	// unless decisionsGeneration() has moved on from generation since the event got dispatched
+	unsigned int generation;
+	bool cacheable;
+	HVAction action;
+	unsigned short instructionSize;
+	uint64_t tsc;       // when it was taken off the ring (see traceEvents())
+	uint64_t arrivalNs; // same, for EventStatistics::responseTime
+	uint64_t serial;    // tells reused events apart (0 while on the free list)
+	bool expired;       // answered on the handler's behalf (see handlerDeadline())
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIXENPENDINGEVENT_H_INCLUDED__
@@ -0,0 +1,53 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+
+#ifndef __BDVMICHECK_H_INCLUDED__
+#define __BDVMICHECK_H_INCLUDED__
+
+#include <cstdio>
+
+/*
+ * Minimal test harness for make check: CHECK() reports a failed condition (and keeps going),
+ * main() returns checkResult(), 0 if nothing failed.
+ */
+
+namespace {
+
+unsigned int checkFailures = 0;
+
+void checkFailed( const char *file, int line, const char *condition )
+{
+	std::fprintf( stderr, "%s:%d: check failed: %s\n", file, line, condition );
+	++checkFailures;
+}
+
+int checkResult()
+{
+	if ( checkFailures )
+		std::fprintf( stderr, "%u check(s) failed\n", checkFailures );
+
+	return checkFailures ? 1 : 0;
+}
+
+} // end of anonymous namespace
+
+#define CHECK( condition )                                                                                             \
+	do {                                                                                                           \
+		if ( !( condition ) )                                                                                  \
+			checkFailed( __FILE__, __LINE__, #condition );                                                 \
+	} while ( 0 )
+
+#endif // __BDVMICHECK_H_INCLUDED__
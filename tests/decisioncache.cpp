@@ -0,0 +1,186 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+
+#include <bdvmi/decisioncache.h>
+#include <cstdlib>
+#include <list>
+#include "check.h"
+
+using namespace bdvmi;
+
+namespace { // Anonymous namespace
+
+struct Entry {
+	uint64_t gfn;
+	uint64_t rip;
+	unsigned int access;
+	HVAction action;
+	unsigned short instructionSize;
+};
+
+// The cache as a plain list, most recently used first
+class Model {
+
+public:
+	Model( size_t maxEntries ) : maxEntries_( maxEntries )
+	{
+	}
+
+	bool find( uint64_t gfn, uint64_t rip, unsigned int access, HVAction &action, unsigned short &instructionSize )
+	{
+		std::list<Entry>::iterator i = lookup( gfn, rip, access );
+
+		if ( i == entries_.end() )
+			return false;
+
+		entries_.splice( entries_.begin(), entries_, i );
+		action = i->action;
+		instructionSize = i->instructionSize;
+
+		return true;
+	}
+
+	void insert( uint64_t gfn, uint64_t rip, unsigned int access, HVAction action, unsigned short instructionSize )
+	{
+		std::list<Entry>::iterator i = lookup( gfn, rip, access );
+
+		if ( i != entries_.end() )
+			entries_.erase( i );
+		else if ( entries_.size() == maxEntries_ )
+			entries_.pop_back();
+
+		Entry e = { gfn, rip, access, action, instructionSize };
+		entries_.push_front( e );
+	}
+
+	void clear()
+	{
+		entries_.clear();
+	}
+
+	size_t size() const
+	{
+		return entries_.size();
+	}
+
+private:
+	std::list<Entry>::iterator lookup( uint64_t gfn, uint64_t rip, unsigned int access )
+	{
+		for ( std::list<Entry>::iterator i = entries_.begin(); i != entries_.end(); ++i )
+			if ( i->gfn == gfn && i->rip == rip && i->access == access )
+				return i;
+
+		return entries_.end();
+	}
+
+private:
+	size_t maxEntries_;
+	std::list<Entry> entries_;
+};
+
+void testLru()
+{
+	DecisionCache cache( 3 );
+	HVAction action = NONE;
+	unsigned short instructionSize = 0;
+
+	cache.insert( 1, 0x10, 2, EMULATE_NOWRITE, 3 );
+	cache.insert( 2, 0x10, 2, NONE, 0 );
+	cache.insert( 3, 0x10, 2, NONE, 0 );
+	CHECK( cache.size() == 3 );
+
+	// Touching 1 makes 2 the oldest
+	CHECK( cache.find( 1, 0x10, 2, action, instructionSize ) );
+	CHECK( action == EMULATE_NOWRITE && instructionSize == 3 );
+
+	cache.insert( 4, 0x10, 2, NONE, 0 );
+	CHECK( cache.size() == 3 );
+	CHECK( !cache.find( 2, 0x10, 2, action, instructionSize ) );
+	CHECK( cache.find( 1, 0x10, 2, action, instructionSize ) );
+	CHECK( cache.find( 3, 0x10, 2, action, instructionSize ) );
+	CHECK( cache.find( 4, 0x10, 2, action, instructionSize ) );
+
+	// The whole key has to match
+	CHECK( !cache.find( 1, 0x11, 2, action, instructionSize ) );
+	CHECK( !cache.find( 1, 0x10, 1, action, instructionSize ) );
+
+	// Inserting an existing key updates it (and doesn't evict anything)
+	cache.insert( 1, 0x10, 2, ALLOW_VIRTUAL, 5 );
+	CHECK( cache.size() == 3 );
+	CHECK( cache.find( 1, 0x10, 2, action, instructionSize ) );
+	CHECK( action == ALLOW_VIRTUAL && instructionSize == 5 );
+
+	cache.clear();
+	CHECK( cache.size() == 0 );
+	CHECK( !cache.find( 1, 0x10, 2, action, instructionSize ) );
+
+	cache.insert( 5, 0x10, 2, NONE, 0 );
+	CHECK( cache.find( 5, 0x10, 2, action, instructionSize ) );
+}
+
+// Random operations on a few keys more than fit, so entries keep getting recycled and unlinked
+// from the middle of hash chains
+void testRandom( size_t maxEntries, unsigned int keys )
+{
+	const HVAction actions[] = { NONE, EMULATE_NOWRITE, ALLOW_VIRTUAL };
+
+	DecisionCache cache( maxEntries );
+	Model model( maxEntries );
+
+	for ( unsigned int i = 0; i < 200000; ++i ) {
+		unsigned int key = std::rand() % keys;
+		uint64_t gfn = key / 4;
+		uint64_t rip = 0x1000 + ( key % 2 );
+		unsigned int access = 1 + ( key / 2 ) % 2;
+		unsigned int op = std::rand() % 100;
+
+		if ( op < 45 ) {
+			HVAction action = actions[std::rand() % 3];
+			unsigned short instructionSize = std::rand() % 16;
+
+			cache.insert( gfn, rip, access, action, instructionSize );
+			model.insert( gfn, rip, access, action, instructionSize );
+
+		} else if ( op < 99 ) {
+			HVAction action = NONE, expectedAction = NONE;
+			unsigned short instructionSize = 0, expectedSize = 0;
+			bool expected = model.find( gfn, rip, access, expectedAction, expectedSize );
+
+			CHECK( cache.find( gfn, rip, access, action, instructionSize ) == expected );
+			CHECK( !expected || ( action == expectedAction && instructionSize == expectedSize ) );
+
+		} else {
+			cache.clear();
+			model.clear();
+		}
+
+		CHECK( cache.size() == model.size() );
+	}
+}
+
+} // end of anonymous namespace
+
+int main()
+{
+	std::srand( 1 );
+
+	testLru();
+	testRandom( 1, 4 );
+	testRandom( 7, 16 );
+	testRandom( 64, 96 );
+
+	return checkResult();
+}
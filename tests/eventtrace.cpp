@@ -0,0 +1,156 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+
+#include <bdvmi/eventtrace.h>
+#include <bdvmi/exception.h>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+#include "check.h"
+
+using namespace bdvmi;
+
+namespace { // Anonymous namespace
+
+enum { INTERFACE_VERSION = 0x00040700, REQUEST_SIZE = 100, RESPONSE_SIZE = 60, RECORDS = 1000 };
+
+// Every record's request and response are filled with bytes derived from its TSC
+void fill( unsigned char *buffer, size_t size, uint64_t tsc, unsigned char salt )
+{
+	for ( size_t i = 0; i < size; ++i )
+		buffer[i] = static_cast<unsigned char>( tsc * 31 + i + salt );
+}
+
+bool filled( const void *buffer, size_t size, uint64_t tsc, unsigned char salt )
+{
+	unsigned char expected[REQUEST_SIZE];
+
+	fill( expected, size, tsc, salt );
+
+	return !memcmp( buffer, expected, size );
+}
+
+bool readerThrows( const std::string &path, uint32_t interfaceVersion, uint32_t requestSize, uint32_t responseSize )
+{
+	try {
+		EventTraceReader reader( path, interfaceVersion, requestSize, responseSize );
+	} catch ( const Exception & ) {
+		return true;
+	}
+
+	return false;
+}
+
+void checkRecords( const EventTraceReader &reader )
+{
+	CHECK( reader.size() == RECORDS );
+
+	for ( size_t i = 0; i < reader.size(); ++i ) {
+		const EventTraceRecord &record = reader.record( i );
+
+		// Appended out of order, read back sorted
+		CHECK( record.tsc == 1000 + i );
+		CHECK( record.size % 8 == 0 && record.size >= sizeof( EventTraceRecord ) + REQUEST_SIZE + RESPONSE_SIZE );
+		CHECK( record.latency == record.tsc * 3 );
+		CHECK( record.flags == ( record.tsc % 3 ) );
+		CHECK( filled( reader.request( i ), REQUEST_SIZE, record.tsc, 1 ) );
+		CHECK( filled( reader.response( i ), RESPONSE_SIZE, record.tsc, 2 ) );
+	}
+}
+
+void testRoundTrip( const std::string &path )
+{
+	{
+		// A small chunk size, so the file has to grow a few times
+		EventTrace trace( path, INTERFACE_VERSION, REQUEST_SIZE, RESPONSE_SIZE, 2400000000ULL, 4096 );
+		unsigned char request[REQUEST_SIZE], response[RESPONSE_SIZE];
+
+		for ( uint64_t i = 0; i < RECORDS; ++i ) {
+			uint64_t tsc = 1000 + ( i * 7919 ) % RECORDS;
+
+			fill( request, sizeof( request ), tsc, 1 );
+			fill( response, sizeof( response ), tsc, 2 );
+
+			CHECK( trace.append( tsc, tsc * 3, tsc % 3, request, response ) );
+		}
+
+		trace.tick();
+		CHECK( trace.dropped() == 0 );
+
+		// The records are there before the header's been brought up to date
+		EventTraceReader reader( path, INTERFACE_VERSION, REQUEST_SIZE, RESPONSE_SIZE );
+		checkRecords( reader );
+	}
+
+	EventTraceReader reader( path, INTERFACE_VERSION, REQUEST_SIZE, RESPONSE_SIZE );
+	const EventTraceHeader &header = reader.header();
+
+	CHECK( !memcmp( header.magic, BDVMI_EVENT_TRACE_MAGIC, sizeof( header.magic ) ) );
+	CHECK( header.version == EVENT_TRACE_VERSION );
+	CHECK( header.headerSize >= sizeof( EventTraceHeader ) );
+	CHECK( header.interfaceVersion == INTERFACE_VERSION );
+	CHECK( header.requestSize == REQUEST_SIZE && header.responseSize == RESPONSE_SIZE );
+	CHECK( header.tscSpeed == 2400000000ULL );
+	CHECK( header.records == RECORDS && header.dropped == 0 );
+	CHECK( header.dataSize == RECORDS * static_cast<uint64_t>( reader.record( 0 ).size ) );
+
+	checkRecords( reader );
+
+	CHECK( readerThrows( path, INTERFACE_VERSION + 1, REQUEST_SIZE, RESPONSE_SIZE ) );
+	CHECK( readerThrows( path, INTERFACE_VERSION, REQUEST_SIZE + 8, RESPONSE_SIZE ) );
+	CHECK( readerThrows( path, INTERFACE_VERSION, REQUEST_SIZE, RESPONSE_SIZE - 8 ) );
+}
+
+void testNotATrace( const std::string &path )
+{
+	FILE *f = fopen( path.c_str(), "w" );
+
+	CHECK( f != NULL );
+
+	if ( f ) {
+		for ( unsigned int i = 0; i < 100; ++i )
+			fputs( "not a trace\n", f );
+
+		fclose( f );
+	}
+
+	CHECK( readerThrows( path, INTERFACE_VERSION, REQUEST_SIZE, RESPONSE_SIZE ) );
+
+	unlink( path.c_str() );
+
+	CHECK( readerThrows( path, INTERFACE_VERSION, REQUEST_SIZE, RESPONSE_SIZE ) );
+}
+
+} // end of anonymous namespace
+
+int main()
+{
+	std::ostringstream path;
+
+	path << "eventtrace." << getpid() << ".tmp";
+
+	try {
+		testRoundTrip( path.str() );
+	} catch ( const std::exception &e ) {
+		std::fprintf( stderr, "%s\n", e.what() );
+		checkFailed( __FILE__, __LINE__, "no exceptions" );
+	}
+
+	testNotATrace( path.str() );
+
+	return checkResult();
+}
@@ -0,0 +1,112 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+
+#include <bdvmi/histogram.h>
+#include <cstdlib>
+#include <vector>
+#include "check.h"
+
+using namespace bdvmi;
+
+namespace { // Anonymous namespace
+
+// The upper bound of value's bucket: with the maximum pushed out of the way, the median of
+// { value, ~0 } is reported as the first bucket's upper bound
+uint64_t upperBound( uint64_t value )
+{
+	Histogram h;
+
+	h.add( value );
+	h.add( ~0ULL );
+
+	return h.percentile( 50 );
+}
+
+void checkBucket( uint64_t value )
+{
+	uint64_t upper = upperBound( value );
+
+	CHECK( upper >= value );
+
+	if ( value < 32 )
+		CHECK( upper == value );
+	else
+		CHECK( upper - value < value / 16 ); // 16 buckets per power of two
+
+	// upper is the last value in the bucket
+	CHECK( upperBound( upper ) == upper );
+	CHECK( upper == ~0ULL || upperBound( upper + 1 ) > upper );
+}
+
+void testBuckets()
+{
+	for ( uint64_t value = 0; value < 4096; ++value )
+		checkBucket( value );
+
+	for ( unsigned int bit = 5; bit < 64; ++bit ) {
+		checkBucket( ( 1ULL << bit ) - 1 );
+		checkBucket( 1ULL << bit );
+		checkBucket( ( 1ULL << bit ) + 1 );
+	}
+
+	checkBucket( ~0ULL );
+
+	for ( unsigned int i = 0; i < 10000; ++i ) {
+		uint64_t value = ( static_cast<uint64_t>( std::rand() ) << 33 ) ^
+		                 ( static_cast<uint64_t>( std::rand() ) << 2 ) ^ std::rand();
+
+		checkBucket( value >> ( std::rand() % 64 ) );
+	}
+}
+
+void testStatistics()
+{
+	Histogram a, b;
+
+	CHECK( a.count() == 0 && a.max() == 0 && a.sum() == 0 && a.mean() == 0 );
+	CHECK( a.percentile( 50 ) == 0 );
+
+	for ( uint64_t value = 1; value <= 100; ++value )
+		a.add( value );
+
+	CHECK( a.count() == 100 && a.max() == 100 && a.sum() == 5050 && a.mean() == 50 );
+	CHECK( a.percentile( 100 ) == 100 );
+	CHECK( a.percentile( 0 ) == 1 );
+	CHECK( a.percentile( 50 ) >= 50 && a.percentile( 50 ) < 50 + 50 / 16 + 1 );
+
+	b.add( 1000000 );
+	b.merge( a );
+
+	CHECK( b.count() == 101 && b.max() == 1000000 && b.sum() == 1005050 );
+	CHECK( b.percentile( 100 ) == 1000000 );
+	CHECK( b.percentile( 50 ) == a.percentile( 50 ) );
+
+	b.clear();
+
+	CHECK( b.count() == 0 && b.max() == 0 && b.sum() == 0 && b.percentile( 99 ) == 0 );
+}
+
+} // end of anonymous namespace
+
+int main()
+{
+	std::srand( 1 );
+
+	testBuckets();
+	testStatistics();
+
+	return checkResult();
+}
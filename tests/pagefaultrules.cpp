@@ -0,0 +1,167 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+
+#include <bdvmi/pagefaultrules.h>
+#include <cstdlib>
+#include <vector>
+#include "check.h"
+
+using namespace bdvmi;
+
+namespace { // Anonymous namespace
+
+struct Rule {
+	uint64_t gfnStart;
+	uint64_t gfnEnd;
+	unsigned int access;
+	uint64_t ripStart;
+	uint64_t ripEnd;
+	uint64_t cr3;
+	HVAction action;
+};
+
+// What match() should say, straight from the rules (first one added wins)
+bool reference( const std::vector<Rule> &rules, uint64_t gfn, unsigned int access, uint64_t rip, uint64_t cr3,
+                HVAction &action )
+{
+	for ( size_t i = 0; i < rules.size(); ++i ) {
+		const Rule &r = rules[i];
+
+		if ( gfn < r.gfnStart || gfn > r.gfnEnd || ( access & ~r.access ) || rip < r.ripStart ||
+		     rip > r.ripEnd || ( r.cr3 != PageFaultRules::ANY_CR3 && r.cr3 != cr3 ) )
+			continue;
+
+		action = r.action;
+		return true;
+	}
+
+	return false;
+}
+
+void testBasics()
+{
+	PageFaultRules rules;
+	HVAction action = NONE;
+
+	CHECK( rules.empty() );
+	CHECK( !rules.add( 20, 10, PageFaultRules::ACCESS_W, 0, ~0ULL, PageFaultRules::ANY_CR3, NONE ) );
+	CHECK( !rules.add( 10, 20, 0, 0, ~0ULL, PageFaultRules::ANY_CR3, NONE ) );
+	CHECK( !rules.add( 10, 20, PageFaultRules::ACCESS_W, 0x2000, 0x1000, PageFaultRules::ANY_CR3, NONE ) );
+	CHECK( !rules.add( 10, 20, PageFaultRules::ACCESS_W, 0, ~0ULL, PageFaultRules::ANY_CR3, SKIP_INSTRUCTION ) );
+	CHECK( !rules.add( 10, 20, PageFaultRules::ACCESS_W, 0, ~0ULL, PageFaultRules::ANY_CR3, EMULATE_SET_CTXT ) );
+	CHECK( rules.empty() );
+
+	CHECK( rules.add( 10, 20, PageFaultRules::ACCESS_W, 0x1000, 0x2000, PageFaultRules::ANY_CR3, EMULATE_NOWRITE ) );
+	CHECK( rules.add( 15, 30, PageFaultRules::ACCESS_R | PageFaultRules::ACCESS_W, 0, ~0ULL, 5, ALLOW_VIRTUAL ) );
+	CHECK( rules.add( 0, ~0ULL, PageFaultRules::ACCESS_X, 0, ~0ULL, PageFaultRules::ANY_CR3, NONE ) );
+
+	// Nothing's visible before compile()
+	CHECK( !rules.match( 12, PageFaultRules::ACCESS_W, 0x1500, 0, action ) );
+
+	rules.compile();
+
+	CHECK( rules.match( 12, PageFaultRules::ACCESS_W, 0x1500, 0, action ) && action == EMULATE_NOWRITE );
+	CHECK( !rules.match( 12, PageFaultRules::ACCESS_W, 0x3000, 0, action ) );
+	// Overlap: the first rule wins where both match, the second one takes over outside its RIPs
+	CHECK( rules.match( 16, PageFaultRules::ACCESS_W, 0x1500, 5, action ) && action == EMULATE_NOWRITE );
+	CHECK( rules.match( 16, PageFaultRules::ACCESS_W, 0x3000, 5, action ) && action == ALLOW_VIRTUAL );
+	CHECK( rules.match( 25, PageFaultRules::ACCESS_R, 0x1500, 5, action ) && action == ALLOW_VIRTUAL );
+	CHECK( !rules.match( 25, PageFaultRules::ACCESS_R, 0x1500, 6, action ) );
+	CHECK( !rules.match( 31, PageFaultRules::ACCESS_W, 0x1500, 5, action ) );
+	// All of the faulting accesses need to be covered
+	CHECK( !rules.match( 12, PageFaultRules::ACCESS_R | PageFaultRules::ACCESS_X, 0x1500, 0, action ) );
+	CHECK( rules.match( ~0ULL, PageFaultRules::ACCESS_X, 0, 5, action ) && action == NONE );
+	CHECK( rules.match( 0, PageFaultRules::ACCESS_X, ~0ULL, 5, action ) && action == NONE );
+
+	rules.clear();
+	rules.compile();
+
+	CHECK( rules.empty() );
+	CHECK( !rules.match( ~0ULL, PageFaultRules::ACCESS_X, 0, 5, action ) );
+}
+
+uint64_t randomBound( uint64_t range )
+{
+	// Mostly small values, so the rules overlap, with the odd one at the very end
+	return ( std::rand() % 16 ) ? std::rand() % range : ~0ULL;
+}
+
+// Random overlapping rules, against the reference, around every segment boundary
+void testSegments()
+{
+	const HVAction actions[] = { NONE, EMULATE_NOWRITE, ALLOW_VIRTUAL };
+
+	for ( unsigned int round = 0; round < 200; ++round ) {
+		PageFaultRules rules;
+		std::vector<Rule> model;
+		std::vector<uint64_t> gfns;
+		unsigned int count = std::rand() % 12;
+
+		for ( unsigned int i = 0; i < count; ++i ) {
+			Rule r;
+
+			r.gfnStart = randomBound( 64 );
+			r.gfnEnd = r.gfnStart == ~0ULL ? ~0ULL : r.gfnStart + randomBound( 32 );
+			if ( r.gfnEnd < r.gfnStart )
+				r.gfnEnd = ~0ULL;
+			r.access = 1 + std::rand() % 7;
+			r.ripStart = std::rand() % 4;
+			r.ripEnd = r.ripStart + std::rand() % 4;
+			r.cr3 = ( std::rand() % 3 ) ? PageFaultRules::ANY_CR3 : std::rand() % 2;
+			r.action = actions[std::rand() % 3];
+
+			CHECK( rules.add( r.gfnStart, r.gfnEnd, r.access, r.ripStart, r.ripEnd, r.cr3, r.action ) );
+			model.push_back( r );
+
+			gfns.push_back( r.gfnStart );
+			gfns.push_back( r.gfnEnd );
+			if ( r.gfnStart )
+				gfns.push_back( r.gfnStart - 1 );
+			if ( r.gfnEnd != ~0ULL )
+				gfns.push_back( r.gfnEnd + 1 );
+		}
+
+		rules.compile();
+
+		gfns.push_back( 0 );
+		gfns.push_back( ~0ULL );
+		for ( unsigned int i = 0; i < 32; ++i )
+			gfns.push_back( std::rand() % 128 );
+
+		for ( size_t i = 0; i < gfns.size(); ++i )
+			for ( unsigned int access = 1; access < 8; ++access )
+				for ( uint64_t rip = 0; rip < 8; ++rip )
+					for ( uint64_t cr3 = 0; cr3 < 2; ++cr3 ) {
+						HVAction expected = NONE, action = NONE;
+						bool found = reference( model, gfns[i], access, rip, cr3, expected );
+
+						CHECK( rules.match( gfns[i], access, rip, cr3, action ) == found );
+						CHECK( !found || action == expected );
+					}
+	}
+}
+
+} // end of anonymous namespace
+
+int main()
+{
+	std::srand( 1 );
+
+	testBasics();
+	testSegments();
+
+	return checkResult();
+}
@@ -0,0 +1,269 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+
+#include <bdvmi/eventhandler.h>
+#include <bdvmi/mockdriver.h>
+#include <bdvmi/mockeventmanager.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "check.h"
+
+using namespace bdvmi;
+
+namespace { // Anonymous namespace
+
+enum { EVENTS = 20000, VCPUS = 2 };
+
+// Bumps the VCPU's RAX through the driver on every event. With the events dispatched to
+// worker threads, a VCPU's events still have to be handled one at a time for none of the
+// increments to get lost.
+class CountingHandler : public EventHandler {
+
+public:
+	CountingHandler( Driver &driver ) : driver_( driver ), events_( 0 ), failures_( 0 )
+	{
+	}
+
+public:
+	virtual void handleCR( unsigned short vcpu, unsigned short, const RegistersView &, uint64_t, uint64_t,
+	                       HVAction & )
+	{
+		count( vcpu );
+	}
+
+	virtual void handleMSR( unsigned short, uint32_t, uint64_t, uint64_t, HVAction & )
+	{
+	}
+
+	virtual void handlePageFault( unsigned short vcpu, const RegistersView &, uint64_t, uint64_t, bool, bool, bool,
+	                              HVAction &, uint8_t *, uint32_t &, unsigned short & )
+	{
+		count( vcpu );
+	}
+
+	virtual void handleVMCALL( unsigned short vcpu, const RegistersView &, uint64_t, uint64_t )
+	{
+		count( vcpu );
+	}
+
+	virtual void handleXSETBV( unsigned short, uint64_t )
+	{
+	}
+
+	virtual void handleSessionOver( bool )
+	{
+	}
+
+public:
+	unsigned int events()
+	{
+		return __sync_fetch_and_add( &events_, 0 );
+	}
+
+	unsigned int failures()
+	{
+		return __sync_fetch_and_add( &failures_, 0 );
+	}
+
+private:
+	void count( unsigned short vcpu )
+	{
+		Registers regs;
+
+		__sync_fetch_and_add( &events_, 1 );
+
+		if ( !driver_.registers( vcpu, regs ) ) {
+			__sync_fetch_and_add( &failures_, 1 );
+			return;
+		}
+
+		++regs.rax;
+
+		if ( !driver_.setRegisters( vcpu, regs, false ) )
+			__sync_fetch_and_add( &failures_, 1 );
+	}
+
+private:
+	Driver &driver_;
+	unsigned int events_;
+	unsigned int failures_;
+};
+
+void testParallelDispatch()
+{
+	MockOptions options;
+
+	options.events = EVENTS;
+	options.vcpus = VCPUS;
+	options.crWrites = 3;
+	options.vmcalls = 3;
+
+	MockDriver driver( "parallel", options );
+	CountingHandler handler( driver );
+	uint64_t rax[VCPUS];
+
+	for ( unsigned short vcpu = 0; vcpu < VCPUS; ++vcpu ) {
+		Registers regs;
+
+		CHECK( driver.registers( vcpu, regs ) );
+		rax[vcpu] = regs.rax;
+	}
+
+	{
+		MockEventManager em( driver,
+		                     EventManager::ENABLE_CR | EventManager::ENABLE_MEMORY | EventManager::ENABLE_VMCALL );
+
+		em.handler( &handler );
+		em.parallelDispatch( 2 );
+		em.asyncEvents( EventManager::ENABLE_CR | EventManager::ENABLE_VMCALL );
+		em.waitForEvents();
+
+		CHECK( em.answered() == EVENTS );
+	}
+
+	// The guest's registers are only ours again once the (simulated) hypervisor is gone
+	uint64_t increments = 0;
+
+	for ( unsigned short vcpu = 0; vcpu < VCPUS; ++vcpu ) {
+		Registers regs;
+
+		CHECK( driver.registers( vcpu, regs ) );
+		increments += regs.rax - rax[vcpu];
+	}
+
+	CHECK( handler.events() == EVENTS );
+	CHECK( handler.failures() == 0 );
+	CHECK( increments == EVENTS );
+}
+
+/*
+ * A response deferred by the handler, then completed (from another thread) after stop(), with
+ * handlerDeadline() having answered the event long before: waitForEvents() has to wait for the
+ * token instead of finishing the session with it still out.
+ */
+class DeferringHandler : public EventHandler {
+
+public:
+	DeferringHandler( EventManager &em ) : em_( em ), token_( NULL ), deferred_( false ), completed_( 0 )
+	{
+	}
+
+public:
+	virtual void handleCR( unsigned short, unsigned short, const RegistersView &, uint64_t, uint64_t, HVAction & )
+	{
+		if ( deferred_ )
+			return;
+
+		deferred_ = true;
+		token_ = em_.deferResponse();
+
+		CHECK( token_ != NULL );
+		CHECK( pthread_create( &completer_, NULL, completerMain, this ) == 0 );
+
+		em_.stop();
+	}
+
+	virtual void handleMSR( unsigned short, uint32_t, uint64_t, uint64_t, HVAction & )
+	{
+	}
+
+	virtual void handlePageFault( unsigned short, const RegistersView &, uint64_t, uint64_t, bool, bool, bool,
+	                              HVAction &, uint8_t *, uint32_t &, unsigned short & )
+	{
+	}
+
+	virtual void handleVMCALL( unsigned short, const RegistersView &, uint64_t, uint64_t )
+	{
+	}
+
+	virtual void handleXSETBV( unsigned short, uint64_t )
+	{
+	}
+
+	virtual void handleSessionOver( bool )
+	{
+	}
+
+public:
+	bool deferred() const
+	{
+		return deferred_;
+	}
+
+	bool completed()
+	{
+		return __sync_fetch_and_add( &completed_, 0 ) != 0;
+	}
+
+	void join()
+	{
+		if ( deferred_ )
+			pthread_join( completer_, NULL );
+	}
+
+private:
+	static void *completerMain( void *arg )
+	{
+		DeferringHandler *self = static_cast<DeferringHandler *>( arg );
+
+		usleep( 200000 );
+
+		self->em_.completeResponse( self->token_, NONE );
+		__sync_lock_test_and_set( &self->completed_, 1 );
+
+		return NULL;
+	}
+
+private:
+	EventManager &em_;
+	EventManager::ResponseToken token_;
+	pthread_t completer_;
+	bool deferred_;
+	int completed_;
+};
+
+void testDeferredAfterStop()
+{
+	MockOptions options;
+
+	options.events = 100;
+	options.vcpus = VCPUS;
+	options.pageFaults = 0;
+	options.crWrites = 1;
+
+	MockDriver driver( "deferred", options );
+	MockEventManager em( driver, EventManager::ENABLE_CR );
+	DeferringHandler handler( em );
+
+	em.handler( &handler );
+	em.handlerDeadline( 1000, NONE );
+	em.waitForEvents();
+
+	CHECK( handler.deferred() );
+	CHECK( handler.completed() );
+
+	handler.join();
+}
+
+} // end of anonymous namespace
+
+int main()
+{
+	testParallelDispatch();
+	testDeferredAfterStop();
+
+	return checkResult();
+}
@@ -0,0 +1,172 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+
+#include <bdvmi/eventhandler.h>
+#include <bdvmi/exception.h>
+#include <bdvmi/mockdriver.h>
+#include <bdvmi/mockeventmanager.h>
+#include <bdvmi/replaydriver.h>
+#include <bdvmi/replayeventmanager.h>
+#include <sstream>
+#include <unistd.h>
+#include "check.h"
+
+using namespace bdvmi;
+
+namespace { // Anonymous namespace
+
+enum { EVENTS = 3000 };
+
+const unsigned short flags = EventManager::ENABLE_CR | EventManager::ENABLE_MEMORY | EventManager::ENABLE_VMCALL;
+
+// Counts the events and, when replaying, checks that what the driver says the VCPU's registers
+// are matches the request being handled
+class Handler : public EventHandler {
+
+public:
+	Handler( Driver *driver = NULL ) : driver_( driver ), events_( 0 ), mismatches_( 0 )
+	{
+	}
+
+public:
+	virtual void handleCR( unsigned short vcpu, unsigned short, const RegistersView &regs, uint64_t, uint64_t,
+	                       HVAction & )
+	{
+		check( vcpu, regs );
+	}
+
+	virtual void handleMSR( unsigned short, uint32_t, uint64_t, uint64_t, HVAction & )
+	{
+		++events_;
+	}
+
+	virtual void handlePageFault( unsigned short vcpu, const RegistersView &regs, uint64_t, uint64_t, bool, bool,
+	                              bool, HVAction &, uint8_t *, uint32_t &, unsigned short & )
+	{
+		check( vcpu, regs );
+	}
+
+	virtual void handleVMCALL( unsigned short vcpu, const RegistersView &regs, uint64_t, uint64_t )
+	{
+		check( vcpu, regs );
+	}
+
+	virtual void handleXSETBV( unsigned short, uint64_t )
+	{
+		++events_;
+	}
+
+	virtual void handleSessionOver( bool )
+	{
+	}
+
+public:
+	unsigned int events() const
+	{
+		return events_;
+	}
+
+	unsigned int mismatches() const
+	{
+		return mismatches_;
+	}
+
+private:
+	void check( unsigned short vcpu, const RegistersView &regs )
+	{
+		++events_;
+
+		if ( !driver_ )
+			return;
+
+		Registers current;
+
+		if ( !driver_->registers( vcpu, current ) || current.rip != regs.rip() || current.cr3 != regs.cr3() ||
+		     current.rsp != regs.rsp() )
+			++mismatches_;
+	}
+
+private:
+	Driver *driver_;
+	unsigned int events_;
+	unsigned int mismatches_;
+};
+
+// A mock session with sync page faults and async CR writes and VMCALLs on two VCPUs, the
+// async requests piling up while the VCPUs keep running
+void record( const std::string &trace )
+{
+	MockOptions options;
+
+	options.events = EVENTS;
+	options.vcpus = 2;
+	options.crWrites = 3;
+	options.vmcalls = 3;
+
+	MockDriver driver( "record", options );
+	MockEventManager em( driver, flags );
+	Handler handler;
+
+	em.handler( &handler );
+	em.asyncEvents( EventManager::ENABLE_CR | EventManager::ENABLE_VMCALL );
+	em.traceEvents( trace );
+	em.waitForEvents();
+
+	CHECK( em.answered() == EVENTS );
+	CHECK( handler.events() == EVENTS );
+}
+
+void replay( const std::string &trace )
+{
+	ReplayOptions options;
+
+	options.trace = trace;
+
+	ReplayDriver driver( trace, options );
+	ReplayEventManager em( driver, flags );
+	Handler handler( &driver );
+
+	em.handler( &handler );
+	em.waitForEvents();
+
+	CHECK( em.replayed() == EVENTS );
+	CHECK( handler.events() == EVENTS );
+	// The driver's view of the registers is the request's, async ones included
+	CHECK( handler.mismatches() == 0 );
+	// Same handler, same answers
+	CHECK( em.mismatches() == 0 );
+}
+
+} // end of anonymous namespace
+
+int main()
+{
+	std::ostringstream trace;
+
+	trace << "replay." << getpid() << ".tmp";
+
+	try {
+		record( trace.str() );
+		replay( trace.str() );
+	} catch ( const std::exception &e ) {
+		std::fprintf( stderr, "%s\n", e.what() );
+		checkFailed( __FILE__, __LINE__, "no exceptions" );
+	}
+
+	unlink( trace.str().c_str() );
+
+	return checkResult();
+}
@@ -0,0 +1,140 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+
+#include <bdvmi/statspage.h>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include "check.h"
+
+using namespace bdvmi;
+
+namespace { // Anonymous namespace
+
+enum { SLOTS = 4, PUBLISHES = 200000 };
+
+int writerDone = 0;
+
+// Publishes n in all the values, for n = 1 .. PUBLISHES
+void *writerMain( void *arg )
+{
+	StatsSlot *slot = static_cast<StatsSlot *>( arg );
+	uint64_t values[StatsSlot::VALUES];
+
+	for ( uint64_t n = 1; n <= PUBLISHES; ++n ) {
+		for ( unsigned int i = 0; i < StatsSlot::VALUES; ++i )
+			values[i] = n;
+
+		StatsPage::publish( slot, values, StatsSlot::VALUES );
+	}
+
+	__sync_lock_test_and_set( &writerDone, 1 );
+
+	return NULL;
+}
+
+void testSeqlock( StatsPageReader &reader, StatsSlot *slot, unsigned int index )
+{
+	pthread_t writer;
+	uint64_t last = 0;
+	unsigned int reads = 0, torn = 0;
+
+	CHECK( pthread_create( &writer, NULL, writerMain, slot ) == 0 );
+
+	while ( !__sync_fetch_and_add( &writerDone, 0 ) ) {
+		StatsSlot copy;
+
+		if ( !reader.read( index, copy ) )
+			continue;
+
+		++reads;
+
+		for ( unsigned int i = 1; i < StatsSlot::VALUES; ++i )
+			if ( copy.values[i] != copy.values[0] )
+				++torn;
+
+		CHECK( copy.values[0] >= last );
+		CHECK( copy.sequence % 2 == 0 );
+		last = copy.values[0];
+	}
+
+	pthread_join( writer, NULL );
+
+	StatsSlot copy;
+
+	CHECK( reads > 0 );
+	CHECK( torn == 0 );
+	CHECK( reader.read( index, copy ) && copy.values[0] == PUBLISHES && copy.values[StatsSlot::VALUES - 1] == PUBLISHES );
+}
+
+} // end of anonymous namespace
+
+int main()
+{
+	StatsPageReader reader;
+	StatsSlot copy;
+
+	CHECK( !StatsPage::enabled() );
+	CHECK( StatsPage::acquire( StatsSlot::EVENT_MANAGER, "off" ) == NULL );
+	CHECK( !reader.attach( getpid() ) );
+
+	if ( !StatsPage::open( SLOTS ) ) {
+		checkFailed( __FILE__, __LINE__, "StatsPage::open()" );
+		return checkResult();
+	}
+
+	CHECK( StatsPage::enabled() );
+	CHECK( reader.attach( getpid() ) );
+	CHECK( reader.slots() == SLOTS );
+
+	for ( unsigned int i = 0; i < SLOTS; ++i )
+		CHECK( !reader.read( i, copy ) );
+
+	CHECK( !reader.read( SLOTS, copy ) );
+
+	StatsSlot *slots[SLOTS];
+
+	for ( unsigned int i = 0; i < SLOTS; ++i ) {
+		slots[i] = StatsPage::acquire( StatsSlot::DRIVER, "driver" );
+		CHECK( slots[i] != NULL );
+	}
+
+	// Full
+	CHECK( StatsPage::acquire( StatsSlot::DRIVER, "driver" ) == NULL );
+
+	StatsPage::release( slots[1] );
+	CHECK( !reader.read( 1, copy ) );
+
+	slots[1] = StatsPage::acquire( StatsSlot::EVENT_MANAGER, "a name that doesn't fit in the slot, not by a long shot" );
+	CHECK( slots[1] != NULL );
+	CHECK( reader.read( 1, copy ) );
+	CHECK( copy.kind == StatsSlot::EVENT_MANAGER );
+	CHECK( strlen( copy.name ) == StatsSlot::NAME_SIZE - 1 );
+	CHECK( copy.values[0] == 0 && copy.updated != 0 );
+
+	testSeqlock( reader, slots[1], 1 );
+
+	for ( unsigned int i = 0; i < SLOTS; ++i )
+		StatsPage::release( slots[i] );
+
+	StatsPage::close();
+
+	CHECK( !StatsPage::enabled() );
+	CHECK( StatsPage::acquire( StatsSlot::DRIVER, "closed" ) == NULL );
+	CHECK( !reader.attach( getpid() ) );
+
+	return checkResult();
+}
@@ -0,0 +1,214 @@
+// Copyright (c) 2015 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+#include <bdvmi/statspage.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+ * Watch the counters a libbdvmi application publishes in its stats page (see
+ * bdvmi::StatsPage). Without a pid, lists the stats pages around and whether their processes
+ * are still alive. With one, prints every slot, once or every -i milliseconds, along with the
+ * per-second rates of the counters since the previous sample.
+ */
+
+namespace { // Anonymous namespace
+
+const char SHM_DIR[] = "/dev/shm";
+const char SHM_PREFIX[] = "bdvmi-stats.";
+
+uint64_t nowNs()
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return static_cast<uint64_t>( ts.tv_sec ) * 1000000000ULL + ts.tv_nsec;
+}
+
+bool alive( pid_t pid )
+{
+	return kill( pid, 0 ) == 0 || errno == EPERM;
+}
+
+int list()
+{
+	DIR *dir = opendir( SHM_DIR );
+
+	if ( !dir ) {
+		cerr << "Could not open " << SHM_DIR << ": " << strerror( errno ) << endl;
+		return -1;
+	}
+
+	struct dirent *entry;
+	unsigned int found = 0;
+
+	while ( ( entry = readdir( dir ) ) != NULL ) {
+		if ( strncmp( entry->d_name, SHM_PREFIX, sizeof( SHM_PREFIX ) - 1 ) != 0 )
+			continue;
+
+		pid_t pid = atoi( entry->d_name + sizeof( SHM_PREFIX ) - 1 );
+
+		if ( pid <= 0 )
+			continue;
+
+		bdvmi::StatsPageReader reader;
+		unsigned int used = 0;
+
+		if ( reader.attach( pid ) ) {
+			bdvmi::StatsSlot slot;
+
+			for ( unsigned int i = 0; i < reader.slots(); ++i )
+				if ( reader.read( i, slot ) )
+					++used;
+		}
+
+		printf( "%8d  %3u slot(s)%s\n", pid, used, alive( pid ) ? "" : "  (stale, process is gone)" );
+		++found;
+	}
+
+	closedir( dir );
+
+	if ( !found )
+		cout << "No stats pages (libbdvmi applications need to call bdvmi::StatsPage::open())" << endl;
+
+	return 0;
+}
+
+// A slot's previous sample is only good for rates if it's still the same component
+bool sameComponent( const bdvmi::StatsSlot &a, const bdvmi::StatsSlot &b )
+{
+	return a.kind == b.kind && strcmp( a.name, b.name ) == 0;
+}
+
+void show( const bdvmi::StatsPageReader &reader, vector<bdvmi::StatsSlot> &previous, vector<bool> &valid )
+{
+	uint64_t now = nowNs();
+
+	previous.resize( reader.slots() );
+	valid.resize( reader.slots(), false );
+
+	for ( unsigned int i = 0; i < reader.slots(); ++i ) {
+		bdvmi::StatsSlot slot;
+
+		if ( !reader.read( i, slot ) ) {
+			valid[i] = false;
+			continue;
+		}
+
+		const char *kind = bdvmi::StatsPage::kindName( slot.kind );
+		uint64_t age = now > slot.updated ? now - slot.updated : 0;
+
+		printf( "[%u] %s \"%s\", updated %llu ms ago\n", i, kind ? kind : "unknown", slot.name,
+		        static_cast<unsigned long long>( age / 1000000 ) );
+
+		bool rates = valid[i] && sameComponent( slot, previous[i] ) && slot.updated > previous[i].updated;
+		double seconds = rates ? ( slot.updated - previous[i].updated ) / 1e9 : 0;
+
+		for ( unsigned int j = 0; j < bdvmi::StatsSlot::VALUES; ++j ) {
+			const char *name = bdvmi::StatsPage::valueName( slot.kind, j );
+
+			if ( !name )
+				continue;
+
+			printf( "    %-20s %20llu", name, static_cast<unsigned long long>( slot.values[j] ) );
+
+			if ( rates && bdvmi::StatsPage::valueIsCounter( slot.kind, j ) &&
+			     slot.values[j] >= previous[i].values[j] )
+				printf( "  %14.1f/s", ( slot.values[j] - previous[i].values[j] ) / seconds );
+
+			printf( "\n" );
+		}
+
+		previous[i] = slot;
+		valid[i] = true;
+	}
+
+	fflush( stdout );
+}
+
+void usage( const char *name )
+{
+	cerr << "Usage: " << name << " [-i interval_ms] [-n count] [pid]" << endl
+	     << "  without a pid, list the stats pages of the running libbdvmi applications" << endl;
+}
+
+} // end of anonymous namespace
+
+int main( int argc, char *argv[] )
+{
+	unsigned long intervalMs = 0;
+	unsigned long count = 0;
+	int opt;
+
+	while ( ( opt = getopt( argc, argv, "i:n:" ) ) != -1 ) {
+		switch ( opt ) {
+			case 'i':
+				intervalMs = strtoul( optarg, NULL, 10 );
+				break;
+			case 'n':
+				count = strtoul( optarg, NULL, 10 );
+				break;
+			default:
+				usage( argv[0] );
+				return -1;
+		}
+	}
+
+	if ( optind == argc )
+		return list();
+
+	if ( optind + 1 != argc ) {
+		usage( argv[0] );
+		return -1;
+	}
+
+	pid_t pid = atoi( argv[optind] );
+	bdvmi::StatsPageReader reader;
+
+	if ( pid <= 0 || !reader.attach( pid ) ) {
+		cerr << "No stats page for pid " << argv[optind] << endl;
+		return -1;
+	}
+
+	vector<bdvmi::StatsSlot> previous;
+	vector<bool> valid;
+
+	for ( unsigned long samples = 1;; ++samples ) {
+		show( reader, previous, valid );
+
+		if ( !intervalMs || ( count && samples >= count ) )
+			break;
+
+		if ( !alive( pid ) ) {
+			cerr << "Process " << pid << " is gone" << endl;
+			break;
+		}
+
+		usleep( intervalMs * 1000 );
+		printf( "\n" );
+	}
+
+	return 0;
+}